@@ -5,303 +5,3058 @@
  *   brew install tokyo-cabinet
  * 
  * コンパイル:
- *   gcc -O3 -o bench_vs bench_vs.c -I/usr/local/include -L/usr/local/lib -ltokyocabinet -lm
+ *   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build
+ *   （本体は kvm.c / kvm.h の libkvm。変種・LTO・PGO のターゲットは CMakeLists.txt）
+ *   手で作るなら:
+ *   gcc -O3 -o bench_vs bench_vs.c kvm.c -I/usr/local/include -L/usr/local/lib -ltokyocabinet -lm -lpthread
+ *   （-DKVM_OFF64 で索引の参照を 64bit にした版になる）
+ *   （比べる相手に LMDB / LevelDB / RocksDB も入れるなら -DBENCH_LMDB -llmdb、
+ *    -DBENCH_LEVELDB -lleveldb か -DBENCH_ROCKSDB -lrocksdb を足す）
  * 
  * 実行:
- *   ./bench_vs [件数(デフォルト:100000)]
+ *   ./bench_vs [件数(デフォルト:100000)] [-t スレッド数] [--read-ratio 読みの割合]
+ *              [--sample n] [--hist-csv ファイル] [--perf]
+ *              [--workload A..F|all] [--ops n] [--dist 分布] [--theta θ] [--value-size 長さ]
+ *              [--tier] [--engines 名前,…|all]
+ *   （エンジンは ENGINE の口を通して同じ手順で流す。既定は tc,tcb,kvm,kvm-line,hash と
+ *    組み込んだ LMDB など。--engines で選んだ順に表の列になる）
+ *   （-t を付けると 1, 2, 4, … スレッドで読み書きを混ぜた負荷もかける。0 なら CPU 数まで。
+ *    スレッドは CPU に固定し、NUMA ノードごとの ops/sec も出す）
+ *   （Write / Seq / Rand / Miss は n 回に1回の操作のレイテンシ分布も出す。既定は 8）
+ *   （--perf を付けるとフェーズごとに cycles や LLC / dTLB ミスなどを 1 操作あたりで出す）
+ *   （--workload を付けると YCSB 風の A〜F を zipf などのキー分布と可変長の値で流す）
+ *   （値の圧縮は HDBTDEFLATE と KVMTLZ / kvm_setdict の辞書つきを比べる）
+ *   （全件の書き出しは書き手を回したまま tchdbcopy と kvm_snapshot を比べる）
+ *   （--tier を付けると値を別ファイルに置く KVMTTIER をキャッシュの大きさを変えて測る）
+ *   （併せて kvm_get_async で値の読みを io_uring に重ねた時をキューの深さごとに測る）
+ *   （KVMTCACHE は上限を決めた領域を古い順に上書きする。キャッシュとしての当たり率も測る）
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <sys/mman.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include <tcutil.h>
 #include <tchdb.h>
+#include <tcbdb.h>
+#ifdef BENCH_LMDB
+#include <lmdb.h>
+#endif
+#ifdef BENCH_ROCKSDB
+#include <rocksdb/c.h>
+#elif defined(BENCH_LEVELDB)
+#include <leveldb/c.h>
+#endif
+#include "kvm.h"
 
-/* ========== 自作KVM ========== */
-#define BUCKET_COUNT (8 * 1024)
-#define BLOOM_SIZE (1 << 20)
-#define POOL_SIZE (64 * 1024 * 1024)  /* 64MB（ローカルなので大きめ） */
+/* ========== ベンチマーク ========== */
+double now_sec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void print_result(const char *name, const char *op, int n, double time) {
+    printf("  %-12s | %-10s | %12.2f ops/sec | %.4f sec\n", name, op, n / time, time);
+}
+
+/* 1操作ごとのレイテンシ（ns）を HDR 風の対数バケットに数える。2 の冪ごとに
+ * 2^HIST_SUB_BITS 個に刻むので、どの値でも誤差は 1/16 以内 */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t n, max;
+} HIST;
+
+static int hist_mask;           /* hist_mask + 1 回に1回だけ測る（--sample） */
+static FILE *hist_csv;          /* --hist-csv の出力先 */
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* バケットに入る最小の値 */
+static uint64_t hist_low(int i) {
+    if (i < HIST_SUB) return i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static inline void hist_add(HIST *h, uint64_t v) {
+    h->count[hist_index(v)]++;
+    h->n++;
+    if (v > h->max) h->max = v;
+}
+
+/* p（0〜1）分位点。入ったバケットの上端を返す */
+static uint64_t hist_pct(const HIST *h, double p) {
+    uint64_t want = (uint64_t)ceil(p * h->n), acc = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        acc += h->count[i];
+        if (acc >= want && acc) {
+            uint64_t hi = i + 1 < HIST_BUCKETS ? hist_low(i + 1) - 1 : UINT64_MAX;
+            return hi < h->max ? hi : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* ループの i 回目が測る回なら stmt を時間を測って実行する */
+#define TIMED(h, i, stmt) do { \
+    if (((i) & hist_mask) == 0) { uint64_t t_ = now_ns(); stmt; hist_add((h), now_ns() - t_); } \
+    else { stmt; } \
+} while (0)
+
+static void print_latency(const char *name, const char *const *ops, const HIST *hs, int n) {
+    printf("  %-12s | %-10s | %8s %8s %8s %8s %8s (ns, 1/%d sampled)\n", name, "Latency",
+           "p50", "p90", "p99", "p99.9", "max", hist_mask + 1);
+    for (int p = 0; p < n; p++) {
+        const HIST *h = &hs[p];
+        if (!h->n) continue;
+        printf("  %-12s | %-10s | %8llu %8llu %8llu %8llu %8llu\n", name, ops[p],
+               (unsigned long long)hist_pct(h, 0.5), (unsigned long long)hist_pct(h, 0.9),
+               (unsigned long long)hist_pct(h, 0.99), (unsigned long long)hist_pct(h, 0.999),
+               (unsigned long long)h->max);
+        if (hist_csv)
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                if (h->count[i])
+                    fprintf(hist_csv, "%s,%s,%llu,%llu,%llu\n", name, ops[p],
+                            (unsigned long long)hist_low(i),
+                            (unsigned long long)(i + 1 < HIST_BUCKETS ? hist_low(i + 1) - 1 : UINT64_MAX),
+                            (unsigned long long)h->count[i]);
+    }
+}
+
+/* ========== ハードウェアカウンタ（--perf） ========== */
+/* perf_event_open でフェーズごとに cycles / instructions / LLC・dTLB の read miss /
+ * 分岐予測ミスを数える。数えるのは呼んだスレッドだけで、コンパクションや
+ * シャードのワーカの分は入らない。カウンタが足りず多重化されたときは
+ * 動いていた時間の割合で引き伸ばす */
+enum { PC_CYCLES, PC_INSNS, PC_LLC, PC_DTLB, PC_BRMISS, NPERF };
+
+typedef struct {
+    double v[NPERF];
+    int valid;
+} PERFC;
+
+static int perf_on;
+static int perf_fd[NPERF] = { -1, -1, -1, -1, -1 };
+
+#ifdef __linux__
+static int perf_open1(uint32_t type, uint64_t config) {
+    struct perf_event_attr pa;
+    memset(&pa, 0, sizeof(pa));
+    pa.size = sizeof(pa);
+    pa.type = type;
+    pa.config = config;
+    pa.disabled = 1;
+    pa.exclude_kernel = 1;
+    pa.exclude_hv = 1;
+    pa.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &pa, 0, -1, -1, 0);
+}
+
+#define PERF_CACHE_MISS(c) \
+    ((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* 開けなかったカウンタは -1 のまま。cycles すら無ければ使わない */
+static int perf_init(void) {
+    perf_fd[PC_CYCLES] = perf_open1(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    if (perf_fd[PC_CYCLES] < 0) return -1;
+    perf_fd[PC_INSNS] = perf_open1(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf_fd[PC_LLC] = perf_open1(PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL));
+    perf_fd[PC_DTLB] = perf_open1(PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB));
+    perf_fd[PC_BRMISS] = perf_open1(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    perf_on = 1;
+    return 0;
+}
+
+static void perf_begin(void) {
+    if (!perf_on) return;
+    for (int i = 0; i < NPERF; i++)
+        if (perf_fd[i] >= 0) {
+            ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+static void perf_end(PERFC *c) {
+    if (!perf_on) return;
+    for (int i = 0; i < NPERF; i++) {
+        uint64_t r[3];
+        c->v[i] = -1;
+        if (perf_fd[i] < 0) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd[i], r, sizeof(r)) != sizeof(r) || !r[2]) continue;
+        c->v[i] = (double)r[0] * r[1] / r[2];
+    }
+    c->valid = 1;
+}
+
+static void perf_fini(void) {
+    for (int i = 0; i < NPERF; i++)
+        if (perf_fd[i] >= 0) close(perf_fd[i]);
+}
+#else
+static int perf_init(void) { return -1; }
+static void perf_begin(void) {}
+static void perf_end(PERFC *c) { (void)c; }
+static void perf_fini(void) {}
+#endif
+
+/* 1 操作あたりの値。取れなかったカウンタは "-" */
+static void print_counters(const char *name, const char *const *ops, const double *t,
+                           const PERFC *pc, int n, int N) {
+    if (!perf_on) return;
+    printf("  %-12s | %-10s | %10s %8s %8s %5s %8s %8s %8s (per op)\n", name, "Counters",
+           "ops/sec", "cycles", "insns", "IPC", "LLC-miss", "dTLB-mis", "br-miss");
+    for (int p = 0; p < n; p++) {
+        const PERFC *c = &pc[p];
+        if (!c->valid || t[p] <= 0) continue;
+        char col[NPERF][16], ipc[16];
+        for (int i = 0; i < NPERF; i++) {
+            if (c->v[i] < 0) strcpy(col[i], "-");
+            else snprintf(col[i], sizeof(col[i]), i <= PC_INSNS ? "%.0f" : "%.3f", c->v[i] / N);
+        }
+        if (c->v[PC_CYCLES] > 0 && c->v[PC_INSNS] >= 0)
+            snprintf(ipc, sizeof(ipc), "%.2f", c->v[PC_INSNS] / c->v[PC_CYCLES]);
+        else strcpy(ipc, "-");
+        printf("  %-12s | %-10s | %10.0f %8s %8s %5s %8s %8s %8s\n", name, ops[p], N / t[p],
+               col[PC_CYCLES], col[PC_INSNS], ipc, col[PC_LLC], col[PC_DTLB], col[PC_BRMISS]);
+    }
+}
+
+/* ========== ワークロード生成 ========== */
+#define YCSB_VMAX (1 << 20)     /* 値の長さの上限（--value-size） */
+#define YCSB_SCAN_MAX 100       /* workload E の走査件数は 1〜これ */
+
+/* 乱数は xoshiro256**（splitmix64 で種を広げる）。libc の rand() より速く、
+ * 同じ種なら TC と自作KVM にまったく同じ列を流せる */
+typedef struct { uint64_t s[4]; } RNG;
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static void rng_seed(RNG *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = mix64(seed += 0x9e3779b97f4a7c15ull);
+}
+
+static inline uint64_t rng_next(RNG *r) {
+    uint64_t *s = r->s, res = rng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+    s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return res;
+}
+
+/* [0, n) の一様乱数（掛け算で縮める。剰余より速い） */
+static inline uint64_t rng_below(RNG *r, uint64_t n) {
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((__uint128_t)rng_next(r) * n) >> 64);
+#else
+    return rng_next(r) % n;
+#endif
+}
+
+static inline double rng_double(RNG *r) {
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* キーの選び方。zipf は YCSB と同じ Gray らの方法で、順位をハッシュで散らして
+ * 人気のキーが固まらないようにする。latest は新しく入れたキーほど選ばれやすい zipf。
+ * hotspot は hot_frac のキーに hot_ops の操作が集まる */
+enum { KD_UNIFORM, KD_ZIPF, KD_LATEST, KD_HOTSPOT };
+static const char *keydist_name[] = { "uniform", "zipf", "latest", "hotspot" };
+
+typedef struct {
+    int kind;
+    uint64_t n;             /* いまのキー数（insert で増える） */
+    double theta;
+    double zetan, zeta2, alpha, eta;
+    uint64_t zeta_n;        /* zetan を足し込んだキー数 */
+    double hot_frac, hot_ops;
+} KEYDIST;
+
+static void zipf_update(KEYDIST *d) {
+    for (uint64_t i = d->zeta_n; i < d->n; i++) d->zetan += 1.0 / pow((double)(i + 1), d->theta);
+    d->zeta_n = d->n;
+    d->eta = (1 - pow(2.0 / d->n, 1 - d->theta)) / (1 - d->zeta2 / d->zetan);
+}
+
+static void keydist_init(KEYDIST *d, int kind, uint64_t n, double theta) {
+    memset(d, 0, sizeof(*d));
+    d->kind = kind;
+    d->n = n > 0 ? n : 1;
+    d->theta = theta;
+    d->zeta2 = 1 + pow(0.5, theta);
+    d->alpha = 1 / (1 - theta);
+    d->hot_frac = 0.2;
+    d->hot_ops = 0.8;
+    if (kind == KD_ZIPF || kind == KD_LATEST) zipf_update(d);
+}
+
+/* 0 が一番人気の順位 */
+static uint64_t zipf_rank(KEYDIST *d, RNG *r) {
+    if (d->zeta_n != d->n) zipf_update(d);
+    double u = rng_double(r), uz = u * d->zetan;
+    if (uz < 1) return 0;
+    if (uz < d->zeta2) return d->n > 1;
+    uint64_t k = (uint64_t)(d->n * pow(d->eta * u - d->eta + 1, d->alpha));
+    return k < d->n ? k : d->n - 1;
+}
+
+static uint64_t keydist_next(KEYDIST *d, RNG *r) {
+    switch (d->kind) {
+    case KD_ZIPF: return mix64(zipf_rank(d, r)) % d->n;
+    case KD_LATEST: return d->n - 1 - zipf_rank(d, r);
+    case KD_HOTSPOT: {
+        uint64_t hot = (uint64_t)(d->n * d->hot_frac);
+        if (hot < 1) hot = 1;
+        if (hot >= d->n || rng_double(r) < d->hot_ops) return rng_below(r, hot);
+        return hot + rng_below(r, d->n - hot);
+    }
+    default: return rng_below(r, d->n);
+    }
+}
+
+/* 値の長さ。"n" は固定、"lo-hi" は一様、"lo~hi" は対数一様（小さい値が多く長い裾を持つ） */
+typedef struct {
+    uint32_t lo, hi;
+    int log;
+} VALDIST;
+
+static int valdist_parse(VALDIST *v, const char *s) {
+    unsigned lo, hi;
+    char sep;
+    int n = sscanf(s, "%u%c%u", &lo, &sep, &hi);
+    if (n == 1) { v->lo = v->hi = lo; v->log = 0; }
+    else if (n == 3 && (sep == '-' || sep == '~') && lo <= hi) { v->lo = lo; v->hi = hi; v->log = sep == '~'; }
+    else return -1;
+    return v->lo > 0 && v->hi <= YCSB_VMAX ? 0 : -1;
+}
+
+static uint32_t valdist_next(const VALDIST *v, RNG *r) {
+    if (v->lo == v->hi) return v->lo;
+    if (v->log) {
+        uint32_t x = (uint32_t)exp(log(v->lo) + rng_double(r) * (log(v->hi + 1.0) - log(v->lo)));
+        return x < v->lo ? v->lo : x > v->hi ? v->hi : x;
+    }
+    return v->lo + (uint32_t)rng_below(r, v->hi - v->lo + 1);
+}
+
+#define SHARD_MAX 16            /* ベンチで使うシャード数の上限 */
+#define MGET_CHUNK 64           /* ベンチで mget に一度に渡すキー数 */
+#define ENGINE_MAX 16           /* 一度に比べるエンジンの数の上限 */
+
+/* kvm_scan / kvm_foreach に渡す。値の先頭バイトを足して読みを捨てさせない */
+static int scan_count(const char *kbuf, uint32_t klen, const char *vbuf, uint32_t vlen, void *op) {
+    (void)kbuf; (void)klen;
+    *(size_t*)op += vlen ? (uint8_t)vbuf[0] : 1;
+    return 1;
+}
+
+enum { PH_WRITE, PH_SEQ, PH_RAND, PH_VIEW, PH_INTO, PH_MGET, PH_MISS, PH_UPDATE, PH_ITER, PH_COMPACT, PH_DELETE, PH_BULK, PH_SHARD, NPHASE };
+static const char *phase_name[NPHASE] = {
+    "Write", "Seq Read", "Rand Read", "Rand View", "Rand Into", "MGet Rand", "Miss Read", "Update", "Iterate", "Compact", "Delete", "Bulk Load", "Shard Load"
+};
+
+/* ========== エンジン ========== */
+/* 共通のフェーズ（bench_engine）・マルチスレッド・YCSB を、どのエンジンにも同じ手順で
+ * 流すための口。db は各エンジンの持ち物で、キーと値は (ポインタ, 長さ) で渡す。
+ * 無い操作は NULL にしておくと、共通の手順（get を回す・put を回すなど）で代えるか、
+ * そのフェーズを "-" にする */
+enum {
+    BK_OWN = 1 << 0,        /* 自作KVM の一族（総合結果で勝ち負けを数える側） */
+    BK_MT = 1 << 1,         /* 複数のスレッドから同時に呼べる */
+    BK_ORDER = 1 << 2,      /* open に渡すとキー順の range が使える */
+    BK_EXTRA = 1 << 3,      /* --engines で名前を挙げた時（か all）だけ流す */
+    BK_REF = 1 << 4         /* 目安として表に出すだけで、勝者や総合結果には数えない */
+};
+
+typedef struct ENGINE ENGINE;
+struct ENGINE {
+    const char *id;         /* --engines で選ぶ名前 */
+    const char *name;       /* 表の列の名前 */
+    const char *title;      /* >>> の見出し */
+    int flags;              /* BK_* */
+    int opts;               /* 自作KVM の KVMT* など、open が使う */
+    void *(*open)(const ENGINE *e, int n, int mode);   /* n 件ほど入る空の DB。mode は BK_ORDER */
+    void (*close)(void *db);                           /* 閉じてファイルも消す */
+    int (*reopen)(void *db);
+    int (*sync)(void *db);
+    int (*put)(void *db, const char *k, int ks, const char *v, int vs);
+    char *(*get)(void *db, const char *k, int ks, int *sp);                 /* malloc した値 */
+    int (*view)(void *db, const char *k, int ks, const char **vp, int *sp); /* コピーしない */
+    int (*into)(void *db, const char *k, int ks, char *buf, int max);       /* 値の長さか -1 */
+    void (*mget)(void *db, const char **keys, int n, char **out);           /* keys は NUL 終わり */
+    int (*out)(void *db, const char *k, int ks);
+    int64_t (*iterate)(void *db, size_t *sum);                              /* 全件を辿った数 */
+    int64_t (*range)(void *db, const char *k, int ks, int n, size_t *sum);  /* k から n 件 */
+    int (*compact)(void *db);                   /* compact_wait があれば始めるだけ */
+    int (*compact_wait)(void *db, int *busy);   /* busy にはまだ動いていたかを返す */
+    int (*bulk)(void *db, const KVMREC *recs, int n);
+    void *(*shard)(const ENGINE *e, const KVMREC *recs, int n);  /* シャードに分けて並行に書く */
+    void (*shard_close)(const ENGINE *e, void *s);  /* 数字を出して閉じ、ファイルも消す */
+    void (*report)(void *db, int ph, int n);    /* フェーズの後にエンジン固有の数字を出す */
+};
+
+/* range の数え方。値の先頭バイトを足しながら left 件で止める */
+typedef struct {
+    int left;
+    size_t sum;
+} RANGE;
+
+static int range_cb(const char *kbuf, uint32_t klen, const char *vbuf, uint32_t vlen, void *op) {
+    RANGE *r = op;
+    (void)kbuf; (void)klen;
+    r->sum += vlen ? (uint8_t)vbuf[0] : 1;
+    return --r->left > 0;
+}
+
+/* ---------- Tokyo Cabinet (Hash DB) ---------- */
+static void tch_fail(TCHDB *hdb, const char *what) {
+    printf("Tokyo Cabinet %s error: %s\n", what, tchdberrmsg(tchdbecode(hdb)));
+    exit(1);
+}
+
+static void *tch_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    remove("bench_tc.tch");
+    TCHDB *hdb = tchdbnew();
+    tchdbsetmutex(hdb);
+    tchdbtune(hdb, (int64_t)n * 2, -1, -1, HDBTLARGE);  /* バケット数調整 */
+    if (!tchdbopen(hdb, "bench_tc.tch", HDBOWRITER | HDBOCREAT | HDBOTRUNC)) tch_fail(hdb, "open");
+    return hdb;
+}
+
+static void tch_close(void *db) {
+    tchdbclose(db);
+    tchdbdel(db);
+    remove("bench_tc.tch");
+}
+
+static int tch_reopen(void *db) {
+    return tchdbclose(db) && tchdbopen(db, "bench_tc.tch", HDBOWRITER) ? 0 : -1;
+}
+
+static int tch_sync(void *db) { return tchdbsync(db) ? 0 : -1; }
+
+static int tch_put(void *db, const char *k, int ks, const char *v, int vs) {
+    return tchdbput(db, k, ks, v, vs) ? 0 : -1;
+}
+
+static char *tch_get(void *db, const char *k, int ks, int *sp) { return tchdbget(db, k, ks, sp); }
+
+static int tch_into(void *db, const char *k, int ks, char *buf, int max) {
+    return tchdbget3(db, k, ks, buf, max);
+}
+
+static int tch_out(void *db, const char *k, int ks) { return tchdbout(db, k, ks) ? 0 : -1; }
+
+static int64_t tch_iterate(void *db, size_t *sum) {
+    TCXSTR *k = tcxstrnew(), *v = tcxstrnew();
+    int64_t n = 0;
+    tchdbiterinit(db);
+    for (; tchdbiternext3(db, k, v); n++)
+        *sum += tcxstrsize(k) + (tcxstrsize(v) ? (uint8_t)*(const char*)tcxstrptr(v) : 0);
+    tcxstrdel(k);
+    tcxstrdel(v);
+    return n;
+}
+
+/* tchdboptimize は終わるまで他の操作を止める */
+static int tch_compact(void *db) { return tchdboptimize(db, -1, -1, -1, UINT8_MAX) ? 0 : -1; }
+
+/* 一括投入の API は無いので tchdbputasync で入れる */
+static int tch_bulk(void *db, const KVMREC *recs, int n) {
+    for (int i = 0; i < n; i++)
+        if (!tchdbputasync(db, recs[i].kbuf, recs[i].klen, recs[i].vbuf, recs[i].vlen)) return -1;
+    return 0;
+}
+
+static void tch_report(void *db, int ph, int n) {
+    (void)n;
+    if (ph == PH_MISS) printf("  File size: %.2f MB\n", tchdbfsiz(db) / (1024.0 * 1024.0));
+}
+
+/* ---------- Tokyo Cabinet (B+tree) ---------- */
+static void tcb_fail(TCBDB *bdb, const char *what) {
+    printf("Tokyo Cabinet %s error: %s\n", what, tcbdberrmsg(tcbdbecode(bdb)));
+    exit(1);
+}
+
+static void *tcb_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    remove("bench_tc.tcb");
+    TCBDB *bdb = tcbdbnew();
+    tcbdbsetmutex(bdb);
+    tcbdbtune(bdb, 0, 0, n / 64 + 1, -1, -1, BDBTLARGE);
+    if (!tcbdbopen(bdb, "bench_tc.tcb", BDBOWRITER | BDBOCREAT | BDBOTRUNC)) tcb_fail(bdb, "open");
+    return bdb;
+}
+
+static void tcb_close(void *db) {
+    tcbdbclose(db);
+    tcbdbdel(db);
+    remove("bench_tc.tcb");
+}
+
+static int tcb_reopen(void *db) {
+    return tcbdbclose(db) && tcbdbopen(db, "bench_tc.tcb", BDBOWRITER) ? 0 : -1;
+}
+
+static int tcb_sync(void *db) { return tcbdbsync(db) ? 0 : -1; }
+
+static int tcb_put(void *db, const char *k, int ks, const char *v, int vs) {
+    return tcbdbput(db, k, ks, v, vs) ? 0 : -1;
+}
+
+static char *tcb_get(void *db, const char *k, int ks, int *sp) { return tcbdbget(db, k, ks, sp); }
+
+/* tcbdbget3 は葉のキャッシュの中を指す（次の操作までしか持たない） */
+static int tcb_view(void *db, const char *k, int ks, const char **vp, int *sp) {
+    return (*vp = tcbdbget3(db, k, ks, sp)) ? 0 : -1;
+}
+
+static int tcb_into(void *db, const char *k, int ks, char *buf, int max) {
+    int sp;
+    const char *v = tcbdbget3(db, k, ks, &sp);
+    if (!v) return -1;
+    memcpy(buf, v, sp < max ? sp : max);
+    return sp;
+}
+
+static int tcb_out(void *db, const char *k, int ks) { return tcbdbout(db, k, ks) ? 0 : -1; }
+
+static int64_t tcb_iterate(void *db, size_t *sum) {
+    BDBCUR *cur = tcbdbcurnew(db);
+    int64_t n = 0;
+    int ks, vs;
+    if (tcbdbcurfirst(cur)) {
+        do {
+            if (!tcbdbcurkey3(cur, &ks)) break;
+            const char *v = tcbdbcurval3(cur, &vs);
+            *sum += ks + (vs ? (uint8_t)v[0] : 0);
+            n++;
+        } while (tcbdbcurnext(cur));
+    }
+    tcbdbcurdel(cur);
+    return n;
+}
+
+static int64_t tcb_range(void *db, const char *k, int ks, int n, size_t *sum) {
+    BDBCUR *cur = tcbdbcurnew(db);
+    RANGE r = { n, 0 };
+    int64_t got = 0;
+    int cks, vs;
+    if (tcbdbcurjump(cur, k, ks)) {
+        do {
+            if (!tcbdbcurkey3(cur, &cks)) break;
+            got++;
+            if (!range_cb(NULL, 0, tcbdbcurval3(cur, &vs), vs, &r)) break;
+        } while (tcbdbcurnext(cur));
+    }
+    tcbdbcurdel(cur);
+    *sum += r.sum;
+    return got;
+}
+
+static int tcb_compact(void *db) { return tcbdboptimize(db, 0, 0, 0, -1, -1, UINT8_MAX) ? 0 : -1; }
+
+static void tcb_report(void *db, int ph, int n) {
+    (void)n;
+    if (ph == PH_MISS) printf("  File size: %.2f MB\n", tcbdbfsiz(db) / (1024.0 * 1024.0));
+}
+
+/* ---------- 自作KVM ---------- */
+typedef struct {
+    KVM *kvm;
+    KVMCOMPACT cs;          /* 最後のコンパクションの結果（report で出す） */
+} BKVM;
+
+static void *bkvm_open(const ENGINE *e, int n, int mode) {
+    BKVM *b = calloc(1, sizeof(BKVM));
+    remove("bench_kvm.kvm");
+    b->kvm = kvm_new();
+    kvm_setmutex(b->kvm);  /* TC 側の tchdbsetmutex と条件を揃える */
+    if (mode & BK_ORDER) kvm_setorder(b->kvm);
+    kvm_tune(b->kvm, 0, e->opts);
+    kvm_setbloom(b->kvm, n, 0.01);
+    if (kvm_open(b->kvm, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+        printf("KVM open error\n");
+        exit(1);
+    }
+    return b;
+}
+
+static void bkvm_close(void *db) {
+    BKVM *b = db;
+    char *vp = (b->kvm->opts & KVMTTIER) ? kvm_vlog_path("bench_kvm.kvm", b->kvm->vlog_seq) : NULL;
+    kvm_del(b->kvm);
+    remove("bench_kvm.kvm");
+    if (vp) remove(vp);
+    free(vp);
+    free(b);
+}
+
+/* ヘッダを読むだけなので件数に依らない */
+static int bkvm_reopen(void *db) {
+    BKVM *b = db;
+    kvm_close(b->kvm);
+    return kvm_open(b->kvm, "bench_kvm.kvm", KVMOWRITER);
+}
+
+static int bkvm_sync(void *db) { return kvm_sync(((BKVM*)db)->kvm); }
+
+static int bkvm_put(void *db, const char *k, int ks, const char *v, int vs) {
+    return kvm_put2(((BKVM*)db)->kvm, k, ks, v, vs);
+}
+
+static char *bkvm_get(void *db, const char *k, int ks, int *sp) {
+    uint32_t n = 0;
+    char *v = kvm_get2(((BKVM*)db)->kvm, k, ks, &n);
+    *sp = (int)n;
+    return v;
+}
+
+/* malloc もコピーもしない */
+static int bkvm_view(void *db, const char *k, int ks, const char **vp, int *sp) {
+    uint32_t n;
+    if (kvm_get_view(((BKVM*)db)->kvm, k, ks, vp, &n) != 0) return -1;
+    *sp = (int)n;
+    return 0;
+}
+
+static int bkvm_into(void *db, const char *k, int ks, char *buf, int max) {
+    return kvm_get_into2(((BKVM*)db)->kvm, k, ks, buf, max);
+}
+
+static void bkvm_mget(void *db, const char **keys, int n, char **out) {
+    kvm_mget(((BKVM*)db)->kvm, keys, n, out);
+}
+
+static int bkvm_out(void *db, const char *k, int ks) { return kvm_delete2(((BKVM*)db)->kvm, k, ks); }
+
+/* 更新で置き換えられた Entry も残った領域を前から辿る */
+static int64_t bkvm_iterate(void *db, size_t *sum) {
+    KVMITER *it = kvm_iter_new(((BKVM*)db)->kvm);
+    const char *ik, *iv;
+    uint32_t iks, ivs;
+    int64_t n = 0;
+    while (kvm_iter_next(it, &ik, &iks, &iv, &ivs) == 0) {
+        *sum += iks + (ivs ? (uint8_t)iv[0] : 0);
+        n++;
+    }
+    kvm_iter_del(it);
+    return n;
+}
+
+static int64_t bkvm_range(void *db, const char *k, int ks, int n, size_t *sum) {
+    RANGE r = { n, 0 };
+    int64_t got = kvm_scan2(((BKVM*)db)->kvm, k, ks, NULL, 0, range_cb, &r);
+    *sum += r.sum;
+    return got;
+}
+
+/* 別スレッドでコピーするので、待つまでの間も読み書きできる */
+static int bkvm_compact(void *db) { return kvm_compact_start(((BKVM*)db)->kvm); }
+
+static int bkvm_compact_wait(void *db, int *busy) {
+    BKVM *b = db;
+    *busy = !kvm_compact_done(b->kvm);
+    return kvm_compact_wait(b->kvm, &b->cs);
+}
+
+static int bkvm_bulk(void *db, const KVMREC *recs, int n) { return kvm_bulk_load(((BKVM*)db)->kvm, recs, n); }
+
+static int shard_count(void) {
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > SHARD_MAX ? SHARD_MAX : n;
+}
+
+/* CPU 数だけのシャードに振り分けて各持ち主が並行に書く */
+static void *bkvm_shard(const ENGINE *e, const KVMREC *recs, int n) {
+    KVMS *ks = kvms_new(shard_count());
+    kvms_tune(ks, 0, e->opts);
+    kvms_setbloom(ks, n, 0.01);
+    if (kvms_open(ks, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0 ||
+        kvms_putbatch(ks, recs, n) != 0) {
+        printf("KVM shard load error\n");
+        exit(1);
+    }
+    kvms_sync(ks);
+    return ks;
+}
+
+static void bkvm_shard_close(const ENGINE *e, void *s) {
+    int nshards = shard_count();
+    printf("  Shard load: %d shards, count %zu\n", nshards, kvms_count(s));
+    kvms_del(s);
+    for (int i = 0; i < nshards; i++) {
+        char path[64];
+        sprintf(path, "bench_kvm.kvm.%d", i);
+        remove(path);
+        if (e->opts & KVMTTIER) {
+            char *vp = kvm_vlog_path(path, 0);
+            remove(vp);
+            free(vp);
+        }
+    }
+}
+
+static void bkvm_report(void *db, int ph, int n) {
+    BKVM *b = db;
+    KVM *kvm = b->kvm;
+    const double MB = 1024.0 * 1024.0;
+    switch (ph) {
+    case PH_MISS: {
+        size_t index_size = table_bytes(kvm, kvm->nbuckets);
+        printf("  File size: %.2f MB, used %.2f MB (Bloom %.2f MB)\n", kvm->mem_size / MB,
+               kvm->write_pos / MB, kvm->bloom_blocks * 64 / MB);
+        printf("  Index: %.2f MB (%d-bit refs, %.1f bytes/record)\n", index_size / MB,
+               (int)sizeof(kvm_ref_t) * 8, (double)index_size / n);
+        KVMSTAT st;
+        kvm_stats(kvm, &st);
+        printf("  Stats: load %.2f, probe %.2f, Bloom FPR est %.4f; hit %llu, miss %llu, bloom %llu\n",
+               st.load, st.probe, st.bloom_fpr, (unsigned long long)st.op[KVMCHIT],
+               (unsigned long long)st.op[KVMCMISS], (unsigned long long)st.op[KVMCBLOOM]);
+        break;
+    }
+    case PH_UPDATE:
+        printf("  After update: live %.2f MB, dead %.2f MB\n", kvm->live_bytes / MB, kvm->dead_bytes / MB);
+        break;
+    case PH_ITER: {
+        size_t fe_sum = 0;
+        double tf = now_sec();
+        int64_t fe_n = kvm_foreach(kvm, scan_count, &fe_sum);
+        printf("  Foreach: %lld records, %.2f ops/sec\n", (long long)fe_n, fe_n / (now_sec() - tf));
+        break;
+    }
+    case PH_COMPACT:
+        printf("  Compact: %.2f MB -> %.2f MB (reclaimed %.2f MB) in %.4f sec\n",
+               b->cs.before / MB, b->cs.after / MB, b->cs.reclaimed / MB, b->cs.seconds);
+        break;
+    case PH_DELETE:
+        printf("  After delete: live %.2f MB, dead %.2f MB, count %zu\n",
+               kvm->live_bytes / MB, kvm->dead_bytes / MB, kvm->count);
+        break;
+    case PH_BULK:
+        printf("  Bulk load: count %zu, used %.2f MB, Bloom %.2f MB\n", kvm->count,
+               kvm->write_pos / MB, kvm->bloom_blocks * 64 / MB);
+        break;
+    }
+}
+
+/* ---------- 自作KVM（シャード + NUMA） ---------- */
+/* CPU 数だけのシャードをメモリ上に持ち、kvms_setnuma で各シャードを持ち主の CPU の
+ * ノードに置く（KVM_NUMA の無いビルドではただのシャード）。rep_ms > 0 なら Bloom と索引表の写しを各ノードに持たせ、持ち主が
+ * rep_ms ごとに写し直す。値を引く物はキーのシャードの KVM に直に頼む */
+#define BKVMS_REP_MS 10
+typedef struct {
+    KVMS *ks;
+    int nshards, rep_ms;
+} BKVMS;
+
+static void *bkvms_make(int n, int rep_ms) {
+    BKVMS *b = calloc(1, sizeof(BKVMS));
+    b->nshards = shard_count();
+    b->rep_ms = rep_ms;
+    b->ks = kvms_new(b->nshards);
+    kvms_setbloom(b->ks, n, 0.01);
+#ifdef KVM_NUMA
+    if (kvms_setnuma(b->ks, rep_ms) != 0) {
+        printf("KVM shard NUMA error\n");
+        exit(1);
+    }
+#endif
+    if (kvms_open(b->ks, NULL, 0) != 0) {
+        printf("KVM shard open error\n");
+        exit(1);
+    }
+    return b;
+}
+
+static void *bkvms_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    return bkvms_make(n, 0);
+}
+
+#ifdef KVM_NUMA
+static void *bkvms_open_rep(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    return bkvms_make(n, BKVMS_REP_MS);
+}
+#endif
+
+static void bkvms_close(void *db) {
+    kvms_del(((BKVMS*)db)->ks);
+    free(db);
+}
+
+/* 写しを持つなら書き終わりで写し直す（Write の時間に入る） */
+static int bkvms_sync(void *db) {
+    BKVMS *b = db;
+    int ret = kvms_sync(b->ks);
+    if (b->rep_ms && kvms_replicate(b->ks) != 0) ret = -1;
+    return ret;
+}
+
+static int bkvms_put(void *db, const char *k, int ks, const char *v, int vs) {
+    return kvms_put2(((BKVMS*)db)->ks, k, ks, v, vs);
+}
+
+static char *bkvms_get(void *db, const char *k, int ks, int *sp) {
+    uint32_t n = 0;
+    char *v = kvms_get2(((BKVMS*)db)->ks, k, ks, &n);
+    *sp = (int)n;
+    return v;
+}
+
+static int bkvms_view(void *db, const char *k, int ks, const char **vp, int *sp) {
+    uint32_t n;
+    if (kvm_get_view(kvms_shard(((BKVMS*)db)->ks, k, ks), k, ks, vp, &n) != 0) return -1;
+    *sp = (int)n;
+    return 0;
+}
+
+static int bkvms_into(void *db, const char *k, int ks, char *buf, int max) {
+    return kvm_get_into2(kvms_shard(((BKVMS*)db)->ks, k, ks), k, ks, buf, max);
+}
+
+static int bkvms_out(void *db, const char *k, int ks) { return kvms_delete2(((BKVMS*)db)->ks, k, ks); }
+
+static int bkvms_bulk(void *db, const KVMREC *recs, int n) { return kvms_putbatch(((BKVMS*)db)->ks, recs, n); }
+
+static void bkvms_report(void *db, int ph, int n) {
+    BKVMS *b = db;
+    (void)n;
+    if (ph != PH_MISS) return;
+    printf("  Shards: %d on %d node(s), replicas %s, count %zu\n", b->nshards, kvm_numa_nodes(),
+           b->rep_ms ? "on" : "off", kvms_count(b->ks));
+}
+
+/* ---------- プロセス内のハッシュ表（下限の目安） ---------- */
+/* std::unordered_map の代わりの素朴なオープンアドレス表。キーと値を一つの malloc に
+ * 入れ、消した所は墓標にする。ファイルもロックも無いので BK_MT ではない */
+typedef struct {
+    uint64_t h;             /* 0 は空き、1 は墓標 */
+    char *rec;              /* キー、値の順 */
+    uint32_t ks, vs;
+} HSLOT;
+
+typedef struct {
+    HSLOT *slot;
+    size_t mask;
+    size_t used;            /* 墓標も含めて埋まっている数 */
+    size_t count;
+    size_t bytes;           /* rec の合計 */
+} HMAP;
+
+static inline uint64_t hm_hash(const char *k, int ks) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < ks; i++) h = (h ^ (uint8_t)k[i]) * 0x100000001b3ull;
+    h = mix64(h);
+    return h < 2 ? h + 2 : h;
+}
+
+/* 見つかればその枠、無ければ入れるべき枠（途中の墓標があればそこ） */
+static HSLOT *hm_find(HMAP *m, const char *k, int ks, uint64_t h, int *found) {
+    HSLOT *tomb = NULL;
+    for (size_t i = h & m->mask;; i = (i + 1) & m->mask) {
+        HSLOT *s = &m->slot[i];
+        if (s->h == 0) {
+            *found = 0;
+            return tomb ? tomb : s;
+        }
+        if (s->h == 1) {
+            if (!tomb) tomb = s;
+        } else if (s->h == h && s->ks == (uint32_t)ks && memcmp(s->rec, k, ks) == 0) {
+            *found = 1;
+            return s;
+        }
+    }
+}
+
+/* 墓標を捨てて cap 枠に詰め直す */
+static void hm_rehash(HMAP *m, size_t cap) {
+    HSLOT *old = m->slot;
+    size_t ocap = old ? m->mask + 1 : 0;
+    m->slot = calloc(cap, sizeof(HSLOT));
+    m->mask = cap - 1;
+    m->used = m->count;
+    for (size_t i = 0; i < ocap; i++) {
+        if (old[i].h < 2) continue;
+        size_t j = old[i].h & m->mask;
+        while (m->slot[j].h) j = (j + 1) & m->mask;
+        m->slot[j] = old[i];
+    }
+    free(old);
+}
+
+static size_t hm_cap(size_t n) {
+    size_t cap = 16;
+    while (cap < n * 2) cap <<= 1;
+    return cap;
+}
+
+static void *hm_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    HMAP *m = calloc(1, sizeof(HMAP));
+    hm_rehash(m, hm_cap(n));
+    return m;
+}
+
+static void hm_close(void *db) {
+    HMAP *m = db;
+    for (size_t i = 0; i <= m->mask; i++)
+        if (m->slot[i].h >= 2) free(m->slot[i].rec);
+    free(m->slot);
+    free(m);
+}
+
+static int hm_put(void *db, const char *k, int ks, const char *v, int vs) {
+    HMAP *m = db;
+    if ((m->used + 1) * 4 > (m->mask + 1) * 3) hm_rehash(m, hm_cap(m->count + 1));
+    uint64_t h = hm_hash(k, ks);
+    int found;
+    HSLOT *s = hm_find(m, k, ks, h, &found);
+    if (found) {
+        if ((uint32_t)vs > s->vs) {
+            char *rec = realloc(s->rec, ks + vs);
+            if (!rec) return -1;
+            s->rec = rec;
+        }
+        m->bytes = m->bytes + vs - s->vs;
+    } else {
+        if (!(s->rec = malloc(ks + vs))) return -1;
+        memcpy(s->rec, k, ks);
+        if (s->h == 0) m->used++;
+        s->h = h;
+        s->ks = ks;
+        m->count++;
+        m->bytes += ks + vs;
+    }
+    memcpy(s->rec + ks, v, vs);
+    s->vs = vs;
+    return 0;
+}
+
+static int hm_view(void *db, const char *k, int ks, const char **vp, int *sp) {
+    int found;
+    HSLOT *s = hm_find(db, k, ks, hm_hash(k, ks), &found);
+    if (!found) return -1;
+    *vp = s->rec + s->ks;
+    *sp = s->vs;
+    return 0;
+}
+
+static char *hm_get(void *db, const char *k, int ks, int *sp) {
+    const char *vp;
+    if (hm_view(db, k, ks, &vp, sp) != 0) return NULL;
+    char *v = malloc(*sp + 1);
+    memcpy(v, vp, *sp);
+    v[*sp] = '\0';
+    return v;
+}
+
+static int hm_into(void *db, const char *k, int ks, char *buf, int max) {
+    const char *vp;
+    int sp;
+    if (hm_view(db, k, ks, &vp, &sp) != 0) return -1;
+    memcpy(buf, vp, sp < max ? sp : max);
+    return sp;
+}
+
+static int hm_out(void *db, const char *k, int ks) {
+    HMAP *m = db;
+    int found;
+    HSLOT *s = hm_find(m, k, ks, hm_hash(k, ks), &found);
+    if (!found) return -1;
+    m->bytes -= s->ks + s->vs;
+    free(s->rec);
+    s->h = 1;
+    m->count--;
+    return 0;
+}
+
+static int64_t hm_iterate(void *db, size_t *sum) {
+    HMAP *m = db;
+    int64_t n = 0;
+    for (size_t i = 0; i <= m->mask; i++) {
+        const HSLOT *s = &m->slot[i];
+        if (s->h < 2) continue;
+        *sum += s->ks + (s->vs ? (uint8_t)s->rec[s->ks] : 0);
+        n++;
+    }
+    return n;
+}
+
+/* unordered_map::rehash と同じく、今の件数に合わせて表を作り直す */
+static int hm_compact(void *db) {
+    HMAP *m = db;
+    hm_rehash(m, hm_cap(m->count));
+    return 0;
+}
+
+static void hm_report(void *db, int ph, int n) {
+    HMAP *m = db;
+    (void)n;
+    if (ph == PH_MISS)
+        printf("  Memory: table %.2f MB, records %.2f MB (malloc の管理領域は含まない)\n",
+               (m->mask + 1) * sizeof(HSLOT) / (1024.0 * 1024.0), m->bytes / (1024.0 * 1024.0));
+}
+
+#ifdef BENCH_LMDB
+/* ---------- LMDB ---------- */
+/* 一つのファイル（MDB_NOSUBDIR）を MDB_WRITEMAP で書く。書きは 1 件ずつ読み書きの
+ * トランザクション、読みは読み取り専用のトランザクションの中で値を写す。値を指したまま
+ * トランザクションを閉じられないので view は使わない */
+#define LMDB_PATH "bench_lmdb.mdb"
+
+typedef struct {
+    MDB_env *env;
+    MDB_dbi dbi;
+    size_t mapsize;
+} BLMDB;
+
+static void lmdb_check(int rc, const char *what) {
+    if (rc != 0) {
+        printf("LMDB %s error: %s\n", what, mdb_strerror(rc));
+        exit(1);
+    }
+}
+
+static void lmdb_env(BLMDB *b) {
+    MDB_txn *txn;
+    lmdb_check(mdb_env_create(&b->env), "env");
+    lmdb_check(mdb_env_set_mapsize(b->env, b->mapsize), "mapsize");
+    lmdb_check(mdb_env_open(b->env, LMDB_PATH, MDB_NOSUBDIR | MDB_WRITEMAP | MDB_NOSYNC | MDB_NOMETASYNC, 0644), "open");
+    lmdb_check(mdb_txn_begin(b->env, NULL, 0, &txn), "txn");
+    lmdb_check(mdb_dbi_open(txn, NULL, 0, &b->dbi), "dbi");
+    lmdb_check(mdb_txn_commit(txn), "commit");
+}
+
+static void *lmdb_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)mode;
+    BLMDB *b = calloc(1, sizeof(BLMDB));
+    remove(LMDB_PATH);
+    remove(LMDB_PATH "-lock");
+    /* 書き直しで古い頁が残る分を見込んで大きめに取る（疎なファイルになる） */
+    b->mapsize = (size_t)n * 1024 + ((size_t)256 << 20);
+    lmdb_env(b);
+    return b;
+}
+
+static void lmdb_close(void *db) {
+    BLMDB *b = db;
+    mdb_env_close(b->env);
+    remove(LMDB_PATH);
+    remove(LMDB_PATH "-lock");
+    free(b);
+}
+
+static int lmdb_reopen(void *db) {
+    BLMDB *b = db;
+    mdb_env_close(b->env);
+    lmdb_env(b);
+    return 0;
+}
+
+static int lmdb_sync(void *db) { return mdb_env_sync(((BLMDB*)db)->env, 1) == 0 ? 0 : -1; }
+
+static int lmdb_put(void *db, const char *k, int ks, const char *v, int vs) {
+    BLMDB *b = db;
+    MDB_txn *txn;
+    MDB_val key = { (size_t)ks, (void*)k }, val = { (size_t)vs, (void*)v };
+    if (mdb_txn_begin(b->env, NULL, 0, &txn) != 0) return -1;
+    if (mdb_put(txn, b->dbi, &key, &val, 0) != 0) {
+        mdb_txn_abort(txn);
+        return -1;
+    }
+    return mdb_txn_commit(txn) == 0 ? 0 : -1;
+}
+
+/* 見つかれば値の長さ。buf が NULL なら malloc して *vp に返す */
+static int lmdb_read(BLMDB *b, const char *k, int ks, char *buf, int max, char **vp) {
+    MDB_txn *txn;
+    MDB_val key = { (size_t)ks, (void*)k }, val;
+    int sp = -1;
+    if (mdb_txn_begin(b->env, NULL, MDB_RDONLY, &txn) != 0) return -1;
+    if (mdb_get(txn, b->dbi, &key, &val) == 0) {
+        sp = (int)val.mv_size;
+        if (!buf) {
+            *vp = malloc(sp + 1);
+            memcpy(*vp, val.mv_data, sp);
+            (*vp)[sp] = '\0';
+        } else {
+            memcpy(buf, val.mv_data, sp < max ? sp : max);
+        }
+    }
+    mdb_txn_abort(txn);
+    return sp;
+}
+
+static char *lmdb_get(void *db, const char *k, int ks, int *sp) {
+    char *v = NULL;
+    *sp = lmdb_read(db, k, ks, NULL, 0, &v);
+    return v;
+}
+
+static int lmdb_into(void *db, const char *k, int ks, char *buf, int max) {
+    return lmdb_read(db, k, ks, buf, max, NULL);
+}
+
+static int lmdb_out(void *db, const char *k, int ks) {
+    BLMDB *b = db;
+    MDB_txn *txn;
+    MDB_val key = { (size_t)ks, (void*)k };
+    if (mdb_txn_begin(b->env, NULL, 0, &txn) != 0) return -1;
+    if (mdb_del(txn, b->dbi, &key, NULL) != 0) {
+        mdb_txn_abort(txn);
+        return -1;
+    }
+    return mdb_txn_commit(txn) == 0 ? 0 : -1;
+}
+
+/* k から n 件（k が NULL なら先頭から全部）。辿った数を返す */
+static int64_t lmdb_walk(BLMDB *b, const char *k, int ks, int n, size_t *sum) {
+    MDB_txn *txn;
+    MDB_cursor *cur;
+    MDB_val key = { (size_t)ks, (void*)k }, val;
+    RANGE r = { n, 0 };
+    int64_t got = 0;
+    if (mdb_txn_begin(b->env, NULL, MDB_RDONLY, &txn) != 0) return -1;
+    if (mdb_cursor_open(txn, b->dbi, &cur) != 0) {
+        mdb_txn_abort(txn);
+        return -1;
+    }
+    for (int rc = mdb_cursor_get(cur, &key, &val, k ? MDB_SET_RANGE : MDB_FIRST); rc == 0;
+         rc = mdb_cursor_get(cur, &key, &val, MDB_NEXT)) {
+        got++;
+        if (k) {
+            if (!range_cb(NULL, 0, val.mv_data, val.mv_size, &r)) break;
+        } else {
+            r.sum += key.mv_size + (val.mv_size ? *(const uint8_t*)val.mv_data : 0);
+        }
+    }
+    mdb_cursor_close(cur);
+    mdb_txn_abort(txn);
+    *sum += r.sum;
+    return got;
+}
+
+static int64_t lmdb_iterate(void *db, size_t *sum) { return lmdb_walk(db, NULL, 0, 0, sum); }
+
+static int64_t lmdb_range(void *db, const char *k, int ks, int n, size_t *sum) {
+    return lmdb_walk(db, k, ks, n, sum);
+}
+
+/* 全件を一つのトランザクションで入れる */
+static int lmdb_bulk(void *db, const KVMREC *recs, int n) {
+    BLMDB *b = db;
+    MDB_txn *txn;
+    if (mdb_txn_begin(b->env, NULL, 0, &txn) != 0) return -1;
+    for (int i = 0; i < n; i++) {
+        MDB_val key = { recs[i].klen, (void*)recs[i].kbuf }, val = { recs[i].vlen, (void*)recs[i].vbuf };
+        if (mdb_put(txn, b->dbi, &key, &val, 0) != 0) {
+            mdb_txn_abort(txn);
+            return -1;
+        }
+    }
+    return mdb_txn_commit(txn) == 0 ? 0 : -1;
+}
+
+static void lmdb_report(void *db, int ph, int n) {
+    BLMDB *b = db;
+    MDB_envinfo info;
+    MDB_stat st;
+    (void)n;
+    if (ph == PH_MISS && mdb_env_info(b->env, &info) == 0 && mdb_env_stat(b->env, &st) == 0)
+        printf("  File size: %.2f MB, used %.2f MB\n", b->mapsize / (1024.0 * 1024.0),
+               (info.me_last_pgno + 1) * (double)st.ms_psize / (1024.0 * 1024.0));
+}
+#endif
+
+#if defined(BENCH_LEVELDB) || defined(BENCH_ROCKSDB)
+/* ---------- LevelDB / RocksDB ---------- */
+/* C API は接頭辞が違うだけなので LSM() で切り替える。書きは WAL に積んで同期しない
+ * （TC や自作KVM の put と同じく、sync を呼ぶまで耐久性は無い） */
+#ifdef BENCH_ROCKSDB
+#define LSM(f) rocksdb_##f
+#define LSM_ID "rocksdb"
+#define LSM_NAME "RocksDB"
+#else
+#define LSM(f) leveldb_##f
+#define LSM_ID "leveldb"
+#define LSM_NAME "LevelDB"
+#endif
+#define LSM_PATH "bench_lsm.db"
+
+typedef struct {
+    LSM(t) *db;
+    LSM(options_t) *opt;
+    LSM(readoptions_t) *ro;
+    LSM(writeoptions_t) *wo;
+} BLSM;
+
+static void lsm_check(char *err, const char *what) {
+    if (err) {
+        printf(LSM_NAME " %s error: %s\n", what, err);
+        exit(1);
+    }
+}
+
+static void *lsm_open(const ENGINE *e, int n, int mode) {
+    (void)e; (void)n; (void)mode;
+    BLSM *b = calloc(1, sizeof(BLSM));
+    char *err = NULL;
+    b->opt = LSM(options_create)();
+    LSM(options_set_create_if_missing)(b->opt, 1);
+    LSM(destroy_db)(b->opt, LSM_PATH, &err);
+    if (err) LSM(free)(err);
+    err = NULL;
+    b->db = LSM(open)(b->opt, LSM_PATH, &err);
+    lsm_check(err, "open");
+    b->ro = LSM(readoptions_create)();
+    b->wo = LSM(writeoptions_create)();
+    return b;
+}
+
+static void lsm_close(void *db) {
+    BLSM *b = db;
+    char *err = NULL;
+    LSM(close)(b->db);
+    LSM(destroy_db)(b->opt, LSM_PATH, &err);
+    if (err) LSM(free)(err);
+    LSM(readoptions_destroy)(b->ro);
+    LSM(writeoptions_destroy)(b->wo);
+    LSM(options_destroy)(b->opt);
+    free(b);
+}
+
+static int lsm_reopen(void *db) {
+    BLSM *b = db;
+    char *err = NULL;
+    LSM(close)(b->db);
+    b->db = LSM(open)(b->opt, LSM_PATH, &err);
+    lsm_check(err, "reopen");
+    return 0;
+}
+
+static int lsm_put(void *db, const char *k, int ks, const char *v, int vs) {
+    BLSM *b = db;
+    char *err = NULL;
+    LSM(put)(b->db, b->wo, k, ks, v, vs, &err);
+    if (!err) return 0;
+    LSM(free)(err);
+    return -1;
+}
+
+/* 戻り値は malloc した配列（NUL 終わりではない） */
+static char *lsm_get(void *db, const char *k, int ks, int *sp) {
+    BLSM *b = db;
+    char *err = NULL;
+    size_t vl = 0;
+    char *v = LSM(get)(b->db, b->ro, k, ks, &vl, &err);
+    if (err) LSM(free)(err);
+    *sp = (int)vl;
+    return v;
+}
+
+static int lsm_into(void *db, const char *k, int ks, char *buf, int max) {
+    int sp;
+    char *v = lsm_get(db, k, ks, &sp);
+    if (!v) return -1;
+    memcpy(buf, v, sp < max ? sp : max);
+    free(v);
+    return sp;
+}
+
+static int lsm_out(void *db, const char *k, int ks) {
+    BLSM *b = db;
+    char *err = NULL;
+    LSM(delete)(b->db, b->wo, k, ks, &err);
+    if (!err) return 0;
+    LSM(free)(err);
+    return -1;
+}
+
+/* k から n 件（k が NULL なら先頭から全部）。辿った数を返す */
+static int64_t lsm_walk(BLSM *b, const char *k, int ks, int n, size_t *sum) {
+    LSM(iterator_t) *it = LSM(create_iterator)(b->db, b->ro);
+    RANGE r = { n, 0 };
+    int64_t got = 0;
+    if (k) LSM(iter_seek)(it, k, ks);
+    else LSM(iter_seek_to_first)(it);
+    for (; LSM(iter_valid)(it); LSM(iter_next)(it)) {
+        size_t kl, vl;
+        LSM(iter_key)(it, &kl);
+        const char *v = LSM(iter_value)(it, &vl);
+        got++;
+        if (k) {
+            if (!range_cb(NULL, 0, v, vl, &r)) break;
+        } else {
+            r.sum += kl + (vl ? (uint8_t)v[0] : 0);
+        }
+    }
+    LSM(iter_destroy)(it);
+    *sum += r.sum;
+    return got;
+}
+
+static int64_t lsm_iterate(void *db, size_t *sum) { return lsm_walk(db, NULL, 0, 0, sum); }
+
+static int64_t lsm_range(void *db, const char *k, int ks, int n, size_t *sum) {
+    return lsm_walk(db, k, ks, n, sum);
+}
+
+/* 全範囲を圧縮し直す（終わるまで返らない） */
+static int lsm_compact(void *db) {
+    LSM(compact_range)(((BLSM*)db)->db, NULL, 0, NULL, 0);
+    return 0;
+}
+
+/* 全件を一つの WriteBatch で入れる */
+static int lsm_bulk(void *db, const KVMREC *recs, int n) {
+    BLSM *b = db;
+    char *err = NULL;
+    LSM(writebatch_t) *wb = LSM(writebatch_create)();
+    for (int i = 0; i < n; i++) LSM(writebatch_put)(wb, recs[i].kbuf, recs[i].klen, recs[i].vbuf, recs[i].vlen);
+    LSM(write)(b->db, b->wo, wb, &err);
+    LSM(writebatch_destroy)(wb);
+    if (!err) return 0;
+    LSM(free)(err);
+    return -1;
+}
+#endif
+
+/* 既定で流すのは BK_EXTRA の付いていない物 */
+static const ENGINE engine_list[] = {
+    { .id = "tc", .name = "TokyoCabinet", .title = "Tokyo Cabinet (Hash DB)", .flags = BK_MT,
+      .open = tch_open, .close = tch_close, .reopen = tch_reopen, .sync = tch_sync,
+      .put = tch_put, .get = tch_get, .into = tch_into, .out = tch_out, .iterate = tch_iterate,
+      .compact = tch_compact, .bulk = tch_bulk, .report = tch_report },
+    { .id = "tcb", .name = "TC-BTree", .title = "Tokyo Cabinet (B+tree DB)", .flags = BK_MT | BK_ORDER,
+      .open = tcb_open, .close = tcb_close, .reopen = tcb_reopen, .sync = tcb_sync,
+      .put = tcb_put, .get = tcb_get, .view = tcb_view, .into = tcb_into, .out = tcb_out,
+      .iterate = tcb_iterate, .range = tcb_range, .compact = tcb_compact, .report = tcb_report },
+#define KVM_ENGINE(i, n, t, f, o, v) \
+    { .id = i, .name = n, .title = t, .flags = BK_OWN | BK_MT | BK_ORDER | (f), .opts = o, \
+      .open = bkvm_open, .close = bkvm_close, .reopen = bkvm_reopen, .sync = bkvm_sync, \
+      .put = bkvm_put, .get = bkvm_get, .view = v, .into = bkvm_into, .mget = bkvm_mget, \
+      .out = bkvm_out, .iterate = bkvm_iterate, .range = bkvm_range, .compact = bkvm_compact, \
+      .compact_wait = bkvm_compact_wait, .bulk = bkvm_bulk, .shard = bkvm_shard, \
+      .shard_close = bkvm_shard_close, .report = bkvm_report }
+    KVM_ENGINE("kvm", "自作KVM", "自作KVM (mmap + Bloom Filter)", 0, 0, bkvm_view),
+    KVM_ENGINE("kvm-line", "KVM-Line", "自作KVM (cache-line bucketed index)", 0, KVMTLINE, bkvm_view),
+    /* 圧縮した値と値ファイルの値は kvm_get_view では引けない */
+    KVM_ENGINE("kvm-lz", "KVM-LZ", "自作KVM (KVMTLZ)", BK_EXTRA, KVMTLZ, NULL),
+    KVM_ENGINE("kvm-tier", "KVM-Tier", "自作KVM (KVMTTIER, values in a pread'd file)", BK_EXTRA, KVMTTIER, NULL),
+#undef KVM_ENGINE
+#define KVMS_ENGINE(i, n, t, o) \
+    { .id = i, .name = n, .title = t, .flags = BK_OWN | BK_MT | BK_EXTRA, \
+      .open = o, .close = bkvms_close, .sync = bkvms_sync, .put = bkvms_put, .get = bkvms_get, \
+      .view = bkvms_view, .into = bkvms_into, .out = bkvms_out, .bulk = bkvms_bulk, .report = bkvms_report }
+    KVMS_ENGINE("kvms", "KVM-Shard", "自作KVM (KVMS, shards on their owners' nodes)", bkvms_open),
+#ifdef KVM_NUMA
+    KVMS_ENGINE("kvms-rep", "KVMS-Rep", "自作KVM (KVMS + per-node index replicas)", bkvms_open_rep),
+#endif
+#undef KVMS_ENGINE
+    { .id = "hash", .name = "HashMap", .title = "in-process hash table (baseline)", .flags = BK_REF,
+      .open = hm_open, .close = hm_close, .put = hm_put, .get = hm_get, .view = hm_view,
+      .into = hm_into, .out = hm_out, .iterate = hm_iterate, .compact = hm_compact, .report = hm_report },
+#ifdef BENCH_LMDB
+    { .id = "lmdb", .name = "LMDB", .title = "LMDB (MDB_WRITEMAP)", .flags = BK_MT | BK_ORDER,
+      .open = lmdb_open, .close = lmdb_close, .reopen = lmdb_reopen, .sync = lmdb_sync,
+      .put = lmdb_put, .get = lmdb_get, .into = lmdb_into, .out = lmdb_out, .iterate = lmdb_iterate,
+      .range = lmdb_range, .bulk = lmdb_bulk, .report = lmdb_report },
+#endif
+#if defined(BENCH_LEVELDB) || defined(BENCH_ROCKSDB)
+    { .id = LSM_ID, .name = LSM_NAME, .title = LSM_NAME " (C API)",
+      .flags = BK_MT | BK_ORDER, .open = lsm_open, .close = lsm_close, .reopen = lsm_reopen,
+      .put = lsm_put, .get = lsm_get, .into = lsm_into, .out = lsm_out, .iterate = lsm_iterate,
+      .range = lsm_range, .compact = lsm_compact, .bulk = lsm_bulk },
+#endif
+};
+#define NENGINE_LIST ((int)(sizeof(engine_list) / sizeof(engine_list[0])))
+
+static const ENGINE *engines[ENGINE_MAX];  /* --engines で選んだ物 */
+static int nengine;
+
+/* 索引の形を決め打ちにしたビルドでは、自作KVM と KVM-Line のうち作れない方を外す */
+static int engine_buildable(const ENGINE *e) {
+    if (!(e->flags & BK_OWN) || KVM_INDEX == 0 || (e->opts & ~KVMTLINE)) return 1;
+    return ((e->opts & KVMTLINE) != 0) == (KVM_INDEX == 2);
+}
+
+/* "tc,kvm,…"（この順で列にする）か "all"。NULL なら既定の組。知らない名前なら -1 */
+static int engine_select(const char *spec) {
+    nengine = 0;
+    if (!spec || strcmp(spec, "all") == 0) {
+        for (int i = 0; i < NENGINE_LIST && nengine < ENGINE_MAX; i++)
+            if ((spec || !(engine_list[i].flags & BK_EXTRA)) && engine_buildable(&engine_list[i]))
+                engines[nengine++] = &engine_list[i];
+        return 0;
+    }
+    for (const char *p = spec; *p; ) {
+        size_t n = strcspn(p, ",");
+        int i = 0;
+        while (i < NENGINE_LIST && (strlen(engine_list[i].id) != n || strncmp(engine_list[i].id, p, n) != 0)) i++;
+        if (i == NENGINE_LIST) return -1;
+        if (engine_buildable(&engine_list[i]) && nengine < ENGINE_MAX) engines[nengine++] = &engine_list[i];
+        p += n + (p[n] == ',');
+    }
+    return nengine > 0 ? 0 : -1;
+}
+
+/* 表の桁を揃えるための表示幅（UTF-8 の 3 バイト以上の文字は 2 桁と数える） */
+static int disp_width(const char *s) {
+    int w = 0;
+    for (const unsigned char *p = (const unsigned char*)s; *p; p++)
+        if (*p < 0x80) w++;
+        else if (*p >= 0xE0) w += 2;
+        else if (*p >= 0xC0) w++;
+    return w;
+}
+
+/* 右寄せで w 桁 */
+static void print_cell(const char *s, int w) {
+    for (int i = disp_width(s); i < w; i++) putchar(' ');
+    fputs(s, stdout);
+}
+
+/* e の共通のフェーズを N 件で流して t・hs・pc を埋める。無い操作のフェーズは t を -1 にする */
+void bench_engine(const ENGINE *e, int N, char **keys, char **vals, char **miss,
+                  char **upds, double *t, HIST *hs, PERFC *pc) {
+    double t0;
+    RNG rng;
+    void *db = e->open(e, N, 0);
+#define REPORT(ph) do { if (e->report) e->report(db, (ph), N); } while (0)
+
+    /* Write */
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++)
+        TIMED(&hs[PH_WRITE], i, e->put(db, keys[i], strlen(keys[i]), vals[i], strlen(vals[i])));
+    if (e->sync) e->sync(db);
+    perf_end(&pc[PH_WRITE]);
+    t[PH_WRITE] = now_sec() - t0;
+
+    /* Reopen */
+    if (e->reopen) {
+        t0 = now_sec();
+        if (e->reopen(db) != 0) {
+            printf("%s reopen error\n", e->name);
+            exit(1);
+        }
+        printf("  Reopen: %.3f ms\n", (now_sec() - t0) * 1e3);
+    }
+
+    /* Seq Read */
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++) {
+        char *v;
+        int sp;
+        TIMED(&hs[PH_SEQ], i, v = e->get(db, keys[i], strlen(keys[i]), &sp));
+        free(v);
+    }
+    perf_end(&pc[PH_SEQ]);
+    t[PH_SEQ] = now_sec() - t0;
+
+    /* Rand Read */
+    rng_seed(&rng, 12345);
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++) {
+        const char *k = keys[rng_below(&rng, N)];
+        char *v;
+        int sp;
+        TIMED(&hs[PH_RAND], i, v = e->get(db, k, strlen(k), &sp));
+        free(v);
+    }
+    perf_end(&pc[PH_RAND]);
+    t[PH_RAND] = now_sec() - t0;
+
+    /* Rand View（malloc もコピーもしない） */
+    size_t sum = 0;
+    if (e->view) {
+        rng_seed(&rng, 12345);
+        t0 = now_sec();
+        perf_begin();
+        for (int i = 0; i < N; i++) {
+            const char *k = keys[rng_below(&rng, N)], *vp;
+            int vs;
+            if (e->view(db, k, strlen(k), &vp, &vs) == 0) sum += vp[0] + vs;
+        }
+        perf_end(&pc[PH_VIEW]);
+        t[PH_VIEW] = now_sec() - t0;
+    }
+
+    /* Rand Into（呼び出し側のバッファへコピー） */
+    rng_seed(&rng, 12345);
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++) {
+        const char *k = keys[rng_below(&rng, N)];
+        char buf[64];
+        if (e->into(db, k, strlen(k), buf, sizeof(buf)) >= 0) sum += buf[0];
+    }
+    perf_end(&pc[PH_INTO]);
+    t[PH_INTO] = now_sec() - t0;
+    /* 領域を直接指す API が無いエンジンは Rand View の比較相手も Into にする */
+    if (!e->view) {
+        t[PH_VIEW] = t[PH_INTO];
+        pc[PH_VIEW] = pc[PH_INTO];
+    }
+    if (sum == 0) printf("  (no hits)\n");
+
+    /* MGet Rand（Rand Read と同じキー列を MGET_CHUNK 件ずつ。一括取得が無ければ get を回す） */
+    const char *mk[MGET_CHUNK];
+    char *mv[MGET_CHUNK];
+    rng_seed(&rng, 12345);
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i += MGET_CHUNK) {
+        int m = N - i < MGET_CHUNK ? N - i : MGET_CHUNK, sp;
+        for (int j = 0; j < m; j++) mk[j] = keys[rng_below(&rng, N)];
+        if (e->mget) e->mget(db, mk, m, mv);
+        else for (int j = 0; j < m; j++) mv[j] = e->get(db, mk[j], strlen(mk[j]), &sp);
+        for (int j = 0; j < m; j++) free(mv[j]);
+    }
+    perf_end(&pc[PH_MGET]);
+    t[PH_MGET] = now_sec() - t0;
+
+    /* Miss Read */
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++) {
+        char *v;
+        int sp;
+        TIMED(&hs[PH_MISS], i, v = e->get(db, miss[i], strlen(miss[i]), &sp));
+        free(v);
+    }
+    perf_end(&pc[PH_MISS]);
+    t[PH_MISS] = now_sec() - t0;
+    REPORT(PH_MISS);
+
+    /* Update（自作KVM は値が元の Entry に収まればその場で上書き） */
+    rng_seed(&rng, 54321);
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++) {
+        int r = (int)rng_below(&rng, N);
+        e->put(db, keys[r], strlen(keys[r]), upds[r], strlen(upds[r]));
+    }
+    perf_end(&pc[PH_UPDATE]);
+    t[PH_UPDATE] = now_sec() - t0;
+    REPORT(PH_UPDATE);
+
+    /* Iterate */
+    t[PH_ITER] = -1;
+    if (e->iterate) {
+        size_t it_sum = 0;
+        t0 = now_sec();
+        perf_begin();
+        int64_t it_n = e->iterate(db, &it_sum);
+        perf_end(&pc[PH_ITER]);
+        t[PH_ITER] = now_sec() - t0;
+        printf("  Iterate: %lld records\n", (long long)it_n);
+        if (it_sum == 0) printf("  (no hits)\n");
+        REPORT(PH_ITER);
+    }
+
+    /* Compact（始めてから終わるまでだけを測る）。裏でコピーするエンジンは、もう一度
+     * コンパクションを掛けてその間のランダム読みを別に出す（表には入れない） */
+    t[PH_COMPACT] = -1;
+    if (e->compact) {
+        int busy, sp;
+        t0 = now_sec();
+        perf_begin();
+        if (e->compact(db) != 0 || (e->compact_wait && e->compact_wait(db, &busy) != 0)) {
+            printf("%s compact error\n", e->name);
+            exit(1);
+        }
+        perf_end(&pc[PH_COMPACT]);
+        t[PH_COMPACT] = now_sec() - t0;
+        REPORT(PH_COMPACT);
+        if (e->compact_wait) {
+            rng_seed(&rng, 12345);
+            if (e->compact(db) != 0) {
+                printf("%s compact error\n", e->name);
+                exit(1);
+            }
+            double t1 = now_sec();
+            int nread = 0;
+            for (; nread < N; nread++) {
+                const char *k = keys[rng_below(&rng, N)];
+                free(e->get(db, k, strlen(k), &sp));
+            }
+            double during = now_sec() - t1;
+            if (e->compact_wait(db, &busy) != 0) {
+                printf("%s compact error\n", e->name);
+                exit(1);
+            }
+            printf("  Rand Read during compaction: %.2f ops/sec%s\n", nread / during,
+                   busy ? "" : " (compaction finished first)");
+        }
+    }
+
+    /* Delete */
+    t0 = now_sec();
+    perf_begin();
+    for (int i = 0; i < N; i++)
+        e->out(db, keys[i], strlen(keys[i]));
+    perf_end(&pc[PH_DELETE]);
+    t[PH_DELETE] = now_sec() - t0;
+    REPORT(PH_DELETE);
+    e->close(db);
+
+    /* Bulk Load（空の DB に全件まとめて入れて同期するまで。一括の口が無ければ put を回す） */
+    KVMREC *recs = malloc(N * sizeof(KVMREC));
+    for (int i = 0; i < N; i++) {
+        recs[i].kbuf = keys[i]; recs[i].klen = strlen(keys[i]);
+        recs[i].vbuf = vals[i]; recs[i].vlen = strlen(vals[i]);
+    }
+    t0 = now_sec();
+    perf_begin();
+    db = e->open(e, N, 0);
+    int ret = 0;
+    if (e->bulk) ret = e->bulk(db, recs, N);
+    else for (int i = 0; i < N && ret == 0; i++) ret = e->put(db, recs[i].kbuf, recs[i].klen, recs[i].vbuf, recs[i].vlen);
+    if (ret != 0) {
+        printf("%s bulk load error\n", e->name);
+        exit(1);
+    }
+    if (e->sync) e->sync(db);
+    perf_end(&pc[PH_BULK]);
+    t[PH_BULK] = now_sec() - t0;
+    REPORT(PH_BULK);
+    e->close(db);
+#undef REPORT
+
+    /* Shard Load（書き手が一つに限られるエンジンは Write と同じ） */
+    if (e->shard) {
+        t0 = now_sec();
+        perf_begin();
+        void *s = e->shard(e, recs, N);
+        perf_end(&pc[PH_SHARD]);
+        t[PH_SHARD] = now_sec() - t0;
+        e->shard_close(e, s);
+    } else {
+        t[PH_SHARD] = t[PH_WRITE];
+        pc[PH_SHARD] = pc[PH_WRITE];
+    }
+    free(recs);
+
+    for (int p = 0; p < NPHASE; p++)
+        if (t[p] > 0) print_result(e->name, phase_name[p], N, t[p]);
+    print_latency(e->name, phase_name, hs, NPHASE);
+    print_counters(e->name, phase_name, t, pc, NPHASE, N);
+}
+
+/* ========== マルチスレッド ========== */
+/* 各スレッドが read_ratio の割合で get、残りで put を ops 回ずつ行う。
+ * put の値は vals と upds を交互に使うので、その場上書きと追記の両方が起きる。
+ * i 本目のスレッドは CPU i % CPU 数に固定し、載ったノードごとに操作数を足す */
+typedef struct {
+    const ENGINE *e;
+    void *db;
+    int N, ops;
+    char **keys, **vals, **upds;
+    double read_ratio;
+    unsigned seed;
+    int cpu, node;          /* cpu は渡す物、node は返す物 */
+} MTARG;
+
+static atomic_int mt_go;
+
+static void *mt_worker(void *p) {
+    MTARG *a = p;
+    const ENGINE *e = a->e;
+    RNG rng;
+    rng_seed(&rng, a->seed);
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(a->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    a->node = kvm_thread_node();
+    while (!atomic_load(&mt_go)) sched_yield();
+    for (int i = 0; i < a->ops; i++) {
+        int r = (int)rng_below(&rng, a->N), sp;
+        int rd = rng_double(&rng) < a->read_ratio;
+        const char *k = a->keys[r], *v = (i & 1) ? a->upds[r] : a->vals[r];
+        if (rd) free(e->get(a->db, k, strlen(k), &sp));
+        else e->put(a->db, k, strlen(k), v, strlen(v));
+    }
+    return NULL;
+}
 
-#define BLOOM_OFF 0
-#define BUCKET_OFF (BLOOM_SIZE / 8)
-#define DATA_OFF (BUCKET_OFF + BUCKET_COUNT * sizeof(uint32_t))
+/* threads 本で合計 ops 回まわした時の ops/sec。node にはノードごとに、そこに載った
+ * スレッドの操作数を同じ経過時間で割った物（スレッドの無いノードは -1）を KVM_NODES 個
+ * 返す。足すと合計の ops/sec になる */
+static double mt_run(const MTARG *proto, int threads, int ops, double *node) {
+    pthread_t *th = malloc(threads * sizeof(pthread_t));
+    MTARG *args = malloc(threads * sizeof(MTARG));
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    atomic_store(&mt_go, 0);
+    for (int i = 0; i < threads; i++) {
+        args[i] = *proto;
+        args[i].ops = ops / threads;
+        args[i].seed = 12345 + i * 7919;
+        args[i].cpu = i % ncpu;
+        pthread_create(&th[i], NULL, mt_worker, &args[i]);
+    }
+    double t0 = now_sec();
+    atomic_store(&mt_go, 1);
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    double t = now_sec() - t0;
+    for (int n = 0; n < KVM_NODES; n++) node[n] = -1;
+    for (int i = 0; i < threads; i++)
+        node[args[i].node] = (node[args[i].node] < 0 ? 0 : node[args[i].node]) + args[i].ops / t;
+    free(th);
+    free(args);
+    return (double)(ops / threads) * threads / t;
+}
 
-typedef struct {
-    uint32_t klen;
-    uint32_t vlen;
-    uint32_t next;
-    char data[];
-} Entry;
+/* 1, 2, 4, … max_threads スレッドで、選んだエンジンのうち BK_MT の物を比べる。
+ * 読み込んだ後に sync するので、写しを持つエンジンは写し直してから測る */
+void bench_mt(int N, int max_threads, double read_ratio, char **keys, char **vals, char **upds) {
+    int counts[32], nc = 0, ne = 0;
+    for (int t = 1; t < max_threads && nc < 31; t *= 2) counts[nc++] = t;
+    counts[nc++] = max_threads;
+    double res[32][ENGINE_MAX];
+    double (*pn)[ENGINE_MAX][KVM_NODES] = malloc(32 * sizeof(*pn));
+    const ENGINE *run[ENGINE_MAX];
+    MTARG proto = { NULL, NULL, N, 0, keys, vals, upds, read_ratio, 0, 0, 0 };
+
+    printf("\n>>> マルチスレッド (read ratio %.2f, %d ops / run)\n", read_ratio, N);
+    for (int k = 0; k < nengine; k++) {
+        const ENGINE *e = engines[k];
+        if (!(e->flags & BK_MT)) continue;
+        proto.e = e;
+        proto.db = e->open(e, N, 0);
+        for (int i = 0; i < N; i++) e->put(proto.db, keys[i], strlen(keys[i]), vals[i], strlen(vals[i]));
+        if (e->sync) e->sync(proto.db);
+        for (int c = 0; c < nc; c++) res[c][ne] = mt_run(&proto, counts[c], N, pn[c][ne]);
+        e->close(proto.db);
+        run[ne++] = e;
+    }
+
+    printf("  %-8s │", "Threads");
+    for (int k = 0; k < ne; k++) {
+        putchar(' ');
+        print_cell(run[k]->name, 12);
+        printf(" │");
+    }
+    printf(" (ops/sec)\n");
+    for (int c = 0; c < nc; c++) {
+        printf("  %-8d │", counts[c]);
+        for (int k = 0; k < ne; k++) printf(" %12.0f │", res[c][k]);
+        printf("\n");
+    }
+
+    /* ノード別。スレッドの載っていないノードの行は出さない */
+    printf("\n  ノード別 (NUMA ノード %d、ノードに載ったスレッドの操作数 / 全体の経過時間。足すと上の表)\n", kvm_numa_nodes());
+    printf("  %-8s │ %-4s │", "Threads", "Node");
+    for (int k = 0; k < ne; k++) {
+        putchar(' ');
+        print_cell(run[k]->name, 12);
+        printf(" │");
+    }
+    printf("\n");
+    for (int c = 0; c < nc; c++)
+        for (int n = 0; n < KVM_NODES; n++) {
+            if (ne == 0 || pn[c][0][n] < 0) continue;
+            printf("  %-8d │ %-4d │", counts[c], n);
+            for (int k = 0; k < ne; k++) printf(" %12.0f │", pn[c][k][n]);
+            printf("\n");
+        }
+    free(pn);
+}
+
+/* ========== スナップショット ========== */
+/* 書き手のスレッドが更新し続けている間に全件をファイルへ書き出す。TC は tchdbcopy
+ * （終わるまで書き手を止める）、自作KVM は kvm_snapshot して kvm_snap_foreach で書く。
+ * 書き出しの時間と、書き手の ops/sec（書き出す前の基準と書き出し中）と
+ * 書き出し中の一回の put の最大の待ちを比べる */
+#define SNAP_BASE_SEC 0.2       /* 書き出す前に書き手だけを回して基準を取る時間 */
 
 typedef struct {
-    uint8_t *mem;
-    size_t mem_size;
-    uint8_t *bloom;
-    uint32_t *buckets;
-    size_t write_pos;
-    size_t count;
-} KVM;
-
-static inline uint32_t fnv1a(const char *key, size_t len) {
-    uint32_t h = 2166136261u;
-    for (size_t i = 0; i < len; i++)
-        h = (h ^ (uint8_t)key[i]) * 16777619u;
-    return h;
-}
-
-static inline uint32_t hash2(const char *key, size_t len) {
-    uint32_t h = 0x5bd1e995;
-    for (size_t i = 0; i < len; i++)
-        h = ((h << 5) + h) ^ key[i];
-    return h;
-}
-
-static inline uint32_t hash3(const char *key, size_t len) {
-    uint32_t h = 0x811c9dc5;
-    for (size_t i = 0; i < len; i++)
-        h = (h * 31) + key[i];
-    return h;
-}
-
-static inline void bloom_add(KVM *db, const char *key, size_t len) {
-    uint32_t h1 = fnv1a(key, len) % BLOOM_SIZE;
-    uint32_t h2 = hash2(key, len) % BLOOM_SIZE;
-    uint32_t h3 = hash3(key, len) % BLOOM_SIZE;
-    db->bloom[h1 >> 3] |= (1 << (h1 & 7));
-    db->bloom[h2 >> 3] |= (1 << (h2 & 7));
-    db->bloom[h3 >> 3] |= (1 << (h3 & 7));
-}
-
-static inline int bloom_maybe(KVM *db, const char *key, size_t len) {
-    uint32_t h1 = fnv1a(key, len) % BLOOM_SIZE;
-    uint32_t h2 = hash2(key, len) % BLOOM_SIZE;
-    uint32_t h3 = hash3(key, len) % BLOOM_SIZE;
-    return (db->bloom[h1 >> 3] & (1 << (h1 & 7))) &&
-           (db->bloom[h2 >> 3] & (1 << (h2 & 7))) &&
-           (db->bloom[h3 >> 3] & (1 << (h3 & 7)));
-}
-
-KVM *kvm_open() {
-    KVM *db = calloc(1, sizeof(KVM));
-    db->mem_size = POOL_SIZE;
-    db->mem = mmap(NULL, db->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (db->mem == MAP_FAILED) { db->mem = malloc(db->mem_size); }
-    memset(db->mem, 0, DATA_OFF);
-    db->bloom = db->mem + BLOOM_OFF;
-    db->buckets = (uint32_t*)(db->mem + BUCKET_OFF);
-    db->write_pos = DATA_OFF;
-    return db;
-}
-
-void kvm_close(KVM *db) {
-    if (db) { munmap(db->mem, db->mem_size); free(db); }
-}
-
-int kvm_put(KVM *db, const char *key, const char *value) {
-    uint32_t klen = strlen(key), vlen = strlen(value);
-    size_t entry_size = (sizeof(Entry) + klen + vlen + 7) & ~7;
-    if (db->write_pos + entry_size > db->mem_size) return -1;
-    uint32_t bucket = fnv1a(key, klen) % BUCKET_COUNT;
-    Entry *e = (Entry*)(db->mem + db->write_pos);
-    e->klen = klen; e->vlen = vlen; e->next = db->buckets[bucket];
-    memcpy(e->data, key, klen);
-    memcpy(e->data + klen, value, vlen);
-    db->buckets[bucket] = db->write_pos;
-    bloom_add(db, key, klen);
-    db->write_pos += entry_size;
-    db->count++;
-    return 0;
+    TCHDB *hdb;             /* どちらか一方を使う */
+    KVM *kvm;
+    int N;
+    char **keys, **vals, **upds;
+    atomic_int stop;
+    atomic_long puts;
+    atomic_ullong maxns;    /* 一回の put の最大（ns）。読んだら 0 に戻す */
+} SNAPARG;
+
+static void *snap_writer(void *p) {
+    SNAPARG *a = p;
+    RNG rng;
+    rng_seed(&rng, 2468);
+    for (long i = 0; !atomic_load(&a->stop); i++) {
+        int r = (int)rng_below(&rng, a->N);
+        const char *v = (i & 1) ? a->upds[r] : a->vals[r];
+        uint64_t t = now_ns();
+        if (a->hdb) tchdbput2(a->hdb, a->keys[r], v);
+        else kvm_put(a->kvm, a->keys[r], v);
+        t = now_ns() - t;
+        if (t > atomic_load_explicit(&a->maxns, memory_order_relaxed)) atomic_store(&a->maxns, t);
+        atomic_fetch_add_explicit(&a->puts, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static int snap_write_cb(const char *kbuf, uint32_t klen, const char *vbuf, uint32_t vlen, void *op) {
+    FILE *f = op;
+    fwrite(kbuf, 1, klen, f);
+    fputc('\t', f);
+    fwrite(vbuf, 1, vlen, f);
+    fputc('\n', f);
+    return 1;
+}
+
+static void snap_export(SNAPARG *a, const char *path) {
+    if (a->hdb) {
+        if (!tchdbcopy(a->hdb, path)) printf("  tchdbcopy failed\n");
+        return;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) return;
+    KVMSNAP *sn = kvm_snapshot(a->kvm);
+    if (!sn || kvm_snap_foreach(sn, snap_write_cb, f) < 0) printf("  kvm_snapshot failed\n");
+    kvm_snap_del(sn);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
 }
 
-char *kvm_get(KVM *db, const char *key) {
-    uint32_t klen = strlen(key);
-    if (!bloom_maybe(db, key, klen)) return NULL;
-    uint32_t off = db->buckets[fnv1a(key, klen) % BUCKET_COUNT];
-    while (off >= DATA_OFF) {
-        Entry *e = (Entry*)(db->mem + off);
-        if (e->klen == klen && memcmp(e->data, key, klen) == 0) {
-            char *v = malloc(e->vlen + 1);
-            memcpy(v, e->data + e->klen, e->vlen);
-            v[e->vlen] = '\0';
-            return v;
+void bench_snap(int N, char **keys, char **vals, char **upds) {
+    printf("\n>>> スナップショット (%d records, 書き手 1 スレッドが更新し続ける間に全件を書き出す)\n", N);
+    printf("  %-14s │ Export (s) │ Writer ops/sec  Exporting │ Max put (us) │\n", "Config");
+    for (int k = 0; k < 3; k++) {
+        SNAPARG a = { 0 };
+        a.N = N;
+        a.keys = keys; a.vals = vals; a.upds = upds;
+        const char *name = k == 0 ? "TokyoCabinet" : k == 1 ? "KVM (chain)" : "KVM-Line";
+        if (k == 0) {
+            remove("bench_tc.tch");
+            a.hdb = tchdbnew();
+            tchdbsetmutex(a.hdb);
+            tchdbtune(a.hdb, N * 2, -1, -1, HDBTLARGE);
+            if (!tchdbopen(a.hdb, "bench_tc.tch", HDBOWRITER | HDBOCREAT | HDBOTRUNC)) {
+                printf("Tokyo Cabinet open error: %s\n", tchdberrmsg(tchdbecode(a.hdb)));
+                exit(1);
+            }
+            for (int i = 0; i < N; i++) tchdbput2(a.hdb, keys[i], vals[i]);
+        } else {
+            remove("bench_kvm.kvm");
+            a.kvm = kvm_new();
+            kvm_setmutex(a.kvm);
+            kvm_tune(a.kvm, N, k == 2 ? KVMTLINE : 0);
+            kvm_setbloom(a.kvm, N, 0.01);
+            if (kvm_open(a.kvm, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+                printf("KVM open error\n");
+                exit(1);
+            }
+            for (int i = 0; i < N; i++) kvm_put(a.kvm, keys[i], vals[i]);
+        }
+        pthread_t th;
+        pthread_create(&th, NULL, snap_writer, &a);
+        double t0 = now_sec();
+        while (now_sec() - t0 < SNAP_BASE_SEC) sched_yield();
+        long p0 = atomic_load(&a.puts);
+        double t1 = now_sec();
+        atomic_store(&a.maxns, 0);
+        snap_export(&a, "bench_snap.out");
+        double t2 = now_sec();
+        long p1 = atomic_load(&a.puts);
+        uint64_t mx = atomic_load(&a.maxns);
+        atomic_store(&a.stop, 1);
+        pthread_join(th, NULL);
+        printf("  %-14s │ %10.4f │ %14.0f %10.0f │ %12.1f │\n", name, t2 - t1,
+               p0 / (t1 - t0), (p1 - p0) / (t2 - t1), mx / 1000.0);
+        if (a.hdb) {
+            tchdbclose(a.hdb);
+            tchdbdel(a.hdb);
+            remove("bench_tc.tch");
+        } else {
+            kvm_del(a.kvm);
+            remove("bench_kvm.kvm");
         }
-        off = e->next;
+        remove("bench_snap.out");
     }
-    return NULL;
 }
 
-/* ========== ベンチマーク ========== */
-double now_sec() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec + tv.tv_usec * 1e-6;
+/* ========== キャッシュ（KVMTCACHE） ========== */
+/* 全体の 1/2, 1/4, 1/10 の大きさに止めた KVMTCACHE を cache-aside で使う。
+ * zipf で引いて無ければ元のデータから作って put する（put は追い出しで必ず通る）。
+ * 先に ops 回回して埋めてから、次の ops 回の当たり率と速さを測る */
+#define CACHE_VLEN 200
+#define CACHE_RING_MIN ((size_t)2 << 20)  /* 輪はこれより小さくしない（件数が少ない時は比が変わる） */
+static const int cache_frac[] = { 2, 4, 10 };
+#define NCFRAC ((int)(sizeof(cache_frac) / sizeof(cache_frac[0])))
+
+static uint32_t cache_value(char *v, int id) {
+    int n = sprintf(v, "value_%d_", id);
+    memset(v + n, 'a' + id % 26, CACHE_VLEN - n);
+    return CACHE_VLEN;
 }
 
-void print_result(const char *name, const char *op, int n, double time) {
-    printf("  %-12s | %-10s | %12.2f ops/sec | %.4f sec\n", name, op, n / time, time);
+static void cache_run(KVM *kvm, char **keys, KEYDIST *d, RNG *r, int ops, long *hits) {
+    char v[CACHE_VLEN];
+    for (int i = 0; i < ops; i++) {
+        int id = (int)keydist_next(d, r);
+        char *got = kvm_get2(kvm, keys[id], strlen(keys[id]), NULL);
+        if (got) {
+            (*hits)++;
+            free(got);
+            continue;
+        }
+        uint32_t vl = cache_value(v, id);
+        if (kvm_put2(kvm, keys[id], strlen(keys[id]), v, vl) != 0) {
+            printf("KVM cache put error\n");
+            exit(1);
+        }
+    }
 }
 
-int main(int argc, char **argv) {
-    int N = (argc > 1) ? atoi(argv[1]) : 100000;
-    
-    printf("╔══════════════════════════════════════════════════════════════════╗\n");
-    printf("║       Tokyo Cabinet vs 自作KVM ベンチマーク対決                  ║\n");
-    printf("╠══════════════════════════════════════════════════════════════════╣\n");
-    printf("║  Records: %-6d                                                 ║\n", N);
-    printf("╚══════════════════════════════════════════════════════════════════╝\n\n");
-    
-    /* テストデータ生成 */
-    char **keys = malloc(N * sizeof(char*));
-    char **vals = malloc(N * sizeof(char*));
-    char **miss = malloc(N * sizeof(char*));
-    for (int i = 0; i < N; i++) {
-        keys[i] = malloc(32); vals[i] = malloc(64); miss[i] = malloc(32);
-        sprintf(keys[i], "key_%08d", i);
-        sprintf(vals[i], "value_%d_data", i);
-        sprintf(miss[i], "miss_%08d", i);
+void bench_cache(int N, char **keys) {
+    int ops = N * 2;
+    size_t total = 0;
+    for (int i = 0; i < N; i++) total += entry_size(strlen(keys[i]), CACHE_VLEN);
+    printf("\n>>> キャッシュ (KVMTCACHE, %d records x %dB = %.1f MB, zipf 0.99 で %d 回引いて無ければ put)\n",
+           N, CACHE_VLEN, total / 1048576.0, ops);
+    printf("  %-16s │ Cache/Data │ Hit (%%) │   ops/sec │    Keys │\n", "Config");
+    for (int k = 0; k < 2; k++) {
+        for (int c = 0; c < NCFRAC; c++) {
+            KVM *kvm = kvm_new();
+            int opts = KVMTCACHE | (k ? KVMTLINE : 0);
+            kvm_tune(kvm, N, opts);
+            /* 索引表の分を足しておく */
+            size_t want = total / cache_frac[c];
+            if (want < CACHE_RING_MIN) want = CACHE_RING_MIN;
+            kvm_setlimit(kvm, want + table_bytes(kvm, kvm->nbuckets) + 64 + HDR_SIZE);
+            if (kvm_open(kvm, NULL, 0) != 0) {
+                printf("KVM open error\n");
+                exit(1);
+            }
+            KEYDIST d;
+            RNG r;
+            keydist_init(&d, KD_ZIPF, N, 0.99);
+            rng_seed(&r, 777);
+            long hits = 0;
+            cache_run(kvm, keys, &d, &r, ops, &hits);
+            hits = 0;
+            double t0 = now_sec();
+            cache_run(kvm, keys, &d, &r, ops, &hits);
+            double t = now_sec() - t0;
+            char name[32];
+            snprintf(name, sizeof(name), "%s 1/%d", k ? "KVM-Line" : "KVM (chain)", cache_frac[c]);
+            size_t ring = kvm->mem_size - kvm->ring_off;
+            printf("  %-16s │ %10.3f │ %7.2f │ %9.0f │ %7zu │\n", name, (double)ring / total,
+                   100.0 * hits / ops, ops / t, kvm->count);
+            kvm_del(kvm);
+        }
     }
-    
-    double tc_write, tc_seq, tc_rand, tc_miss;
-    double kvm_write, kvm_seq, kvm_rand, kvm_miss;
-    double t0;
-    
-    /* ========== Tokyo Cabinet ========== */
-    printf(">>> Tokyo Cabinet (Hash DB)\n");
-    remove("bench_tc.tch");
-    
-    TCHDB *hdb = tchdbnew();
-    tchdbsetmutex(hdb);
-    tchdbtune(hdb, N * 2, -1, -1, HDBTLARGE);  /* バケット数調整 */
-    
-    if (!tchdbopen(hdb, "bench_tc.tch", HDBOWRITER | HDBOCREAT | HDBOTRUNC)) {
-        printf("Tokyo Cabinet open error: %s\n", tchdberrmsg(tchdbecode(hdb)));
-        return 1;
+    /* 期限の分の手間：put と put_ttl、その後の get。kvm_sweep は 1 秒で切れるように
+     * 置き直して、全部が切れてから測る */
+    printf("  %-16s │ %11s │ %11s │ %11s │\n", "TTL", "Put", "Get", "Sweep");
+    for (int k = 0; k < 2; k++) {
+        KVM *kvm = kvm_new();
+        kvm_tune(kvm, N, 0);
+        kvm_setbloom(kvm, N, 0.01);
+        kvm_open(kvm, NULL, 0);
+        char v[CACHE_VLEN];
+        double t0 = now_sec();
+        for (int i = 0; i < N; i++) {
+            uint32_t vl = cache_value(v, i);
+            if (k) kvm_put_ttl2(kvm, keys[i], strlen(keys[i]), v, vl, 3600);
+            else kvm_put2(kvm, keys[i], strlen(keys[i]), v, vl);
+        }
+        double tp = now_sec() - t0;
+        t0 = now_sec();
+        for (int i = 0; i < N; i++) free(kvm_get2(kvm, keys[i], strlen(keys[i]), NULL));
+        double tg = now_sec() - t0;
+        double ts = 0;
+        if (k) {
+            uint32_t start = kvm_clock();
+            for (int i = 0; i < N; i++)
+                kvm_put_ttl2(kvm, keys[i], strlen(keys[i]), v, cache_value(v, i), 1);
+            /* 期限は秒単位なので、全部が切れるまで待つ */
+            while (kvm_clock() <= start + 1) usleep(10000);
+            t0 = now_sec();
+            int64_t n = kvm_sweep(kvm);
+            ts = now_sec() - t0;
+            if (n != N) printf("  (sweep removed %lld of %d)\n", (long long)n, N);
+        }
+        char sweep[16] = "-";
+        if (k) snprintf(sweep, sizeof(sweep), "%.0f", N / ts);
+        printf("  %-16s │ %11.0f │ %11.0f │ %11s │\n", k ? "kvm_put_ttl" : "kvm_put", N / tp, N / tg, sweep);
+        kvm_del(kvm);
     }
-    
-    /* TC Write */
+}
+
+/* ========== 統計の数え（kvm_stats） ========== */
+/* kvm_setstats(db, 0) で数えを切った DB と比べて、スレッドごとの数えの手間を測る。
+ * 差が見えやすいよう読みは値をコピーしない kvm_get_view で、-t を付けた時はその本数で
+ * 同じ読みを並べる。数えの有無を交互に STAT_REP 回流し、それぞれ一番速い回を取る */
+#define STAT_REP 5
+
+enum { ST_WRITE, ST_RAND, ST_MISS, ST_MT, NSTAT };
+static const char *const stat_name[NSTAT] = { "Write", "Rand View", "Miss View", "MT View" };
+
+typedef struct {
+    KVM *kvm;
+    char **keys;
+    int N, ops;
+    unsigned seed;
+} STARG;
+
+static atomic_size_t stat_sink;  /* 読んだ値を捨てさせない（スレッドからも足す） */
+
+static void stat_view(KVM *kvm, char **keys, int N, int ops, unsigned seed) {
+    RNG rng;
+    rng_seed(&rng, seed);
+    size_t sum = 0;
+    for (int i = 0; i < ops; i++) {
+        const char *k = keys[rng_below(&rng, N)], *vp;
+        uint32_t sp;
+        if (kvm_get_view(kvm, k, strlen(k), &vp, &sp) == 0) sum += sp;
+    }
+    atomic_fetch_add_explicit(&stat_sink, sum, memory_order_relaxed);
+}
+
+static void *stat_worker(void *p) {
+    STARG *a = p;
+    while (!atomic_load(&mt_go)) sched_yield();
+    stat_view(a->kvm, a->keys, a->N, a->ops, a->seed);
+    return NULL;
+}
+
+/* threads 本で合わせて N 回読んだ秒数 */
+static double stat_mt(KVM *kvm, char **keys, int N, int threads) {
+    pthread_t th[64];
+    STARG args[64];
+    if (threads > 64) threads = 64;
+    atomic_store(&mt_go, 0);
+    for (int i = 0; i < threads; i++) {
+        args[i] = (STARG){ kvm, keys, N, N / threads, 4242 + i * 7919 };
+        pthread_create(&th[i], NULL, stat_worker, &args[i]);
+    }
+    double t0 = now_sec();
+    atomic_store(&mt_go, 1);
+    for (int i = 0; i < threads; i++) pthread_join(th[i], NULL);
+    return now_sec() - t0;
+}
+
+/* 1 回分。t にフェーズごとの秒数を書き、開いたままの DB を返す */
+static KVM *stat_run(int N, char **keys, char **vals, char **miss, int threads, int opts, int on,
+                     double *t) {
+    KVM *kvm = kvm_new();
+    kvm_setmutex(kvm);
+    kvm_setstats(kvm, on);
+    kvm_tune(kvm, 0, opts);
+    kvm_setbloom(kvm, N, 0.01);
+    if (kvm_open(kvm, NULL, 0) != 0) {
+        printf("KVM open error\n");
+        exit(1);
+    }
+    double t0 = now_sec();
+    for (int i = 0; i < N; i++) kvm_put2(kvm, keys[i], strlen(keys[i]), vals[i], strlen(vals[i]));
+    t[ST_WRITE] = now_sec() - t0;
     t0 = now_sec();
-    for (int i = 0; i < N; i++)
-        tchdbput2(hdb, keys[i], vals[i]);
-    tchdbsync(hdb);
-    tc_write = now_sec() - t0;
-    
-    /* TC Seq Read */
+    stat_view(kvm, keys, N, N, 12345);
+    t[ST_RAND] = now_sec() - t0;
     t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = tchdbget2(hdb, keys[i]);
-        free(v);
+    stat_view(kvm, miss, N, N, 12345);
+    t[ST_MISS] = now_sec() - t0;
+    t[ST_MT] = threads > 1 ? stat_mt(kvm, keys, N, threads) : -1;
+    return kvm;
+}
+
+static void stat_print(const char *name, int line, const KVMSTAT *st) {
+    printf("  %s: %zu keys / %zu %s, load %.2f, probe %.2f, max %zu\n", name, st->count, st->nbuckets,
+           line ? "lines" : "buckets", st->load, st->probe, st->hist_max);
+    printf("    hist");
+    size_t last = st->hist_max < KVM_HIST ? st->hist_max : KVM_HIST - 1;
+    for (size_t i = 0; i <= last; i++)
+        printf(" %zu%s:%llu", i, i == KVM_HIST - 1 ? "+" : "", (unsigned long long)st->hist[i]);
+    printf("\n");
+    const uint64_t *op = st->op;
+    uint64_t absent = op[KVMCMISS] + op[KVMCBLOOM];
+    printf("    Bloom %.2f MB, fill %.3f, FPR est %.4f / seen %.4f\n", st->bloom_bytes / 1048576.0,
+           st->bloom_fill, st->bloom_fpr, absent ? (double)op[KVMCMISS] / absent : 0.0);
+    printf("    live %.2f MB, dead %.2f MB; hit %llu, miss %llu, bloom %llu, expired %llu, put %llu,"
+           " %d threads\n", st->live_bytes / 1048576.0, st->dead_bytes / 1048576.0,
+           (unsigned long long)op[KVMCHIT], (unsigned long long)op[KVMCMISS],
+           (unsigned long long)op[KVMCBLOOM], (unsigned long long)op[KVMCEXPIRED],
+           (unsigned long long)op[KVMCPUT], st->threads);
+}
+
+void bench_stats(int N, char **keys, char **vals, char **miss, int threads) {
+    printf("\n>>> 統計の数え (kvm_setstats, %d records, best of %d", N, STAT_REP);
+    if (threads > 1) printf(", MT %d threads", threads);
+    printf(")\n  %-16s │", "Config");
+    for (int p = 0; p < NSTAT; p++) printf(" %10s │", stat_name[p]);
+    printf(" (ops/sec)\n");
+    for (int k = 0; k < 2; k++) {
+        if (KVM_INDEX != 0 && k != (KVM_INDEX == 2)) continue;
+        const char *form = k ? "line" : "chain";
+        double best[2][NSTAT];
+        KVM *keep = NULL;
+        for (int r = 0; r < STAT_REP; r++) {
+            for (int j = 0; j < 2; j++) {
+                int on = (r + j) & 1;
+                double t[NSTAT];
+                KVM *kvm = stat_run(N, keys, vals, miss, threads, k ? KVMTLINE : 0, on, t);
+                for (int p = 0; p < NSTAT; p++)
+                    if (r == 0 || t[p] < best[on][p]) best[on][p] = t[p];
+                if (on && r == STAT_REP - 1) keep = kvm;
+                else kvm_del(kvm);
+            }
+        }
+        for (int on = 1; on >= 0; on--) {
+            char name[32];
+            snprintf(name, sizeof(name), "%s stats %s", form, on ? "on" : "off");
+            printf("  %-16s │", name);
+            for (int p = 0; p < NSTAT; p++) {
+                if (best[on][p] < 0) printf(" %10s │", "-");
+                else printf(" %10.0f │", N / best[on][p]);
+            }
+            printf("\n");
+        }
+        printf("  %-16s │", "cost");
+        for (int p = 0; p < NSTAT; p++) {
+            if (best[1][p] < 0) printf(" %10s │", "-");
+            else printf(" %9.1f%% │", 100.0 * (best[1][p] / best[0][p] - 1));
+        }
+        printf("\n");
+        KVMSTAT st;
+        kvm_stats(keep, &st);
+        stat_print(form, k, &st);
+        kvm_del(keep);
     }
-    tc_seq = now_sec() - t0;
+}
+
+/* ========== 範囲走査 ========== */
+/* tcbdb のカーソルと kvm_scan / kvm_prefix を比べる。キーは key_%08d なので
+ * 連番 SCAN_LEN 件の範囲と、下 2 桁を落とした前置（同じく SCAN_LEN 件）を引く */
+#define SCAN_LEN 100
+
+/* 戻り値は渡したレコード数 */
+static size_t tc_scan(BDBCUR *cur, const char *start, const char *end, size_t *sum) {
+    size_t n = 0;
+    int ks, vs, el = strlen(end);
+    if (!tcbdbcurjump2(cur, start)) return 0;
+    do {
+        const char *k = tcbdbcurkey3(cur, &ks);
+        if (!k) break;
+        int m = ks < el ? ks : el, c = memcmp(k, end, m);
+        if (c > 0 || (c == 0 && ks >= el)) break;
+        const char *v = tcbdbcurval3(cur, &vs);
+        *sum += vs ? (uint8_t)v[0] : 1;
+        n++;
+    } while (tcbdbcurnext(cur));
+    return n;
+}
+
+static size_t tc_prefix(BDBCUR *cur, const char *prefix, size_t *sum) {
+    size_t n = 0;
+    int ks, vs, pl = strlen(prefix);
+    if (!tcbdbcurjump2(cur, prefix)) return 0;
+    do {
+        const char *k = tcbdbcurkey3(cur, &ks);
+        if (!k || ks < pl || memcmp(k, prefix, pl) != 0) break;
+        const char *v = tcbdbcurval3(cur, &vs);
+        *sum += vs ? (uint8_t)v[0] : 1;
+        n++;
+    } while (tcbdbcurnext(cur));
+    return n;
+}
+
+enum { SC_WRITE, SC_RANGE, SC_PREFIX, SC_COMPACT, NSCAN };
+
+void bench_scan(int N, char **keys, char **vals) {
+    static const char *rowname[NSCAN] = { "Ordered Write", "Range Scan", "Prefix Scan", "Scan (compact)" };
+    double res[NSCAN][3];
+    int nscan = N / SCAN_LEN > 0 ? N / SCAN_LEN : 1;
+    size_t sum = 0, recs;
+    RNG rng;
+    char start[32], end[32];
     
-    /* TC Rand Read */
-    srand(12345);
+    printf("\n>>> 範囲走査 (%d scans x %d records)\n", nscan, SCAN_LEN);
+    remove("bench_tc.tcb");
+    TCBDB *bdb = tcbdbnew();
+    tcbdbsetmutex(bdb);
+    tcbdbtune(bdb, 0, 0, N / 64 + 1, -1, -1, BDBTLARGE);
+    if (!tcbdbopen(bdb, "bench_tc.tcb", BDBOWRITER | BDBOCREAT | BDBOTRUNC)) {
+        printf("Tokyo Cabinet open error: %s\n", tcbdberrmsg(tcbdbecode(bdb)));
+        exit(1);
+    }
+    double t0 = now_sec();
+    for (int i = 0; i < N; i++) tcbdbput2(bdb, keys[i], vals[i]);
+    tcbdbsync(bdb);
+    res[SC_WRITE][0] = N / (now_sec() - t0);
+    BDBCUR *cur = tcbdbcurnew(bdb);
+    rng_seed(&rng, 2468);
+    recs = 0;
     t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = tchdbget2(hdb, keys[rand() % N]);
-        free(v);
+    for (int s = 0; s < nscan; s++) {
+        int a = (int)rng_below(&rng, N);
+        sprintf(start, "key_%08d", a);
+        sprintf(end, "key_%08d", a + SCAN_LEN);
+        recs += tc_scan(cur, start, end, &sum);
     }
-    tc_rand = now_sec() - t0;
-    
-    /* TC Miss Read */
+    res[SC_RANGE][0] = recs / (now_sec() - t0);
+    rng_seed(&rng, 1357);
+    recs = 0;
     t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = tchdbget2(hdb, miss[i]);
-        free(v);
+    for (int s = 0; s < nscan; s++) {
+        sprintf(start, "key_%06d", (int)rng_below(&rng, (N + 99) / 100));
+        recs += tc_prefix(cur, start, &sum);
     }
-    tc_miss = now_sec() - t0;
-    
-    tchdbclose(hdb);
-    tchdbdel(hdb);
-    
-    int64_t tc_size = 0;
-    tcstatfile("bench_tc.tch", NULL, &tc_size, NULL);
-    printf("  File size: %.2f MB\n", (double)tc_size / 1024 / 1024);
-    print_result("TokyoCabinet", "Write", N, tc_write);
-    print_result("TokyoCabinet", "Seq Read", N, tc_seq);
-    print_result("TokyoCabinet", "Rand Read", N, tc_rand);
-    print_result("TokyoCabinet", "Miss Read", N, tc_miss);
-    
-    /* ========== 自作KVM ========== */
-    printf("\n>>> 自作KVM (mmap + Bloom Filter)\n");
-    
-    KVM *kvm = kvm_open();
+    res[SC_PREFIX][0] = recs / (now_sec() - t0);
+    res[SC_COMPACT][0] = 0;  /* B+tree の葉は最初からキー順 */
+    tcbdbcurdel(cur);
+    tcbdbclose(bdb);
+    tcbdbdel(bdb);
+    remove("bench_tc.tcb");
     
-    /* KVM Write */
-    t0 = now_sec();
-    for (int i = 0; i < N; i++)
-        kvm_put(kvm, keys[i], vals[i]);
-    kvm_write = now_sec() - t0;
+    for (int k = 0; k < 2; k++) {
+        remove("bench_kvm.kvm");
+        KVM *kvm = kvm_new();
+        kvm_setmutex(kvm);
+        kvm_setorder(kvm);
+        kvm_tune(kvm, 0, k ? KVMTLINE : 0);
+        kvm_setbloom(kvm, N, 0.01);
+        if (kvm_open(kvm, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+            printf("KVM open error\n");
+            exit(1);
+        }
+        t0 = now_sec();
+        for (int i = 0; i < N; i++) kvm_put(kvm, keys[i], vals[i]);
+        kvm_sync(kvm);
+        res[SC_WRITE][1 + k] = N / (now_sec() - t0);
+        for (int pass = 0; pass < 2; pass++) {
+            /* 2 周目はキー順に詰め直した後 */
+            if (pass) kvm_optimize(kvm, NULL);
+            rng_seed(&rng, 2468);
+            recs = 0;
+            t0 = now_sec();
+            for (int s = 0; s < nscan; s++) {
+                int a = (int)rng_below(&rng, N);
+                sprintf(start, "key_%08d", a);
+                sprintf(end, "key_%08d", a + SCAN_LEN);
+                recs += kvm_scan(kvm, start, end, scan_count, &sum);
+            }
+            res[pass ? SC_COMPACT : SC_RANGE][1 + k] = recs / (now_sec() - t0);
+        }
+        rng_seed(&rng, 1357);
+        recs = 0;
+        t0 = now_sec();
+        for (int s = 0; s < nscan; s++) {
+            sprintf(start, "key_%06d", (int)rng_below(&rng, (N + 99) / 100));
+            recs += kvm_prefix(kvm, start, scan_count, &sum);
+        }
+        res[SC_PREFIX][1 + k] = recs / (now_sec() - t0);
+        kvm_del(kvm);
+        remove("bench_kvm.kvm");
+    }
+    if (sum == 0) printf("  (no hits)\n");
     
-    /* KVM Seq Read */
-    t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = kvm_get(kvm, keys[i]);
-        free(v);
+    printf("  %-14s │ TC B+tree    │  自作KVM   │  KVM-Line  │ (records/sec)\n", "Phase");
+    for (int r = 0; r < NSCAN; r++) {
+        if (res[r][0] > 0) printf("  %-14s │ %12.0f │", rowname[r], res[r][0]);
+        else printf("  %-14s │ %12s │", rowname[r], "-");
+        printf(" %10.0f │ %10.0f │\n", res[r][1], res[r][2]);
+    }
+}
+
+/* ========== 値の圧縮 ========== */
+/* 200B〜20KB（対数一様）の JSON 風の値を N / 10 件置いて読む。TC は HDBTDEFLATE の有無、
+ * KVM は KVMTLZ の有無と、先頭 COMP_TRAIN 件から学習した辞書の有無を比べる */
+#define COMP_TRAIN 100
+
+static int comp_value(char *v, int id, uint32_t len, RNG *rng) {
+    static const char *status[] = { "active", "pending", "suspended", "deleted" };
+    int n = sprintf(v, "{\"id\":%d,\"items\":[", id);
+    while ((uint32_t)n + 160 < len)
+        n += sprintf(v + n, "{\"sku\":\"SKU-%06llu\",\"name\":\"item %llu\",\"price\":%llu.%02llu,"
+                     "\"qty\":%llu,\"status\":\"%s\",\"updated_at\":\"2026-%02llu-%02lluT12:00:00Z\"},",
+                     (unsigned long long)rng_below(rng, 1000000), (unsigned long long)rng_below(rng, 5000),
+                     (unsigned long long)rng_below(rng, 1000), (unsigned long long)rng_below(rng, 100),
+                     (unsigned long long)rng_below(rng, 20) + 1, status[rng_below(rng, 4)],
+                     (unsigned long long)rng_below(rng, 12) + 1, (unsigned long long)rng_below(rng, 28) + 1);
+    n += sprintf(v + n, "{}],\"owner\":\"user%d@example.com\"}", id);
+    return n;
+}
+
+enum { CP_WRITE, CP_READ, CP_SIZE, NCOMP };
+
+void bench_comp(int N) {
+    static const char *rowname[NCOMP] = { "Write", "Read", "Used (MB)" };
+    enum { NCOL = 5 };
+    double res[NCOMP][NCOL];
+    int nrec = N / 10 > COMP_TRAIN ? N / 10 : COMP_TRAIN;
+    VALDIST vd;
+    valdist_parse(&vd, "200~20000");
+    RNG rng;
+    rng_seed(&rng, 8642);
+    char **keys = malloc(nrec * sizeof(char*)), **vals = malloc(nrec * sizeof(char*));
+    uint32_t *vlen = malloc(nrec * sizeof(uint32_t));
+    double raw = 0;
+    char *tmp = malloc(YCSB_VMAX);
+    for (int i = 0; i < nrec; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "doc_%08d", i);
+        vlen[i] = comp_value(tmp, i, valdist_next(&vd, &rng), &rng);
+        vals[i] = malloc(vlen[i] + 1);
+        memcpy(vals[i], tmp, vlen[i] + 1);
+        raw += vlen[i];
     }
-    kvm_seq = now_sec() - t0;
+    free(tmp);
+    uint32_t *order = malloc(nrec * sizeof(uint32_t));
+    for (int i = 0; i < nrec; i++) order[i] = rng_below(&rng, nrec);
     
-    /* KVM Rand Read */
-    srand(12345);
-    t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = kvm_get(kvm, keys[rand() % N]);
-        free(v);
+    printf("\n>>> 値の圧縮 (%d records, %.2f MB of values)\n", nrec, raw / 1024 / 1024);
+    size_t sum = 0;
+    for (int k = 0; k < 2; k++) {
+        remove("bench_tc.tch");
+        TCHDB *hdb = tchdbnew();
+        tchdbtune(hdb, nrec * 2, 4, 10, HDBTLARGE | (k ? HDBTDEFLATE : 0));
+        if (!tchdbopen(hdb, "bench_tc.tch", HDBOWRITER | HDBOCREAT | HDBOTRUNC)) {
+            printf("Tokyo Cabinet open error: %s\n", tchdberrmsg(tchdbecode(hdb)));
+            exit(1);
+        }
+        double t0 = now_sec();
+        for (int i = 0; i < nrec; i++) tchdbput(hdb, keys[i], 12, vals[i], vlen[i]);
+        tchdbsync(hdb);
+        res[CP_WRITE][k] = nrec / (now_sec() - t0);
+        t0 = now_sec();
+        for (int i = 0; i < nrec; i++) {
+            int vs;
+            char *v = tchdbget(hdb, keys[order[i]], 12, &vs);
+            if (v) { sum += (uint8_t)v[vs / 2]; free(v); }
+        }
+        res[CP_READ][k] = nrec / (now_sec() - t0);
+        res[CP_SIZE][k] = tchdbfsiz(hdb) / 1024.0 / 1024;
+        tchdbclose(hdb);
+        tchdbdel(hdb);
+        remove("bench_tc.tch");
+    }
+    for (int k = 0; k < 3; k++) {
+        remove("bench_kvm.kvm");
+        KVM *kvm = kvm_new();
+        kvm_tune(kvm, nrec, k ? KVMTLZ : 0);
+        kvm_setbloom(kvm, nrec, 0.01);
+        if (kvm_open(kvm, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+            printf("KVM open error\n");
+            exit(1);
+        }
+        double t0 = now_sec();
+        if (k == 2) {
+            /* 学習の時間も書き込みに含める */
+            uint32_t n = nrec < COMP_TRAIN ? nrec : COMP_TRAIN;
+            if (kvm_setdict(kvm, (const void *const *)vals, vlen, n) != 0) printf("  kvm_setdict failed\n");
+        }
+        for (int i = 0; i < nrec; i++) kvm_put2(kvm, keys[i], 12, vals[i], vlen[i]);
+        kvm_sync(kvm);
+        res[CP_WRITE][2 + k] = nrec / (now_sec() - t0);
+        t0 = now_sec();
+        for (int i = 0; i < nrec; i++) {
+            uint32_t vs;
+            char *v = kvm_get2(kvm, keys[order[i]], 12, &vs);
+            if (v) { sum += (uint8_t)v[vs / 2]; free(v); }
+        }
+        res[CP_READ][2 + k] = nrec / (now_sec() - t0);
+        res[CP_SIZE][2 + k] = (kvm->write_pos - kvm->data_off) / 1024.0 / 1024;
+        kvm_del(kvm);
+        remove("bench_kvm.kvm");
     }
-    kvm_rand = now_sec() - t0;
+    if (sum == 0) printf("  (no hits)\n");
     
-    /* KVM Miss Read */
+    printf("  %-10s │ TC plain │ TC deflate │ KVM plain │  KVM LZ  │ KVM LZ+dict │\n", "Phase");
+    for (int r = 0; r < NCOMP; r++) {
+        if (r == CP_SIZE)
+            printf("  %-10s │ %8.2f │   %8.2f │  %8.2f │ %8.2f │    %8.2f │\n", rowname[r],
+                   res[r][0], res[r][1], res[r][2], res[r][3], res[r][4]);
+        else
+            printf("  %-10s │ %8.0f │   %8.0f │  %8.0f │ %8.0f │    %8.0f │\n", rowname[r],
+                   res[r][0], res[r][1], res[r][2], res[r][3], res[r][4]);
+    }
+    printf("  (Write / Read は ops/sec)\n");
+    for (int i = 0; i < nrec; i++) { free(keys[i]); free(vals[i]); }
+    free(keys);
+    free(vals);
+    free(vlen);
+    free(order);
+}
+
+/* ========== YCSB ========== */
+/* YCSB の A〜F を真似たワークロード。nrec 件を読み込んだあと、あらかじめ作った
+ * 操作列を選んだエンジンに同じ順で流す。キーは "user" + 12 桁の固定長 */
+enum { YC_READ, YC_UPDATE, YC_INSERT, YC_SCAN, YC_RMW, NYCOP };
+static const char *ycop_name[NYCOP] = { "Read", "Update", "Insert", "Scan", "RMW" };
+
+#define YC_KLEN 16
+
+typedef struct {
+    char name;
+    double mix[NYCOP];      /* 各操作の割合 */
+    int dist;               /* KD_* */
+} YCSBMIX;
+
+static const YCSBMIX ycsb_mix[] = {
+    { 'A', { 0.50, 0.50, 0, 0, 0 }, KD_ZIPF },
+    { 'B', { 0.95, 0.05, 0, 0, 0 }, KD_ZIPF },
+    { 'C', { 1.00, 0, 0, 0, 0 }, KD_ZIPF },
+    { 'D', { 0.95, 0, 0.05, 0, 0 }, KD_LATEST },
+    { 'E', { 0, 0, 0.05, 0.95, 0 }, KD_ZIPF },
+    { 'F', { 0.50, 0, 0, 0, 0.50 }, KD_ZIPF },
+};
+
+typedef struct {
+    uint64_t key;
+    uint32_t vlen;
+    uint8_t op, scan;       /* scan は YC_SCAN の件数 */
+} YCOP;
+
+typedef struct {
+    int nrec, ops, dist;    /* dist < 0 なら各ワークロードの既定 */
+    double theta;
+    VALDIST vsize;
+    char *kbuf;             /* キー id i は kbuf + i * YC_KLEN */
+    char *vbuf;             /* 値はこの先頭から vlen バイト */
+} YCSBCONF;
+
+/* 操作列を作る。insert は新しいキー id を振るのでキー数が増えていく */
+static int ycsb_trace(const YCSBCONF *c, const YCSBMIX *m, YCOP *tr) {
+    RNG rng;
+    KEYDIST d;
+    rng_seed(&rng, 777 + m->name);
+    keydist_init(&d, c->dist >= 0 ? c->dist : m->dist, c->nrec, c->theta);
+    int ninsert = 0;
+    for (int i = 0; i < c->ops; i++) {
+        double u = rng_double(&rng), acc = 0;
+        int op = YC_READ;
+        for (int k = 0; k < NYCOP; k++) {
+            acc += m->mix[k];
+            if (u < acc) { op = k; break; }
+        }
+        YCOP *o = &tr[i];
+        o->op = op;
+        o->vlen = valdist_next(&c->vsize, &rng);
+        o->scan = 0;
+        if (op == YC_INSERT) {
+            o->key = d.n++;
+            ninsert++;
+        } else {
+            o->key = keydist_next(&d, &rng);
+            if (op == YC_SCAN) o->scan = 1 + rng_below(&rng, YCSB_SCAN_MAX);
+        }
+    }
+    return ninsert;
+}
+
+static inline void yc_put(const ENGINE *e, void *db, const YCSBCONF *c, uint64_t key, uint32_t vlen) {
+    e->put(db, c->kbuf + key * YC_KLEN, YC_KLEN, c->vbuf + (key & 4095), vlen);
+}
+
+static inline int yc_get(const ENGINE *e, void *db, const YCSBCONF *c, uint64_t key) {
+    int sp = 0;
+    char *v = e->get(db, c->kbuf + key * YC_KLEN, YC_KLEN, &sp);
+    if (!v) return -1;
+    free(v);
+    return sp;
+}
+
+static volatile size_t yc_sink;  /* 走査で読んだ値を捨てさせない */
+
+/* 読み込みと操作列の実行。戻り値は操作列の ops/sec、load に読み込みの ops/sec */
+static double ycsb_exec(const ENGINE *e, void *db, const YCSBCONF *c, const YCOP *tr, double *load, HIST *hs) {
+    RNG rng;
+    rng_seed(&rng, 4242);
+    double t0 = now_sec();
+    for (int i = 0; i < c->nrec; i++) yc_put(e, db, c, i, valdist_next(&c->vsize, &rng));
+    *load = c->nrec / (now_sec() - t0);
+    size_t sum = 0;
     t0 = now_sec();
-    for (int i = 0; i < N; i++) {
-        char *v = kvm_get(kvm, miss[i]);
+    for (int i = 0; i < c->ops; i++) {
+        const YCOP *o = &tr[i];
+        switch (o->op) {
+        case YC_READ: TIMED(&hs[YC_READ], i, yc_get(e, db, c, o->key)); break;
+        case YC_UPDATE: TIMED(&hs[YC_UPDATE], i, yc_put(e, db, c, o->key, o->vlen)); break;
+        case YC_INSERT: TIMED(&hs[YC_INSERT], i, yc_put(e, db, c, o->key, o->vlen)); break;
+        case YC_SCAN: TIMED(&hs[YC_SCAN], i, e->range(db, c->kbuf + o->key * YC_KLEN, YC_KLEN, o->scan, &sum)); break;
+        case YC_RMW: TIMED(&hs[YC_RMW], i, { yc_get(e, db, c, o->key); yc_put(e, db, c, o->key, o->vlen); }); break;
+        }
+    }
+    double run = c->ops / (now_sec() - t0);
+    yc_sink += sum;
+    return run;
+}
+
+/* 1 つのワークロードを選んだエンジンで回して表にする。走査のある E は range を
+ * 持つ物だけで、自作KVM は kvm_setorder して流す */
+static void ycsb_one(YCSBCONF *c, const YCSBMIX *m) {
+    YCOP *tr = malloc((size_t)c->ops * sizeof(YCOP));
+    int ninsert = ycsb_trace(c, m, tr);
+    uint64_t nkeys = (uint64_t)c->nrec + ninsert;
+    double run[ENGINE_MAX], load[ENGINE_MAX];
+    const ENGINE *used[ENGINE_MAX];
+    int ne = 0;
+    HIST *hs = calloc(ENGINE_MAX * NYCOP, sizeof(HIST));
+    printf("\n>>> YCSB %c (%s, %d records, %d ops, value %u-%u%s)\n", m->name,
+           keydist_name[c->dist >= 0 ? c->dist : m->dist], c->nrec, c->ops, c->vsize.lo, c->vsize.hi,
+           c->vsize.log ? " log" : "");
+    int ordered = m->mix[YC_SCAN] > 0;
+    for (int k = 0; k < nengine; k++) {
+        const ENGINE *e = engines[k];
+        if (ordered && !e->range) continue;
+        void *db = e->open(e, nkeys, ordered ? BK_ORDER : 0);
+        run[ne] = ycsb_exec(e, db, c, tr, &load[ne], &hs[ne * NYCOP]);
+        e->close(db);
+        used[ne++] = e;
+    }
+    printf("  %-8s │", "Phase");
+    for (int k = 0; k < ne; k++) {
+        putchar(' ');
+        print_cell(used[k]->name, 12);
+        printf(" │");
+    }
+    printf(" (ops/sec)\n");
+    printf("  %-8s │", "Load");
+    for (int k = 0; k < ne; k++) printf(" %12.0f │", load[k]);
+    printf("\n  %-8s │", "Run");
+    for (int k = 0; k < ne; k++) printf(" %12.0f │", run[k]);
+    printf("\n");
+    for (int k = 0; k < ne; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%c/%s", m->name, used[k]->name);
+        print_latency(name, ycop_name, &hs[k * NYCOP], NYCOP);
+    }
+    free(hs);
+    free(tr);
+}
+
+/* which は "A"〜"F" の並び（"all" は全部） */
+void bench_ycsb(const char *which, int nrec, int ops, int dist, double theta, const VALDIST *vsize) {
+    YCSBCONF c = { nrec, ops, dist, theta, *vsize, NULL, NULL };
+    /* insert で増える分まで含めてキーを作っておく */
+    size_t nkeys = (size_t)nrec + ops;
+    c.kbuf = malloc(nkeys * YC_KLEN + 1);
+    for (size_t i = 0; i < nkeys; i++) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "user%012llu", (unsigned long long)i);
+        memcpy(c.kbuf + i * YC_KLEN, tmp, YC_KLEN);
+    }
+    c.vbuf = malloc(YCSB_VMAX + 4096);
+    RNG rng;
+    rng_seed(&rng, 99);
+    for (int i = 0; i < YCSB_VMAX + 4096; i++) c.vbuf[i] = 'a' + rng_below(&rng, 26);
+    if (strcmp(which, "all") == 0) which = "ABCDEF";
+    for (const char *w = which; *w; w++)
+        for (size_t k = 0; k < sizeof(ycsb_mix) / sizeof(ycsb_mix[0]); k++)
+            if (ycsb_mix[k].name == (*w & ~0x20)) ycsb_one(&c, &ycsb_mix[k]);
+    free(c.kbuf);
+    free(c.vbuf);
+}
+
+/* ========== 値の階層化（--tier） ========== */
+/* 値の合計が RAM の 2〜10 倍ある状況を、KVMTTIER のキャッシュの上限を値の合計の
+ * 1/2〜1/10 にして作る。pread はそのままだと OS のページキャッシュに当たり続けるので、
+ * 値ファイルは読みの間も TIER_DROP 回ごとにページキャッシュから外す（その時間は除く）。
+ * 比べる相手は全部を mmap する自作KVM と TC で、どれも閉じてページキャッシュを捨て、
+ * 開き直してから zipf で読む。"After Scan" は kvm_foreach（TC は tchdbiternext）で
+ * 全件を一度流した後に同じ読みをしたもの */
+static const int tier_ratio[] = { 2, 5, 10 };
+#define NTIER ((int)(sizeof(tier_ratio) / sizeof(tier_ratio[0])))
+
+static void drop_page_cache(const char *path) {
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+typedef struct {
+    double ops;             /* ops/sec */
+    uint64_t p50, p99;
+    double hit;             /* キャッシュの当たり率（無ければ負） */
+} TIERRES;
+
+/* 値ファイルを持つ KVM なら、その中身を OS のページキャッシュから外す。かかった時間を返す */
+#define TIER_DROP 64
+static double tier_uncache(KVM *kvm) {
+    if (!kvm || kvm->vfd < 0) return 0;
+    double t0 = now_sec();
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(kvm->vfd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    return now_sec() - t0;
+}
+
+/* keys を zipf で ops 回読む。kvm が NULL なら hdb を読む */
+static void tier_reads(KVM *kvm, TCHDB *hdb, char **keys, int nrec, int ops, TIERRES *r) {
+    HIST *h = calloc(1, sizeof(HIST));
+    KEYDIST kd;
+    RNG rng;
+    keydist_init(&kd, KD_ZIPF, nrec, 0.99);
+    rng_seed(&rng, 4711);
+    uint64_t h0 = kvm && kvm->cache ? kvm->cache->hits : 0, m0 = kvm && kvm->cache ? kvm->cache->misses : 0;
+    size_t sum = 0;
+    tier_uncache(kvm);
+    double t0 = now_sec(), td = 0;
+    for (int i = 0; i < ops; i++) {
+        if (i % TIER_DROP == TIER_DROP - 1) td += tier_uncache(kvm);
+        const char *k = keys[keydist_next(&kd, &rng)];
+        char *v;
+        int vs;
+        uint32_t kvs;
+        if (kvm) TIMED(h, i, v = kvm_get2(kvm, k, strlen(k), &kvs));
+        else TIMED(h, i, v = tchdbget(hdb, k, strlen(k), &vs));
+        if (v) { sum += (uint8_t)v[0]; free(v); }
+    }
+    r->ops = ops / (now_sec() - t0 - td);
+    r->p50 = hist_pct(h, 0.5);
+    r->p99 = hist_pct(h, 0.99);
+    r->hit = -1;
+    if (kvm && kvm->cache) {
+        uint64_t hh = kvm->cache->hits - h0, mm = kvm->cache->misses - m0;
+        r->hit = hh + mm ? 100.0 * hh / (hh + mm) : 0;
+    }
+    if (sum == 0) printf("  (no hits)\n");
+    free(h);
+}
+
+static void tier_scan(KVM *kvm, TCHDB *hdb) {
+    size_t sum = 0;
+    if (kvm) {
+        kvm_foreach(kvm, scan_count, &sum);
+        return;
+    }
+    tchdbiterinit(hdb);
+    int ks;
+    void *k;
+    while ((k = tchdbiternext(hdb, &ks))) {
+        int vs;
+        void *v = tchdbget(hdb, k, ks, &vs);
         free(v);
+        free(k);
+    }
+}
+
+static void tier_row(const char *name, double ram, const TIERRES *r) {
+    char rb[16], h0[16], h1[16];
+    if (ram > 0) snprintf(rb, sizeof(rb), "%8.1f", ram); else snprintf(rb, sizeof(rb), "%8s", "-");
+    if (r[0].hit >= 0) snprintf(h0, sizeof(h0), "%5.1f%%", r[0].hit); else snprintf(h0, sizeof(h0), "%6s", "-");
+    if (r[1].hit >= 0) snprintf(h1, sizeof(h1), "%5.1f%%", r[1].hit); else snprintf(h1, sizeof(h1), "%6s", "-");
+    printf("  %-14s │ %s │ %10.0f %7llu %8llu %s │ %10.0f %8llu %s │\n", name, rb,
+           r[0].ops, (unsigned long long)r[0].p50, (unsigned long long)r[0].p99, h0,
+           r[1].ops, (unsigned long long)r[1].p99, h1);
+}
+
+/* 値ファイルの読みを kvm_get_async で qd 件まで重ねた時の速さと 1 件ごとの待ち。
+ * 待ちは kvm_get_async を呼んでから cb が呼ばれるまで */
+typedef struct {
+    uint64_t t0;
+    HIST *h;
+    size_t *sum;
+} QDOP;
+
+static void qd_done(const char *v, uint32_t vl, void *op) {
+    QDOP *o = op;
+    hist_add(o->h, now_ns() - o->t0);
+    if (v && vl) *o->sum += (uint8_t)v[0];
+}
+
+static void tier_qd(KVM *kvm, char **keys, int nrec, int ops, int qd, TIERRES *r) {
+    HIST *h = calloc(1, sizeof(HIST));
+    QDOP *o = calloc(ops, sizeof(QDOP));
+    RNG rng;
+    rng_seed(&rng, 4711);
+    size_t sum = 0;
+    tier_uncache(kvm);
+    double t0 = now_sec(), td = 0;
+    if (qd == 0) {
+        /* 比べる相手の同期の kvm_get2 */
+        for (int i = 0; i < ops; i++) {
+            if (i % TIER_DROP == TIER_DROP - 1) td += tier_uncache(kvm);
+            const char *k = keys[rng_below(&rng, nrec)];
+            uint32_t vs;
+            char *v;
+            TIMED(h, 0, v = kvm_get2(kvm, k, strlen(k), &vs));
+            if (v) { sum += (uint8_t)v[0]; free(v); }
+        }
+    } else {
+        KVMAIO *aio = kvm_aio_new(kvm, qd);
+        for (int i = 0; i < ops; i++) {
+            if (i % TIER_DROP == TIER_DROP - 1) td += tier_uncache(kvm);
+            while (kvm_aio_pending(aio) >= qd) kvm_aio_poll(aio, 1);
+            o[i].h = h;
+            o[i].sum = &sum;
+            o[i].t0 = now_ns();
+            kvm_get_async(aio, keys[rng_below(&rng, nrec)], qd_done, &o[i]);
+        }
+        kvm_aio_del(aio);
+    }
+    r->ops = ops / (now_sec() - t0 - td);
+    r->p50 = hist_pct(h, 0.5);
+    r->p99 = hist_pct(h, 0.99);
+    if (sum == 0) printf("  (no hits)\n");
+    free(o);
+    free(h);
+}
+
+/* キャッシュを値の合計の 1/10 にし、開くたびにページキャッシュを捨てて一様に読む */
+static void tier_qd_sweep(KVM *kvm, const char *path, const char *vp, char **keys, int nrec, double total) {
+    int ops = nrec < 20000 ? nrec : 20000;
+    printf("\n>>> 非同期の読み (KVM-Tier 10x, uniform, %d ops each, cold start)\n", ops);
+    printf("  %-10s │ %12s %9s %9s │\n", "QD", "ops/sec", "p50(ns)", "p99(ns)");
+    for (int qd = 0; qd <= 256; qd = qd ? qd * 2 : 1) {
+        drop_page_cache(path);
+        drop_page_cache(vp);
+        kvm_setcache(kvm, (size_t)(total / 10));
+        if (kvm_open(kvm, path, KVMOWRITER) != 0) {
+            printf("KVM reopen error\n");
+            exit(1);
+        }
+        TIERRES r;
+        tier_qd(kvm, keys, nrec, ops, qd, &r);
+        char name[16];
+        if (qd) snprintf(name, sizeof(name), "%d", qd); else snprintf(name, sizeof(name), "sync");
+        printf("  %-10s │ %12.0f %9llu %9llu │\n", name, r.ops,
+               (unsigned long long)r.p50, (unsigned long long)r.p99);
+        kvm_close(kvm);
+    }
+#ifndef KVM_URING
+    printf("  (io_uring が無いので非同期の読みも中では pread)\n");
+#endif
+}
+
+void bench_tier(int nrec) {
+    VALDIST vd;
+    valdist_parse(&vd, "500~2000");
+    RNG rng;
+    rng_seed(&rng, 1234);
+    char **keys = malloc(nrec * sizeof(char*)), *vbuf = malloc(vd.hi + 256);
+    uint32_t *vlen = malloc(nrec * sizeof(uint32_t));
+    double total = 0;
+    for (uint32_t i = 0; i < vd.hi + 256; i++) vbuf[i] = 'a' + rng_below(&rng, 26);
+    for (int i = 0; i < nrec; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "key_%08d", i);
+        vlen[i] = valdist_next(&vd, &rng);
+        total += vlen[i];
     }
-    kvm_miss = now_sec() - t0;
+    printf("\n>>> 値の階層化 (%d records, %.1f MB of values, zipf 0.99, cold start)\n",
+           nrec, total / 1024 / 1024);
+    printf("  %-14s │ RAM (MB) │ Zipf Read      p50      p99   hit │ After Scan      p99   hit │\n", "Config");
+    TIERRES r[2];
     
-    printf("  Memory used: %.2f MB\n", kvm->write_pos / (1024.0 * 1024.0));
-    print_result("自作KVM", "Write", N, kvm_write);
-    print_result("自作KVM", "Seq Read", N, kvm_seq);
-    print_result("自作KVM", "Rand Read", N, kvm_rand);
-    print_result("自作KVM", "Miss Read", N, kvm_miss);
+    /* TC と全部 mmap する自作KVM */
+    remove("bench_tc.tch");
+    TCHDB *hdb = tchdbnew();
+    tchdbtune(hdb, nrec * 2, -1, -1, HDBTLARGE);
+    if (!tchdbopen(hdb, "bench_tc.tch", HDBOWRITER | HDBOCREAT | HDBOTRUNC)) {
+        printf("Tokyo Cabinet open error: %s\n", tchdberrmsg(tchdbecode(hdb)));
+        exit(1);
+    }
+    for (int i = 0; i < nrec; i++) tchdbput(hdb, keys[i], strlen(keys[i]), vbuf + (i & 255), vlen[i]);
+    tchdbclose(hdb);
+    drop_page_cache("bench_tc.tch");
+    tchdbopen(hdb, "bench_tc.tch", HDBOWRITER);
+    tier_reads(NULL, hdb, keys, nrec, nrec, &r[0]);
+    tier_scan(NULL, hdb);
+    tier_reads(NULL, hdb, keys, nrec, nrec, &r[1]);
+    tier_row("TokyoCabinet", 0, r);
+    tchdbclose(hdb);
+    tchdbdel(hdb);
+    remove("bench_tc.tch");
     
-    kvm_close(kvm);
+    for (int tier = 0; tier < 2; tier++) {
+        remove("bench_kvm.kvm");
+        KVM *kvm = kvm_new();
+        kvm_tune(kvm, nrec, tier ? KVMTTIER : 0);
+        kvm_setbloom(kvm, nrec, 0.01);
+        if (kvm_open(kvm, "bench_kvm.kvm", KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+            printf("KVM open error\n");
+            exit(1);
+        }
+        for (int i = 0; i < nrec; i++) kvm_put2(kvm, keys[i], strlen(keys[i]), vbuf + (i & 255), vlen[i]);
+        kvm_close(kvm);
+        char *vp = kvm_vlog_path("bench_kvm.kvm", 0);
+        for (int k = 0; k < (tier ? NTIER : 1); k++) {
+            drop_page_cache("bench_kvm.kvm");
+            if (tier) {
+                drop_page_cache(vp);
+                kvm_setcache(kvm, (size_t)(total / tier_ratio[k]));
+            }
+            if (kvm_open(kvm, "bench_kvm.kvm", KVMOWRITER) != 0) {
+                printf("KVM reopen error\n");
+                exit(1);
+            }
+            tier_reads(kvm, NULL, keys, nrec, nrec, &r[0]);
+            tier_scan(kvm, NULL);
+            tier_reads(kvm, NULL, keys, nrec, nrec, &r[1]);
+            char name[32];
+            if (tier) snprintf(name, sizeof(name), "KVM-Tier %dx", tier_ratio[k]);
+            else snprintf(name, sizeof(name), "KVM (mmap)");
+            tier_row(name, tier ? (kvm->write_pos + kvm->cache->cap) / 1024.0 / 1024 : 0, r);
+            kvm_close(kvm);
+        }
+        if (tier) {
+            printf("  (RAM: KVM-Tier は領域（キーと索引）+ キャッシュの上限、Nx は値の合計 / キャッシュ)\n");
+            printf("  (KVM-Tier の値ファイルは %d 回の読みごとに POSIX_FADV_DONTNEED で OS のページキャッシュ\n"
+                   "   から外し、その時間は除く。間の %d 回のうちのページキャッシュの当たりは含む。\n"
+                   "   TC と KVM (mmap) はページキャッシュに載ったまま読む)\n", TIER_DROP, TIER_DROP);
+        }
+        if (tier) tier_qd_sweep(kvm, "bench_kvm.kvm", vp, keys, nrec, total);
+        kvm_del(kvm);
+        remove("bench_kvm.kvm");
+        remove(vp);
+        free(vp);
+    }
+    for (int i = 0; i < nrec; i++) free(keys[i]);
+    free(keys);
+    free(vlen);
+    free(vbuf);
+}
+
+int main(int argc, char **argv) {
+    int N = 100000, threads = -1, sample = 8, ops = 0, dist = -1, tier = 0;
+    double read_ratio = 0.9, theta = 0.99;
+    const char *workload = NULL, *engine_spec = NULL;
+    VALDIST vsize = { 100, 1000, 0 };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-ratio") == 0 && i + 1 < argc) {
+            read_ratio = atof(argv[++i]);
+        } else if (strncmp(argv[i], "--read-ratio=", 13) == 0) {
+            read_ratio = atof(argv[i] + 13);
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hist-csv") == 0 && i + 1 < argc) {
+            if (!(hist_csv = fopen(argv[++i], "w"))) {
+                perror(argv[i]);
+                return 1;
+            }
+            fprintf(hist_csv, "engine,phase,low_ns,high_ns,count\n");
+        } else if (strcmp(argv[i], "--tier") == 0) {
+            tier = 1;
+        } else if (strcmp(argv[i], "--engines") == 0 && i + 1 < argc) {
+            engine_spec = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            if (perf_init() != 0) perror("perf_event_open (counters disabled)");
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            workload = argv[++i];
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) {
+            theta = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc) {
+            const char *d = argv[++i];
+            for (int k = 0; k < 4; k++)
+                if (strcmp(d, keydist_name[k]) == 0) dist = k;
+            if (dist < 0) {
+                fprintf(stderr, "unknown dist: %s\n", d);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--value-size") == 0 && i + 1 < argc) {
+            if (valdist_parse(&vsize, argv[++i]) != 0) {
+                fprintf(stderr, "bad value size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i][0] != '-') {
+            N = atoi(argv[i]);
+        } else {
+            fprintf(stderr, "usage: %s [件数] [-t スレッド数] [--read-ratio 0..1] [--sample n]"
+                    " [--hist-csv ファイル] [--perf]\n"
+                    "       [--workload A..F|all] [--ops n] [--dist uniform|zipf|latest|hotspot]"
+                    " [--theta 0..1) [--value-size n|lo-hi|lo~hi] [--tier]\n"
+                    "       [--engines 名前,…|all]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (engine_select(engine_spec) != 0) {
+        fprintf(stderr, "unknown engine in %s (", engine_spec);
+        for (int k = 0; k < NENGINE_LIST; k++) fprintf(stderr, "%s%s", k ? ", " : "", engine_list[k].id);
+        fprintf(stderr, ")\n");
+        return 1;
+    }
+    if (threads == 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (read_ratio < 0) read_ratio = 0;
+    if (read_ratio > 1) read_ratio = 1;
+    if (ops <= 0) ops = N;
+    if (theta <= 0 || theta >= 1) theta = 0.99;
+    /* 測る間隔は 2 の冪に切り上げる */
+    while (hist_mask + 1 < sample) hist_mask = hist_mask * 2 + 1;
     
-    /* ========== 結果比較 ========== */
-    printf("\n╔══════════════════════════════════════════════════════════════════╗\n");
-    printf("║                        対決結果                                  ║\n");
-    printf("╠══════════════════════════════════════════════════════════════════╣\n");
-    printf("║  %-12s │ TokyoCabinet │  自作KVM   │  勝者        ║\n", "Operation");
+    printf("╔══════════════════════════════════════════════════════════════════╗\n");
+    printf("║       Tokyo Cabinet vs 自作KVM ベンチマーク対決                  ║\n");
     printf("╠══════════════════════════════════════════════════════════════════╣\n");
+    printf("║  Records: %-6d                                                 ║\n", N);
+    char build[64];
+    snprintf(build, sizeof(build), "%d-bit refs, Bloom %s, index %s", (int)sizeof(kvm_ref_t) * 8,
+             KVM_BLOOM ? "on" : "off", KVM_INDEX == 1 ? "chain" : KVM_INDEX == 2 ? "line" : "kvm_tune");
+    printf("║  Build:   %-55s║\n", build);
+    char list[128] = "";
+    for (int k = 0; k < nengine; k++)
+        snprintf(list + strlen(list), sizeof(list) - strlen(list), "%s%s", k ? "," : "", engines[k]->id);
+    printf("║  Engines: %-55s║\n", list);
+    printf("╚══════════════════════════════════════════════════════════════════╝\n\n");
     
-    #define WINNER(tc, kvm) ((tc) < (kvm) ? "TokyoCabinet" : "自作KVM ★")
-    #define RATIO(tc, kvm) ((tc) < (kvm) ? (kvm)/(tc) : (tc)/(kvm))
-    
-    printf("║  %-12s │ %10.0f   │ %10.0f │  %-12s (%.1fx)\n", 
-           "Write", N/tc_write, N/kvm_write, WINNER(tc_write, kvm_write), RATIO(tc_write, kvm_write));
-    printf("║  %-12s │ %10.0f   │ %10.0f │  %-12s (%.1fx)\n", 
-           "Seq Read", N/tc_seq, N/kvm_seq, WINNER(tc_seq, kvm_seq), RATIO(tc_seq, kvm_seq));
-    printf("║  %-12s │ %10.0f   │ %10.0f │  %-12s (%.1fx)\n", 
-           "Rand Read", N/tc_rand, N/kvm_rand, WINNER(tc_rand, kvm_rand), RATIO(tc_rand, kvm_rand));
-    printf("║  %-12s │ %10.0f   │ %10.0f │  %-12s (%.1fx)\n", 
-           "Miss Read", N/tc_miss, N/kvm_miss, WINNER(tc_miss, kvm_miss), RATIO(tc_miss, kvm_miss));
-    printf("╚══════════════════════════════════════════════════════════════════╝\n");
-    
-    /* 総合判定 */
-    int kvm_wins = 0;
-    if (kvm_write < tc_write) kvm_wins++;
-    if (kvm_seq < tc_seq) kvm_wins++;
-    if (kvm_rand < tc_rand) kvm_wins++;
-    if (kvm_miss < tc_miss) kvm_wins++;
+    /* テストデータ生成（更新値は少し長く、Entry に収まるものと収まらないものが混ざる） */
+    char **keys = malloc(N * sizeof(char*));
+    char **vals = malloc(N * sizeof(char*));
+    char **miss = malloc(N * sizeof(char*));
+    char **upds = malloc(N * sizeof(char*));
+    for (int i = 0; i < N; i++) {
+        keys[i] = malloc(32); vals[i] = malloc(64); miss[i] = malloc(32); upds[i] = malloc(64);
+        sprintf(keys[i], "key_%08d", i);
+        sprintf(vals[i], "value_%d_data", i);
+        sprintf(miss[i], "miss_%08d", i);
+        sprintf(upds[i], "value_%d_data_v2", i);
+    }
     
-    printf("\n🏆 総合結果: %s の勝利！ (%d - %d)\n", 
-           kvm_wins >= 2 ? "自作KVM" : "Tokyo Cabinet", 
-           kvm_wins, 4 - kvm_wins);
+    double (*t)[NPHASE] = malloc(nengine * sizeof(*t));
+    HIST *hs = calloc((size_t)nengine * NPHASE, sizeof(HIST));
+    PERFC *pc = calloc((size_t)nengine * NPHASE, sizeof(PERFC));
+    for (int k = 0; k < nengine; k++) {
+        printf("%s>>> %s\n", k ? "\n" : "", engines[k]->title);
+        bench_engine(engines[k], N, keys, vals, miss, upds, t[k], &hs[k * NPHASE], &pc[k * NPHASE]);
+    }
+
+    /* ========== 結果比較 ========== */
+    /* 勝者は BK_REF 以外で一番速いエンジン。倍率は自作KVM の一族の最速とそれ以外の
+     * 最速の比（片方しか選んでいなければ二番手との比） */
+    int width = 16 + 15 * nengine + 24;
+    char cell[32];
+    printf("\n╔");
+    for (int i = 0; i < width; i++) printf("═");
+    printf("╗\n║%*s対決結果%*s║\n╠", (width - 8) / 2, "", width - 8 - (width - 8) / 2, "");
+    for (int i = 0; i < width; i++) printf("═");
+    printf("╣\n║  %-12s │", "Operation");
+    for (int k = 0; k < nengine; k++) {
+        putchar(' ');
+        print_cell(engines[k]->name, 12);
+        printf(" │");
+    }
+    printf("  勝者\n╠");
+    for (int i = 0; i < width; i++) printf("═");
+    printf("╣\n");
+
+    int kvm_wins = 0, contested = 0, wins[ENGINE_MAX] = { 0 };
+    for (int p = 0; p < NPHASE; p++) {
+        int best = -1, own = -1, other = -1, second = -1;
+        printf("║  %-12s │", phase_name[p]);
+        for (int k = 0; k < nengine; k++) {
+            /* 0 は時計の刻みより速く終わった物で、比べられないので測っていない扱い */
+            double v = t[k][p];
+            if (v <= 0) strcpy(cell, "-");
+            else snprintf(cell, sizeof(cell), "%.0f", N / v);
+            putchar(' ');
+            print_cell(cell, 12);
+            printf(" │");
+            if (v <= 0 || (engines[k]->flags & BK_REF)) continue;
+            int *side = (engines[k]->flags & BK_OWN) ? &own : &other;
+            if (*side < 0 || v < t[*side][p]) *side = k;
+            if (best < 0 || v < t[best][p]) {
+                second = best;
+                best = k;
+            } else if (second < 0 || v < t[second][p]) {
+                second = k;
+            }
+        }
+        if (best < 0) {
+            printf("\n");
+            continue;
+        }
+        int rival = own >= 0 && other >= 0 ? (best == own ? other : own) : second;
+        printf("  %s%s", engines[best]->name, (engines[best]->flags & BK_OWN) ? " ★" : "");
+        if (rival >= 0) printf(" (%.1fx)", t[rival][p] / t[best][p]);
+        printf("\n");
+        if (own >= 0 && other >= 0) {
+            contested++;
+            if (t[own][p] < t[other][p]) kvm_wins++;
+            else wins[other]++;
+        }
+    }
+    printf("╚");
+    for (int i = 0; i < width; i++) printf("═");
+    printf("╝\n");
+
+    /* 総合判定（自作KVM の一族とそれ以外の両方を選んだ時だけ） */
+    if (contested > 0) {
+        int top = -1;
+        for (int k = 0; k < nengine; k++)
+            if (!(engines[k]->flags & (BK_OWN | BK_REF)) && (top < 0 || wins[k] > wins[top])) top = k;
+        printf("\n🏆 総合結果: %s の勝利！ (%d - %d)\n",
+               kvm_wins * 2 >= contested ? "自作KVM" : engines[top]->name,
+               kvm_wins, contested - kvm_wins);
+    }
+
+    bench_scan(N, keys, vals);
+    bench_comp(N);
+    bench_snap(N, keys, vals, upds);
+    bench_cache(N, keys);
+    bench_stats(N, keys, vals, miss, threads);
+    if (threads > 0) bench_mt(N, threads, read_ratio, keys, vals, upds);
+    if (workload) bench_ycsb(workload, N, ops, dist, theta, &vsize);
+    if (tier) bench_tier(N);
     
     /* クリーンアップ */
     remove("bench_tc.tch");
-    for (int i = 0; i < N; i++) { free(keys[i]); free(vals[i]); free(miss[i]); }
-    free(keys); free(vals); free(miss);
+    for (int i = 0; i < N; i++) { free(keys[i]); free(vals[i]); free(miss[i]); free(upds[i]); }
+    free(keys); free(vals); free(miss); free(upds);
+    free(t); free(hs); free(pc);
+    if (hist_csv) fclose(hist_csv);
+    perf_fini();
     
     return 0;
 }
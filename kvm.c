@@ -0,0 +1,4294 @@
+/*
+ * 自作KVM の本体。API と公開する構造体は kvm.h、ベンチマークは bench_vs.c
+ */
+#define _GNU_SOURCE             /* mlock2 / pthread_setaffinity_np（Linux のみ） */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "kvm.h"
+#ifdef KVM_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef KVM_NUMA
+#include <linux/mempolicy.h>
+#include <dirent.h>
+#endif
+
+/* ========== 自作KVM ========== */
+#ifndef POOL_SIZE
+#define POOL_SIZE (64 * 1024 * 1024)  /* 64MB: ファイルの初期サイズ */
+#endif
+#define POOL_GROW_MAX ((size_t)1 << 30)  /* ファイルは倍々、ただし一度に伸ばすのは 1GB まで */
+
+#define REF(pos) ((kvm_ref_t)((pos) >> REF_SHIFT))
+#define REF_POS(ref) ((size_t)(ref) << REF_SHIFT)
+#define ENTRY(db, ref) ((Entry*)((db)->mem + REF_POS(ref)))
+
+/* 仮想アドレスだけ先に確保する上限。mem はこの範囲から動かないので
+ * 伸ばしても参照もポインタも変わらない */
+#define POOL_MAX (sizeof(size_t) > 4 ? REF_MAX : (size_t)1 << 30)
+#ifndef BUCKET_COUNT
+#define BUCKET_COUNT (8 * 1024)       /* 初期バケット数（2の冪） */
+#endif
+#ifndef LOAD_FACTOR
+#define LOAD_FACTOR 2                 /* count > バケット数 * LOAD_FACTOR で倍に拡張 */
+#endif
+#define REHASH_STEP 4                 /* put/get 1回あたりに移すバケット数 */
+#define BULK_PART_BITS 10       /* kvm_bulk_load で索引を区切る数（2^n） */
+#define BULK_PREFETCH 8         /* kvm_bulk_load で入力を先読みする件数 */
+#define BULK_VBUF (1 << 20)     /* kvm_bulk_load が KVMTTIER の値をまとめて書く単位 */
+#define KVM_RSTRIPES 16         /* kvm_setmutex 時の読み手カウンタの本数 */
+#define MGET_BATCH 16           /* kvm_mget で同時にプリフェッチするキー数 */
+
+#define BLOOM_EXPECTED 100000        /* kvm_setbloom を呼ばなかった時の想定キー数 */
+#define BLOOM_FPR 0.01                /* 同じく目標の偽陽性率 */
+#define BLOOM_K 8                     /* 1ブロック(64bit x 8)の各ワードに1ビットずつ */
+
+#define KVM_MAGIC "KVM2026"
+#define KVM_VERSION 5                 /* 3: 値の圧縮と辞書、4: 値ファイル、5: 期限と KVMTCACHE。
+                                         2 以降はそのまま開ける */
+#define KVM_FOPEN 1                   /* 書き込みで開いている間ヘッダに立てる（残っていれば作り直す） */
+
+#define BLOOM_OFF HDR_SIZE
+
+/* ファイル先頭のヘッダ。オフセットはすべてファイル先頭から。
+ * 開き直す時はこれだけ読めばよく、レコードを走査し直さない */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;         /* KVM_FOPEN */
+    uint32_t opts;          /* KVMT* */
+    uint32_t ref_bits;      /* kvm_ref_t の幅。ビルドと合わなければ開けない */
+    uint64_t mem_size;
+    uint64_t write_pos;
+    uint64_t count;
+    uint64_t data_off;
+    uint64_t bloom_blocks;
+    uint64_t nbuckets;
+    uint64_t table_off;
+    uint64_t old_nbuckets;
+    uint64_t old_table_off;
+    uint64_t rehash_pos;
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    uint64_t dict_off;      /* kvm_setdict の辞書（無ければ 0） */
+    uint64_t dict_len;
+    uint64_t vlog_pos;      /* KVMTTIER の値ファイルの有効な長さ */
+    uint64_t vlog_seq;      /* 値ファイルの世代（<path>.val.<seq>） */
+    uint64_t ring_off;      /* KVMTCACHE: 使い回す範囲の先頭（索引表と辞書の後ろ） */
+    uint64_t ring_head;     /* 一番古い Entry */
+    uint64_t ring_wend;     /* 先頭に戻って書いている時の古い側の終わり（戻っていなければ 0） */
+} KVMHDR;
+
+/* kvm_setmutex 時の排他。書き手同士は wmtx で直列にする。
+ * 読み手はロックを取らず、スレッドごとに割り当てた stripe の数を増やすだけ
+ * （同じキャッシュラインを読み手同士で奪い合わない）。索引表の拡張・移行や
+ * コンパクションの入れ替えのように参照先が動く操作だけは、書き手が gate を立てて
+ * 全 stripe が 0 になるのを待つ。値のその場上書きは seq（seqlock）で守り、
+ * 読み手はコピーの前後で seq が変わっていればやり直す */
+typedef struct {
+    atomic_int n;
+    char pad[64 - sizeof(atomic_int)];
+} KVMSTRIPE;
+
+struct KVMSYNC {
+    KVMSTRIPE stripe[KVM_RSTRIPES];
+    atomic_int gate;
+    atomic_uint seq;
+    pthread_mutex_t wmtx;
+    int excl;               /* kvm_excl の入れ子の深さ（wmtx を持つ書き手だけが触る） */
+};
+
+/* kvm_setsweep の掃除スレッド */
+struct KVMSWEEP {
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    /* 止める時に起こす */
+    int ms;                 /* kvm_sweep の間隔 */
+    int running;
+    int quit;
+};
+
+/* wyhash 系の 64bit ハッシュ。8 バイト単位で読んで 128bit 乗算で混ぜる。
+ * バケット番号は下位ビット、Bloom のプローブとラインの tag は上位 32bit から取る */
+static inline void kvm_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r; *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, la = (uint32_t)*a, hb = *b >> 32, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo; *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t kvm_mix(uint64_t a, uint64_t b) {
+    kvm_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t kvm_r8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t kvm_r4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static inline uint64_t kvm_hash(const void *key, size_t len) {
+    static const uint64_t s0 = 0x2d358dccaa6c78a5ull, s1 = 0x8bb84b93962eacc9ull,
+                          s2 = 0x4b33a62ed433d4a3ull, s3 = 0x4d5a2da51de1aa47ull;
+    const uint8_t *p = key;
+    uint64_t seed = kvm_mix(s0, s1), a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (kvm_r4(p) << 32) | kvm_r4(p + ((len >> 3) << 2));
+            b = (kvm_r4(p + len - 4) << 32) | kvm_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = kvm_mix(kvm_r8(p) ^ s1, kvm_r8(p + 8) ^ seed);
+                see1 = kvm_mix(kvm_r8(p + 16) ^ s2, kvm_r8(p + 24) ^ see1);
+                see2 = kvm_mix(kvm_r8(p + 32) ^ s3, kvm_r8(p + 40) ^ see2);
+                p += 48; i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = kvm_mix(kvm_r8(p) ^ s1, kvm_r8(p + 8) ^ seed);
+            p += 16; i -= 16;
+        }
+        a = kvm_r8(p + i - 16);
+        b = kvm_r8(p + i - 8);
+    }
+    a ^= s1; b ^= seed;
+    kvm_mum(&a, &b);
+    return kvm_mix(a ^ s0 ^ len, b ^ s1);
+}
+
+/* キャッシュライン単位の Bloom filter。ハッシュ下位 32bit でブロックを選び、
+ * 上位 32bit にワードごとの salt を掛けて各 64bit ワード内のビットを決める。
+ * 1回の判定で触るのは 1 ライン（split block bloom filter と同じ形） */
+static const uint32_t bloom_salt[BLOOM_K] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+/* bloom は db->bloom か kvm_setreplica のノードの写し */
+static inline uint64_t *bloom_block_in(KVM *db, uint64_t *bloom, uint64_t h) {
+    return bloom + (((uint64_t)(uint32_t)h * db->bloom_blocks) >> 32) * BLOOM_K;
+}
+
+static inline uint64_t *bloom_block(KVM *db, uint64_t h) {
+    return bloom_block_in(db, db->bloom, h);
+}
+
+static inline void bloom_mask(uint64_t h, uint64_t m[BLOOM_K]) {
+    uint32_t x = h >> 32;
+    for (int i = 0; i < BLOOM_K; i++)
+        m[i] = 1ull << ((uint32_t)(x * bloom_salt[i]) >> 26);
+}
+
+/* KVMTCACHE では追い出したキーのビットを消せず埋まる一方なので Bloom を持たない */
+static inline void bloom_add(KVM *db, uint64_t h) {
+    if (!db->bloom_blocks) return;
+    uint64_t *blk = bloom_block(db, h), m[BLOOM_K];
+    bloom_mask(h, m);
+    for (int i = 0; i < BLOOM_K; i++) blk[i] |= m[i];
+}
+
+/* KVM_BLOOM=0 のビルドは引かない。既にある DB の Bloom は bloom_add で保つので、
+ * 普通のビルドで開き直しても取りこぼさない */
+static inline int bloom_maybe_in(KVM *db, uint64_t *bloom, uint64_t h) {
+    if (!KVM_BLOOM || !db->bloom_blocks) return 1;
+    const uint64_t *blk = bloom_block_in(db, bloom, h);
+    uint64_t m[BLOOM_K];
+    bloom_mask(h, m);
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < BLOOM_K; i += 2) {
+        __m128i mv = _mm_loadu_si128((const __m128i*)&m[i]);
+        acc = _mm_or_si128(acc, _mm_andnot_si128(_mm_load_si128((const __m128i*)&blk[i]), mv));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t miss = 0;
+    for (int i = 0; i < BLOOM_K; i++) miss |= m[i] & ~blk[i];
+    return miss == 0;
+#endif
+}
+
+static inline int bloom_maybe(KVM *db, uint64_t h) {
+    return bloom_maybe_in(db, db->bloom, h);
+}
+
+/* 1ブロックに平均 lambda 個のキーが入った時の偽陽性率。
+ * ブロック内のキー数はポアソン分布、c 個入ったワードのビットが立つ確率は 1-(63/64)^c */
+static double bloom_fpr_at(double lambda) {
+    double pois = exp(-lambda), fpr = 0;
+    int cmax = (int)(lambda + 10 * sqrt(lambda) + 20);
+    for (int c = 0; c <= cmax; c++) {
+        fpr += pois * pow(1 - pow(63.0 / 64, c), BLOOM_K);
+        pois *= lambda / (c + 1);
+    }
+    return fpr;
+}
+
+/* 想定キー数と偽陽性率からブロック数を決める（1ブロックあたりのキー数を二分探索） */
+static void bloom_size(KVM *db) {
+    double n = db->bloom_expected > 0 ? (double)db->bloom_expected : BLOOM_EXPECTED;
+    double p = db->bloom_fpr > 0 && db->bloom_fpr < 1 ? db->bloom_fpr : BLOOM_FPR;
+    double lo = 0.01, hi = 512;
+    for (int i = 0; i < 50; i++) {
+        double mid = (lo + hi) / 2;
+        if (bloom_fpr_at(mid) > p) hi = mid; else lo = mid;
+    }
+    db->bloom_blocks = (size_t)ceil(n / lo);
+    if (db->bloom_blocks < 1) db->bloom_blocks = 1;
+}
+
+/* KVMTTIER では領域（キー・索引・Bloom だけ）を RAM に留める。MLOCK_ONFAULT なら
+ * 触ったページから順に固定され、ファイルの穴まで読み込まない。RLIMIT_MEMLOCK に
+ * 掛かるなどで失敗してもそのまま続ける（pinned が伸びないだけ） */
+static void kvm_pin(KVM *db) {
+    if (db->pinned >= db->mem_size) return;
+#if defined(__linux__) && defined(MLOCK_ONFAULT)
+    int r = mlock2(db->mem + db->pinned, db->mem_size - db->pinned, MLOCK_ONFAULT);
+#else
+    int r = mlock(db->mem + db->pinned, db->mem_size - db->pinned);
+#endif
+    if (r == 0) db->pinned = db->mem_size;
+}
+
+/* write_pos から need バイト書けるようにする。ファイルは予約済みの範囲内で
+ * ftruncate して伸ばすので既存のエントリは動かない。KVMTCACHE は伸ばさない */
+static int kvm_ensure(KVM *db, size_t need) {
+    if (db->write_pos + need <= db->mem_size) return 0;
+    if (db->fd < 0 || (db->opts & KVMTCACHE) || db->write_pos + need > db->map_size) return -1;
+    size_t size = db->mem_size + (db->mem_size < POOL_GROW_MAX ? db->mem_size : POOL_GROW_MAX);
+    if (size < db->write_pos + need) size = db->write_pos + need;
+    if (size > db->map_size) size = db->map_size;
+    size = (size + HDR_SIZE - 1) & ~(size_t)(HDR_SIZE - 1);
+    if (ftruncate(db->fd, size) != 0) return -1;
+    db->mem_size = size;
+    if (db->opts & KVMTTIER) kvm_pin(db);
+    return 0;
+}
+
+/* Entry の値の場所に実際に置くバイト数（EF_COLD なら値ファイルの位置だけ） */
+static inline uint32_t entry_vbytes(uint32_t flags, uint32_t vlen) {
+    return (flags & EF_COLD) ? sizeof(uint64_t) : vlen;
+}
+
+/* EF_TTL の期限は Entry の末尾に置く。size はその場上書きでも変わらないので位置も動かない */
+static inline uint32_t entry_expire(const Entry *e) {
+    uint32_t t;
+    memcpy(&t, (const uint8_t*)e + e->size - sizeof(t), sizeof(t));
+    return t;
+}
+
+static inline int entry_expired(const Entry *e, uint32_t flags, uint32_t now) {
+    return (flags & EF_TTL) && entry_expire(e) <= now;
+}
+
+/* 索引表はデータ領域から Entry 形式で切り出す（write_pos より先は未使用なのでゼロ）。
+ * Line 用に先頭を 64 バイト境界に揃える */
+static void *kvm_alloc_table(KVM *db, size_t n) {
+    size_t size = entry_size(0, table_bytes(db, n) + 64);
+    if (kvm_ensure(db, size) != 0) return NULL;
+    Entry *e = (Entry*)(db->mem + db->write_pos);
+    e->klen = 0; e->vlen = table_bytes(db, n) + 64; e->size = size; e->flags = EF_BLOB; e->next = 0;
+    db->write_pos += size;
+    db->live_bytes += size;
+    return (void*)(((uintptr_t)e->data + 63) & ~(uintptr_t)63);
+}
+
+/* ========== 値の圧縮（KVMTLZ） ========== */
+/* LZ4 と同じ形のブロック（トークン / リテラル / 2 バイトの距離 / 一致長）を自前で詰める。
+ * 外部ライブラリは使わない。辞書があれば出力の前に辞書が続いているものとして
+ * 距離を辞書の中まで伸ばせるので、短い JSON でも鍵の名前などが一致で消える。
+ * 圧縮した Entry は値の先頭 4 バイトに元の長さを置き、flags に EF_LZ（辞書を使えば
+ * EF_DICT も）を立てる。短すぎる値と縮まなかった値はそのまま置く */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFF 65535
+#define COMP_MIN 128            /* これより短い値は圧縮しない */
+#define DICT_MAX (16 * 1024)    /* kvm_setdict の辞書の上限 */
+
+static inline uint32_t lz_r32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* 最悪の出力長（縮まない入力でもこれに収まる） */
+static inline size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static uint8_t *lz_len(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+/* 辞書の位置を引く表（0 は空きを表すので位置 + 1）。辞書と一緒に領域へ置いておき、
+ * 圧縮のたびに辞書を舐め直さずに写すだけで済ませる */
+#define LZ_TAB_BYTES (sizeof(uint32_t) << LZ_HASH_BITS)
+
+static void lz_dict_table(const uint8_t *dict, size_t dlen, uint32_t *tab) {
+    memset(tab, 0, LZ_TAB_BYTES);
+    for (size_t i = 0; i + LZ_MIN_MATCH <= dlen; i++)
+        tab[lz_hash(lz_r32(dict + i))] = (uint32_t)i + 1;
+}
+
+/* buf[0, start) が辞書、buf[start, end) が入力。dtab は辞書の表（辞書が無ければ NULL）。
+ * dst には lz_bound ぶんの空きが要る */
+static size_t lz_compress(const uint8_t *buf, size_t start, size_t end, const uint32_t *dtab,
+                          uint8_t *dst) {
+    uint32_t tab[1 << LZ_HASH_BITS];
+    if (dtab) memcpy(tab, dtab, sizeof(tab));
+    else memset(tab, 0, sizeof(tab));
+    uint8_t *op = dst;
+    size_t ip = start, anchor = start;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t v = lz_r32(buf + ip), *slot = &tab[lz_hash(v)];
+        size_t ref = *slot;
+        *slot = (uint32_t)ip + 1;
+        if (!ref || ip - (ref - 1) > LZ_MAX_OFF || lz_r32(buf + ref - 1) != v) {
+            ip += 1 + ((ip - anchor) >> 6);  /* 一致が続かない所は飛ばし気味に進む */
+            continue;
+        }
+        ref--;
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < end && buf[ref + len] == buf[ip + len]) len++;
+        size_t lit = ip - anchor, ml = len - LZ_MIN_MATCH;
+        uint8_t *tok = op++;
+        *tok = (uint8_t)((lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15));
+        if (lit >= 15) op = lz_len(op, lit - 15);
+        memcpy(op, buf + anchor, lit);
+        op += lit;
+        size_t off = ip - ref;
+        *op++ = (uint8_t)off;
+        *op++ = (uint8_t)(off >> 8);
+        if (ml >= 15) op = lz_len(op, ml - 15);
+        ip += len;
+        anchor = ip;
+    }
+    size_t lit = end - anchor;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = lz_len(op, lit - 15);
+    memcpy(op, buf + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int lz_getlen(const uint8_t *src, size_t n, size_t *ip, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= n) return -1;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* 壊れた入力（その場上書きと競合した読みなど）でも範囲の外は読み書きしない。
+ * 出力がちょうど raw バイトにならなければ -1 */
+static int lz_decompress(const uint8_t *src, size_t n, const uint8_t *dict, size_t dlen,
+                         uint8_t *dst, size_t raw) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t tok = src[ip++];
+        size_t lit = tok >> 4, ml = tok & 15;
+        if (lit == 15 && lz_getlen(src, n, &ip, &lit) != 0) return -1;
+        if (lit > n - ip || lit > raw - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break;  /* 最後はリテラルだけ */
+        if (n - ip < 2) return -1;
+        size_t off = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (ml == 15 && lz_getlen(src, n, &ip, &ml) != 0) return -1;
+        ml += LZ_MIN_MATCH;
+        if (!off || ml > raw - op || off > op + dlen) return -1;
+        if (off > op) {
+            /* 辞書の中から始まる一致 */
+            size_t from = dlen - (off - op), k = off - op < ml ? off - op : ml;
+            memcpy(dst + op, dict + from, k);
+            op += k;
+            ml -= k;
+        }
+        const uint8_t *m = dst + op - off;
+        if (off >= ml) memcpy(dst + op, m, ml);
+        else for (size_t i = 0; i < ml; i++) dst[op + i] = m[i];
+        op += ml;
+    }
+    return op == raw ? 0 : -1;
+}
+
+/* 辞書の Entry は [辞書][4 バイト境界に揃えた lz_dict_table の表] */
+static inline const uint32_t *kvm_dict_tab(KVM *db) {
+    return (const uint32_t*)(((uintptr_t)db->dict + db->dict_len + 3) & ~(uintptr_t)3);
+}
+
+/* KVMTCACHE では輪に何も書いていない間だけ置ける（輪の手前に足して輪を縮める） */
+static int kvm_store_dict(KVM *db, const void *dict, uint32_t len) {
+    int cache = (db->opts & KVMTCACHE) != 0;
+    if (cache && (db->write_pos != db->ring_off || db->ring_head != db->ring_off || db->ring_wend)) return -1;
+    uint32_t vlen = len + 4 + LZ_TAB_BYTES;
+    size_t size = entry_size(0, vlen);
+    if (kvm_ensure(db, size) != 0) return -1;
+    Entry *e = (Entry*)(db->mem + db->write_pos);
+    e->klen = 0; e->vlen = vlen; e->size = size; e->flags = EF_BLOB; e->next = 0;
+    memcpy(e->data, dict, len);
+    db->write_pos += size;
+    db->live_bytes += size;
+    db->dict = (const uint8_t*)e->data;
+    db->dict_len = len;
+    lz_dict_table(db->dict, len, (uint32_t*)kvm_dict_tab(db));
+    if (cache) db->ring_off = db->ring_head = db->write_pos;
+    return 0;
+}
+
+/* 書く値を決める。圧縮したら *tmp に malloc したバッファを返す（使い終わったら free） */
+static const char *kvm_encode(KVM *db, const char *value, uint32_t *vlen, uint32_t *flags, char **tmp) {
+    *flags = 0;
+    *tmp = NULL;
+    if (!(db->opts & KVMTLZ) || *vlen < COMP_MIN) return value;
+    size_t dl = db->dict_len, n = *vlen;
+    uint8_t *buf = malloc(dl + n + 4 + lz_bound(n));
+    if (!buf) return value;
+    if (dl) memcpy(buf, db->dict, dl);
+    memcpy(buf + dl, value, n);
+    uint8_t *out = buf + dl + n;
+    size_t c = lz_compress(buf, dl, dl + n, dl ? kvm_dict_tab(db) : NULL, out + 4);
+    /* 1/16 も縮まなければ元のまま置く（読む時の展開が無駄になる） */
+    if (c + 4 > n - n / 16) { free(buf); return value; }
+    uint32_t raw = *vlen;
+    memcpy(out, &raw, 4);
+    memmove(buf, out, c + 4);
+    *vlen = c + 4;
+    *flags = EF_LZ | (dl ? EF_DICT : 0);
+    *tmp = (char*)buf;
+    return (char*)buf;
+}
+
+/* 置かれた値 v（vlen バイト、一度だけ読んだもの）の本来の長さ */
+static inline uint32_t kvm_raw_len(const char *v, uint32_t flags, uint32_t vlen) {
+    if (!(flags & EF_LZ)) return vlen;
+    uint32_t raw = 0;
+    if (vlen >= 4) memcpy(&raw, v, 4);
+    /* 競合した読みでおかしな長さを掴んでも大きな確保をしない（LZ の伸びは 255 倍まで） */
+    return raw <= (uint64_t)vlen * 255 ? raw : 0;
+}
+
+/* 本来の値を dst に raw バイト書く。展開できなければ -1 */
+static int kvm_decode(KVM *db, const char *v, uint32_t flags, uint32_t vlen, char *dst, uint32_t raw) {
+    if (!(flags & EF_LZ)) {
+        memcpy(dst, v, raw);
+        return 0;
+    }
+    if (vlen < 4) return -1;
+    return lz_decompress((const uint8_t*)v + 4, vlen - 4, db->dict,
+                         (flags & EF_DICT) ? db->dict_len : 0, (uint8_t*)dst, raw);
+}
+
+/* ========== 値ファイルと読みキャッシュ（KVMTTIER） ========== */
+/* 値を <path>.val.<世代> に追記し、Entry には値ファイル内の位置だけを置く（EF_COLD。
+ * Entry.vlen は値ファイルに置いた長さで、圧縮したならその後の長さ）。領域にはキーと索引と
+ * Bloom しか残らないので小さく、mlock で RAM に留めておける。値は pread で読み、
+ * 読んだ値は cache_bytes までのキャッシュに持つ。キャッシュは CLOCK で、入れた時の
+ * 使用カウンタを 0 にしておき、読まれるたびに CACHE_REF_MAX まで増やして針が通るたびに
+ * 1 減らす。一度しか読まれない値（走査や一巡するだけの読み）は次に針が来た時に
+ * 追い出されるので、繰り返し読まれる値が押し出されない。
+ * 8 バイト以下の値は位置を置くのと変わらないので領域にそのまま置く */
+#define TIER_CACHE ((size_t)64 << 20)  /* kvm_setcache を呼ばなかった時のキャッシュの上限 */
+#define CACHE_REF_MAX 3
+#define CACHE_AVG 256           /* スロット数 = 上限 / CACHE_AVG */
+#define CACHE_FRAC 16           /* 上限の 1/CACHE_FRAC より大きな値はキャッシュしない */
+
+static KVMCACHE *kvm_cache_new(size_t cap) {
+    KVMCACHE *c = calloc(1, sizeof(KVMCACHE));
+    if (!c) return NULL;
+    uint32_t n = 64;
+    while (n < cap / CACHE_AVG && n < (1u << 30)) n <<= 1;
+    c->head = malloc(n * sizeof(int32_t));
+    c->slot = calloc(n, sizeof(CSLOT));
+    if (!c->head || !c->slot) { free(c->head); free(c->slot); free(c); return NULL; }
+    pthread_mutex_init(&c->mtx, NULL);
+    c->cap = cap;
+    c->mask = n - 1;
+    for (uint32_t i = 0; i < n; i++) {
+        c->head[i] = -1;
+        c->slot[i].next = i + 1 < n ? (int32_t)i + 1 : -1;
+    }
+    c->free = 0;
+    return c;
+}
+
+/* 値ファイルを作り直した時（kvm_bulk_load）は位置が使い回されるので空にする */
+static void kvm_cache_clear(KVMCACHE *c) {
+    if (!c) return;
+    for (uint32_t i = 0; i <= c->mask; i++) {
+        free(c->slot[i].buf);
+        c->slot[i].buf = NULL;
+        c->slot[i].next = i < c->mask ? (int32_t)i + 1 : -1;
+        c->head[i] = -1;
+    }
+    c->free = 0;
+    c->used = 0;
+    c->nused = 0;
+}
+
+static void kvm_cache_free(KVMCACHE *c) {
+    if (!c) return;
+    kvm_cache_clear(c);
+    pthread_mutex_destroy(&c->mtx);
+    free(c->head);
+    free(c->slot);
+    free(c);
+}
+
+static inline uint32_t cache_bucket(const KVMCACHE *c, uint64_t off) {
+    return (uint32_t)((off * 0x9E3779B97F4A7C15ull) >> 32) & c->mask;
+}
+
+static int32_t cache_find(KVMCACHE *c, uint64_t off) {
+    int32_t i = c->head[cache_bucket(c, off)];
+    while (i >= 0 && c->slot[i].off != off) i = c->slot[i].next;
+    return i;
+}
+
+/* 針を進めて使用カウンタが 0 のものを 1 つ追い出す。空きでないスロットが要る */
+static void cache_evict1(KVMCACHE *c) {
+    for (;;) {
+        uint32_t i = c->hand;
+        CSLOT *s = &c->slot[i];
+        c->hand = (i + 1) & c->mask;
+        if (!s->buf) continue;
+        if (s->ref) { s->ref--; continue; }
+        int32_t *link = &c->head[cache_bucket(c, s->off)];
+        while (*link != (int32_t)i) link = &c->slot[*link].next;
+        *link = s->next;
+        free(s->buf);
+        s->buf = NULL;
+        c->used -= s->len;
+        c->nused--;
+        s->next = c->free;
+        c->free = i;
+        return;
+    }
+}
+
+/* 呼ぶ時は mtx を持つ。buf は引き取る */
+static void cache_insert(KVMCACHE *c, uint64_t off, char *buf, uint32_t len) {
+    if (cache_find(c, off) >= 0) { free(buf); return; }
+    while ((c->used + len > c->cap || c->free < 0) && c->nused) cache_evict1(c);
+    int32_t i = c->free;
+    CSLOT *s = &c->slot[i];
+    c->free = s->next;
+    s->off = off;
+    s->buf = buf;
+    s->len = len;
+    s->ref = 0;
+    uint32_t b = cache_bucket(c, off);
+    s->next = c->head[b];
+    c->head[b] = i;
+    c->used += len;
+    c->nused++;
+}
+
+static int kvm_vread(int fd, void *buf, size_t len, uint64_t off) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t r = pread(fd, (char*)buf + done, len - done, off + done);
+        if (r <= 0) return -1;
+        done += r;
+    }
+    return 0;
+}
+
+/* 値ファイルの末尾に足す。書き手の mutex か kvm_excl の下で呼ぶ */
+static int kvm_vlog_append(KVM *db, const void *buf, size_t len, uint64_t *off) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t w = pwrite(db->vfd, (const char*)buf + done, len - done, db->vlog_pos + done);
+        if (w <= 0) return -1;
+        done += w;
+    }
+    *off = db->vlog_pos;
+    db->vlog_pos += len;
+    return 0;
+}
+
+/* キャッシュにあれば dst に写して 0、無ければ -1 */
+static int kvm_cache_get(KVMCACHE *c, uint64_t off, uint32_t len, char *dst) {
+    pthread_mutex_lock(&c->mtx);
+    int32_t i = cache_find(c, off);
+    if (i >= 0 && c->slot[i].len == len) {
+        CSLOT *s = &c->slot[i];
+        memcpy(dst, s->buf, len);
+        if (s->ref < CACHE_REF_MAX) s->ref++;
+        c->hits++;
+        pthread_mutex_unlock(&c->mtx);
+        return 0;
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->mtx);
+    return -1;
+}
+
+/* 値ファイルから読んだ値をキャッシュに写して入れる */
+static void kvm_cache_put(KVMCACHE *c, uint64_t off, const char *src, uint32_t len) {
+    if (len > c->cap / CACHE_FRAC) return;
+    char *buf = malloc(len);
+    if (!buf) return;
+    memcpy(buf, src, len);
+    pthread_mutex_lock(&c->mtx);
+    cache_insert(c, off, buf, len);
+    pthread_mutex_unlock(&c->mtx);
+}
+
+/* 値ファイルの off から len バイトを dst に読む。キャッシュにあればそこから写す */
+static int kvm_cold_read(KVM *db, uint64_t off, uint32_t len, char *dst) {
+    if (kvm_cache_get(db->cache, off, len, dst) == 0) return 0;
+    /* 読んでいる間は誰も待たせない（値ファイルは追記だけなので位置の中身は変わらない） */
+    if (off + len > db->vlog_pos || kvm_vread(db->vfd, dst, len, off) != 0) return -1;
+    kvm_cache_put(db->cache, off, dst, len);
+    return 0;
+}
+
+/* Entry に置かれた値のバイト列（flags と vlen は呼び出し側で一度だけ読んだもの）。
+ * EF_COLD なら *tmp に vlen + 1 バイト確保して読み込み、それを返す（使い終わったら free）。
+ * 読めなければ NULL */
+static const char *kvm_stored(KVM *db, const Entry *e, uint32_t flags, uint32_t vlen, char **tmp) {
+    *tmp = NULL;
+    if (!(flags & EF_COLD)) return e->data + e->klen;
+    uint64_t off;
+    memcpy(&off, e->data + e->klen, sizeof(off));
+    char *b = malloc((size_t)vlen + 1);
+    if (!b || kvm_cold_read(db, off, vlen, b) != 0) { free(b); return NULL; }
+    *tmp = b;
+    return b;
+}
+
+/* KVMTTIER の値ファイルのパス <path>.val.<seq>（呼び出し側で free する） */
+char *kvm_vlog_path(const char *path, uint64_t seq) {
+    char *p = malloc(strlen(path) + 32);
+    if (p) sprintf(p, "%s.val.%llu", path, (unsigned long long)seq);
+    return p;
+}
+
+/* ヘッダを読んだ（作った）後に値ファイルを開く。ヘッダの vlog_pos より後ろは
+ * 書いている途中で落ちた分なので切り捨てる */
+static int kvm_tier_open(KVM *db) {
+    if (!db->path) return -1;
+    char *vp = kvm_vlog_path(db->path, db->vlog_seq);
+    if (!vp) return -1;
+    int writer = (db->omode & KVMOWRITER) != 0;
+    db->vfd = open(vp, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    free(vp);
+    if (db->vfd < 0) return -1;
+    if (writer && ftruncate(db->vfd, db->vlog_pos) != 0) return -1;
+    if (writer && db->vlog_seq) {
+        /* 入れ替えの直後に落ちていれば前の世代が残っている */
+        vp = kvm_vlog_path(db->path, db->vlog_seq - 1);
+        if (vp) unlink(vp);
+        free(vp);
+    }
+#ifdef POSIX_FADV_RANDOM
+    posix_fadvise(db->vfd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    db->cache = kvm_cache_new(db->cache_bytes);
+    if (!db->cache) return -1;
+    /* 領域（キーと索引）は先に読み込ませておき、RAM に留める */
+    madvise(db->mem, db->write_pos, MADV_WILLNEED);
+    kvm_pin(db);
+    return 0;
+}
+
+static void kvm_tier_close(KVM *db) {
+    if (db->vfd >= 0) close(db->vfd);
+    db->vfd = -1;
+    kvm_cache_free(db->cache);
+    db->cache = NULL;
+    db->pinned = 0;
+}
+
+static inline uint8_t line_tag(uint64_t h) {
+    uint8_t t = h >> 32;
+    return t < 2 ? t + 2 : t;
+}
+
+static inline unsigned line_match(const Line *l, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i t = _mm_load_si128((const __m128i*)l->tag);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)tag))) & ((1u << LINE_SLOTS) - 1);
+#else
+    unsigned m = 0;
+    for (int i = 0; i < LINE_SLOTS; i++) m |= (unsigned)(l->tag[i] == tag) << i;
+    return m;
+#endif
+}
+
+/* 空きスロット（tag 0）があればそこで探索終了 */
+static inline int line_has_empty(const Line *l) {
+    return line_match(l, 0) != 0;
+}
+
+/* キーを格納しているスロットの off を返す。無ければ NULL。
+ * ep には照合した Entry を返す（スロットを読み直すと書き手の差し替えと食い違うため） */
+static kvm_ref_t *line_find(KVM *db, Line *t, size_t n, uint64_t h, const char *key, uint32_t klen,
+                            Entry **ep) {
+    uint8_t tag = line_tag(h);
+    size_t i = h & (n - 1);
+    for (size_t probe = 0; probe < n; probe++) {
+        Line *l = &t[i];
+        unsigned mt = line_match(l, tag);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (unsigned m = mt; m; m &= m - 1) {
+            int s = __builtin_ctz(m);
+            Entry *e = ENTRY(db, __atomic_load_n(&l->off[s], __ATOMIC_RELAXED));
+            if (e->klen == klen && memcmp(e->data, key, klen) == 0) {
+                if (ep) *ep = e;
+                return &l->off[s];
+            }
+        }
+        if (line_has_empty(l)) break;
+        i = (i + 1) & (n - 1);
+    }
+    return NULL;
+}
+
+/* キーが無いことが分かっている前提で空き（または削除済み）スロットに入れる */
+static void line_insert(Line *t, size_t n, uint64_t h, kvm_ref_t off) {
+    size_t i = h & (n - 1);
+    for (;;) {
+        Line *l = &t[i];
+        unsigned m = line_match(l, 0) | line_match(l, 1);
+        if (m) {
+            int s = __builtin_ctz(m);
+            l->off[s] = off;
+            __atomic_store_n(&l->tag[s], line_tag(h), __ATOMIC_RELEASE);
+            return;
+        }
+        i = (i + 1) & (n - 1);
+    }
+}
+
+/* ========== kvm_setmutex 時の排他（KVMSYNC） ========== */
+static inline void kvm_wlock(KVM *db) {
+    if (db->sync) pthread_mutex_lock(&db->sync->wmtx);
+}
+
+static inline void kvm_wunlock(KVM *db) {
+    if (db->sync) pthread_mutex_unlock(&db->sync->wmtx);
+}
+
+/* スレッドごとの stripe 番号（初回に順番に振る） */
+static _Thread_local int kvm_tstripe = -1;
+static atomic_int kvm_nstripe;
+
+static inline KVMSTRIPE *kvm_rlock(KVM *db) {
+    KVMSYNC *sy = db->sync;
+    if (!sy) return NULL;
+    if (kvm_tstripe < 0) kvm_tstripe = atomic_fetch_add(&kvm_nstripe, 1) % KVM_RSTRIPES;
+    KVMSTRIPE *st = &sy->stripe[kvm_tstripe];
+    for (;;) {
+        atomic_fetch_add(&st->n, 1);
+        if (!atomic_load(&sy->gate)) return st;
+        atomic_fetch_sub(&st->n, 1);
+        while (atomic_load_explicit(&sy->gate, memory_order_relaxed)) sched_yield();
+    }
+}
+
+static inline void kvm_runlock(KVMSTRIPE *st) {
+    if (st) atomic_fetch_sub_explicit(&st->n, 1, memory_order_release);
+}
+
+/* 書き手（wmtx を持っている）が読み手を締め出す */
+static void kvm_excl(KVM *db) {
+    KVMSYNC *sy = db->sync;
+    if (!sy || sy->excl++) return;
+    atomic_store(&sy->gate, 1);
+    for (int i = 0; i < KVM_RSTRIPES; i++)
+        while (atomic_load(&sy->stripe[i].n)) sched_yield();
+}
+
+static void kvm_unexcl(KVM *db) {
+    if (db->sync && --db->sync->excl == 0) atomic_store(&db->sync->gate, 0);
+}
+
+static inline unsigned kvm_read_begin(KVM *db) {
+    if (!db->sync) return 0;
+    unsigned s;
+    while ((s = atomic_load_explicit(&db->sync->seq, memory_order_acquire)) & 1) sched_yield();
+    return s;
+}
+
+static inline int kvm_read_retry(KVM *db, unsigned s) {
+    if (!db->sync) return 0;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&db->sync->seq, memory_order_relaxed) != s;
+}
+
+/* ========== 統計（kvm_stats） ========== */
+/* 操作の数えはスレッドごとの KVMCTR に持ち、持ち主のスレッドだけが書く。kvm_stats が
+ * 一覧を辿って足すので、get も put も他のスレッドと同じキャッシュラインに書かない。
+ * スレッドは自分の KVMCTR を KVMSTATS.id で引く小さな表に覚える（DB のポインタは
+ * 使い回されるので id で見分ける）。終わったスレッドの KVMCTR も数えを残したまま
+ * 置いておき、同じ pthread_t のスレッドが来れば引き継ぐ */
+#define KVM_TCTR 64             /* スレッドごとに覚えておく DB の数（id の下位ビットで引く） */
+
+typedef struct KVMCTR {
+    uint64_t v[KVMCNUM];
+    pthread_t owner;
+    struct KVMCTR *next;
+} __attribute__((aligned(64))) KVMCTR;
+
+struct KVMSTATS {
+    pthread_mutex_t mtx;    /* head に足す時と kvm_stats が辿る時だけ */
+    KVMCTR *head;
+    uint64_t id;            /* 0 は使わず、使い回さない */
+    int nctr;
+};
+
+static _Thread_local struct { uint64_t id; KVMCTR *c; } kvm_tctr[KVM_TCTR];
+static atomic_uint_fast64_t kvm_nstats;
+
+static KVMSTATS *kvm_stats_new(void) {
+    KVMSTATS *s = calloc(1, sizeof(KVMSTATS));
+    if (!s) return NULL;
+    pthread_mutex_init(&s->mtx, NULL);
+    s->id = atomic_fetch_add(&kvm_nstats, 1) + 1;
+    return s;
+}
+
+static void kvm_stats_free(KVMSTATS *s) {
+    if (!s) return;
+    for (KVMCTR *c = s->head, *next; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    pthread_mutex_destroy(&s->mtx);
+    free(s);
+}
+
+static KVMCTR *kvm_ctr_slow(KVMSTATS *s, unsigned i) {
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&s->mtx);
+    KVMCTR *c = s->head;
+    while (c && !pthread_equal(c->owner, self)) c = c->next;
+    void *p;
+    if (!c && posix_memalign(&p, 64, sizeof(KVMCTR)) == 0) {
+        c = memset(p, 0, sizeof(KVMCTR));
+        c->owner = self;
+        c->next = s->head;
+        s->head = c;
+        s->nctr++;
+    }
+    pthread_mutex_unlock(&s->mtx);
+    if (c) {
+        kvm_tctr[i].id = s->id;
+        kvm_tctr[i].c = c;
+    }
+    return c;
+}
+
+/* このスレッドの数え。kvm_setstats(db, 0) なら NULL */
+static inline KVMCTR *kvm_ctr(KVM *db) {
+    KVMSTATS *s = db->stats;
+    if (!s) return NULL;
+    unsigned i = s->id & (KVM_TCTR - 1);
+    if (kvm_tctr[i].id == s->id) return kvm_tctr[i].c;
+    return kvm_ctr_slow(s, i);
+}
+
+/* 書くのは持ち主だけなので読んで足して置くだけ（kvm_stats が途中の値を読めるよう atomic に置く） */
+static inline void kvm_count(KVMCTR *c, int i) {
+    if (c) __atomic_store_n(&c->v[i], c->v[i] + 1, __ATOMIC_RELAXED);
+}
+
+/* kvm_open 前に呼ぶ。on が 0 なら操作を数えない（kvm_stats の op は 0 のまま）。既定は数える */
+int kvm_setstats(KVM *db, int on) {
+    if (db->mem) return -1;
+    if (on && !db->stats) return (db->stats = kvm_stats_new()) ? 0 : -1;
+    if (!on) {
+        kvm_stats_free(db->stats);
+        db->stats = NULL;
+    }
+    return 0;
+}
+
+static void stats_hist(KVMSTAT *st, size_t n, uint64_t k) {
+    st->hist[n < KVM_HIST ? n : KVM_HIST - 1] += k;
+    if (n > st->hist_max) st->hist_max = n;
+}
+
+/* チェーン: 長さ L のバケットのキーを全部引けば 1 + 2 + … + L 回照合する */
+static void stats_chains(KVM *db, const kvm_ref_t *t, size_t from, size_t n, KVMSTAT *st,
+                         uint64_t *keys, double *cmp) {
+    for (size_t b = from; b < n; b++) {
+        size_t len = 0;
+        for (kvm_ref_t r = t[b]; r; r = ENTRY(db, r)->next) len++;
+        stats_hist(st, len, 1);
+        *keys += len;
+        *cmp += len * (len + 1) / 2.0;
+    }
+}
+
+/* KVMTLINE: 置かれたキーごとに家のラインから何本先にあるか。組み直し中の古い表は
+ * from より前が移し終えた所で、移したスロットも削除済み(1)になっているので数えない */
+static void stats_lines(KVM *db, const Line *t, size_t from, size_t n, KVMSTAT *st, uint64_t *keys,
+                        double *cmp) {
+    for (size_t i = from; i < n; i++) {
+        for (int s = 0; s < LINE_SLOTS; s++) {
+            if (t[i].tag[s] == 1) st->tombs++;
+            if (t[i].tag[s] < 2) continue;
+            Entry *e = ENTRY(db, t[i].off[s]);
+            size_t dist = (i - (kvm_hash(e->data, e->klen) & (n - 1))) & (n - 1);
+            stats_hist(st, dist, 1);
+            (*keys)++;
+            *cmp += dist + 1;
+        }
+    }
+}
+
+/* 索引表と Bloom を一通り読んで数える（キー数と Bloom の大きさに比例する）。
+ * kvm_setmutex 時は数える間だけ書き手を止める（読み手は止めない）。
+ * 操作の数えは開いていなくても返すが、その時の戻り値は -1 */
+int kvm_stats(KVM *db, KVMSTAT *st) {
+    memset(st, 0, sizeof(*st));
+    st->bloom_fpr = 1;
+    if (db->stats) {
+        pthread_mutex_lock(&db->stats->mtx);
+        for (KVMCTR *c = db->stats->head; c; c = c->next)
+            for (int i = 0; i < KVMCNUM; i++) st->op[i] += __atomic_load_n(&c->v[i], __ATOMIC_RELAXED);
+        st->threads = db->stats->nctr;
+        pthread_mutex_unlock(&db->stats->mtx);
+    }
+    kvm_wlock(db);
+    if (!db->mem) {
+        kvm_wunlock(db);
+        return -1;
+    }
+    st->count = db->count;
+    st->mem_size = db->mem_size;
+    st->write_pos = db->write_pos;
+    st->live_bytes = db->live_bytes;
+    st->dead_bytes = db->dead_bytes;
+    st->nbuckets = db->nbuckets;
+    /* 期限切れで外していないキーも数えるので count とはずれることがある */
+    uint64_t keys = 0;
+    double cmp = 0;
+    if (KVM_ISLINE(db)) {
+        st->load = (double)db->count / (db->nbuckets * LINE_SLOTS);
+        stats_lines(db, db->lines, 0, db->nbuckets, st, &keys, &cmp);
+        if (db->old_lines) stats_lines(db, db->old_lines, db->rehash_pos, db->old_nbuckets, st,
+                                       &keys, &cmp);
+    } else {
+        st->load = (double)db->count / db->nbuckets;
+        stats_chains(db, db->buckets, 0, db->nbuckets, st, &keys, &cmp);
+        if (db->old_buckets) stats_chains(db, db->old_buckets, db->rehash_pos, db->old_nbuckets, st,
+                                               &keys, &cmp);
+    }
+    st->probe = keys ? cmp / keys : 0;
+    /* 引くキーが当たるブロックの 8 ワードで、それぞれ立っているビットに当たる確率の積 */
+    st->bloom_bytes = db->bloom_blocks * BLOOM_K * sizeof(uint64_t);
+    if (db->bloom_blocks) {
+        uint64_t bits = 0;
+        double fpr = 0;
+        for (size_t b = 0; b < db->bloom_blocks; b++) {
+            const uint64_t *blk = db->bloom + b * BLOOM_K;
+            double p = 1;
+            for (int i = 0; i < BLOOM_K; i++) {
+                int c = __builtin_popcountll(blk[i]);
+                bits += c;
+                p *= c / 64.0;
+            }
+            fpr += p;
+        }
+        st->bloom_fill = (double)bits / (db->bloom_blocks * BLOOM_K * 64);
+        if (KVM_BLOOM) st->bloom_fpr = fpr / db->bloom_blocks;
+    }
+    kvm_wunlock(db);
+    return 0;
+}
+
+/* ========== NUMA（kvm_setnode / kvm_setreplica） ========== */
+/* kvm_setnode は領域（Bloom・索引表・データ）を mbind でそのノードに寄せる。
+ * kvm_setreplica は読みの多い DB のために Bloom と索引表の写しをノードごとに持ち、
+ * 読み手は自分のノードの写しで Bloom を引いて Entry の参照まで辿る（Entry は領域のまま）。
+ * 写しは kvm_replicate がその時の中身を写すだけで、put / delete などの書き手が入ると
+ * wseq が進んで古くなり、次に写すまで読み手は元の索引を見る。写す間は読み手を
+ * 締め出す（kvm_excl）ので、写しを途中まで見ることはない */
+typedef struct {
+    uint8_t *buf;           /* ノードに mbind した mmap。先頭に Bloom、続けて索引表 */
+    size_t size;
+    uint64_t *bloom;
+    void *table;            /* kvm_ref_t[] か Line[] */
+    size_t nbuckets;
+    atomic_ulong seq;       /* 写した時の wseq（0 なら写していない） */
+} KVMREPN;
+
+struct KVMREP {
+    atomic_ulong wseq;
+    char pad[64 - sizeof(atomic_ulong)];  /* 書き手が増やすので写しの一覧と線を分ける */
+    int nnodes;
+    KVMREPN node[KVM_NODES];
+};
+
+static _Thread_local int kvm_tnode = -1;
+
+/* 呼んだスレッドが初めて聞いた時に載っていた CPU のノード（CPU に固定したスレッドを前提にする） */
+int kvm_thread_node(void) {
+    if (kvm_tnode < 0) {
+        unsigned node = 0;
+#ifdef KVM_NUMA
+        unsigned cpu;
+        if (syscall(__NR_getcpu, &cpu, &node, NULL) != 0) node = 0;
+#endif
+        kvm_tnode = node < KVM_NODES ? (int)node : 0;
+    }
+    return kvm_tnode;
+}
+
+/* このスレッドのノードの写し。写していないか古ければ NULL（元の索引を見る） */
+static inline KVMREPN *kvm_rep(KVM *db) {
+    KVMREP *r = db->rep;
+    if (!r) return NULL;
+    int n = kvm_thread_node();
+    if (n >= r->nnodes) return NULL;
+    KVMREPN *p = &r->node[n];
+    unsigned long s = atomic_load_explicit(&p->seq, memory_order_acquire);
+    return s && s == atomic_load(&r->wseq) ? p : NULL;
+}
+
+/* 索引か Bloom を書き換える書き手が、書き換える前に呼ぶ */
+static inline void kvm_dirty(KVM *db) {
+    if (db->rep) atomic_fetch_add(&db->rep->wseq, 1);
+}
+
+/* 写しの索引で引く。移行中の旧表は写さない（写す前に移行を済ませる） */
+static void kvm_find_rep(KVM *db, KVMREPN *p, uint64_t h, const char *key, uint32_t klen, Entry **ep) {
+    if (KVM_ISLINE(db)) {
+        line_find(db, p->table, p->nbuckets, h, key, klen, ep);
+        return;
+    }
+    kvm_ref_t r = ((const kvm_ref_t*)p->table)[h & (p->nbuckets - 1)];
+    while (r) {
+        Entry *e = ENTRY(db, r);
+        if (e->klen == klen && memcmp(e->data, key, klen) == 0) {
+            *ep = e;
+            return;
+        }
+        r = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* 旧バケット表の bucket 番目を新表に移す。新表は倍の大きさなので
+ * 移動先は bucket か bucket + old_nbuckets のどちらか。チェーン順は保つ */
+static void kvm_rehash_bucket(KVM *db, size_t bucket) {
+    kvm_ref_t *lo = &db->buckets[bucket];
+    kvm_ref_t *hi = &db->buckets[bucket + db->old_nbuckets];
+    kvm_ref_t off = db->old_buckets[bucket];
+    while (off) {
+        Entry *e = ENTRY(db, off);
+        kvm_ref_t next = e->next;
+        kvm_ref_t **tail = (kvm_hash(e->data, e->klen) & db->old_nbuckets) ? &hi : &lo;
+        e->next = 0;
+        **tail = off;
+        *tail = &e->next;
+        off = next;
+    }
+    db->old_buckets[bucket] = 0;
+}
+
+/* 旧ラインの中身を新表に移す。移したスロットは削除済み(1)にするので、
+ * 旧表に残るキーの探索列は途切れない */
+static void kvm_rehash_line(KVM *db, size_t line) {
+    Line *l = &db->old_lines[line];
+    for (int s = 0; s < LINE_SLOTS; s++) {
+        if (l->tag[s] < 2) continue;
+        Entry *e = ENTRY(db, l->off[s]);
+        line_insert(db->lines, db->nbuckets, kvm_hash(e->data, e->klen), l->off[s]);
+        l->tag[s] = 1;
+    }
+}
+
+static int kvm_rehashing(KVM *db) {
+    return db->old_nbuckets != 0;
+}
+
+static void kvm_rehash_step(KVM *db) {
+    kvm_excl(db);
+    for (int i = 0; i < REHASH_STEP && db->rehash_pos < db->old_nbuckets; i++) {
+        if (KVM_ISLINE(db)) kvm_rehash_line(db, db->rehash_pos++);
+        else kvm_rehash_bucket(db, db->rehash_pos++);
+    }
+    if (db->rehash_pos == db->old_nbuckets) {
+        size_t size = entry_size(0, table_bytes(db, db->old_nbuckets) + 64);
+        db->live_bytes -= size;
+        db->dead_bytes += size;
+        db->old_buckets = NULL;
+        db->old_lines = NULL;
+        db->old_nbuckets = 0;
+    }
+    kvm_unexcl(db);
+}
+
+/* 負荷率を超えたら倍の索引表を確保して段階的な移行を始める。
+ * 確保できなければ現在の表のまま続ける。KVMTCACHE は輪の外に置けないので伸ばさない */
+static void kvm_maybe_grow(KVM *db) {
+    if (kvm_rehashing(db) || (db->opts & KVMTCACHE)) return;
+    if (KVM_ISLINE(db)) {
+        if (db->count <= db->nbuckets * LINE_LOAD) return;
+        Line *t = kvm_alloc_table(db, db->nbuckets * 2);
+        if (!t) return;
+        kvm_excl(db);
+        db->old_lines = db->lines;
+        db->lines = t;
+    } else {
+        if (db->count <= db->nbuckets * LOAD_FACTOR) return;
+        kvm_ref_t *t = kvm_alloc_table(db, db->nbuckets * 2);
+        if (!t) return;
+        kvm_excl(db);
+        db->old_buckets = db->buckets;
+        db->buckets = t;
+    }
+    db->old_nbuckets = db->nbuckets;
+    db->rehash_pos = 0;
+    db->nbuckets *= 2;
+    kvm_unexcl(db);
+}
+
+/* キーのチェーン先頭。移行前のバケットなら旧表を指す */
+static inline kvm_ref_t *kvm_slot(KVM *db, uint64_t h) {
+    if (db->old_buckets) {
+        size_t ob = h & (db->old_nbuckets - 1);
+        if (ob >= db->rehash_pos) return &db->old_buckets[ob];
+    }
+    return &db->buckets[h & (db->nbuckets - 1)];
+}
+
+/* KVMTLINE でキーの off を持つスロット。移行中は旧表も見る */
+static inline kvm_ref_t *kvm_line_slot(KVM *db, uint64_t h, const char *key, uint32_t klen,
+                                        Entry **ep) {
+    kvm_ref_t *p = NULL;
+    if (db->old_lines) p = line_find(db, db->old_lines, db->old_nbuckets, h, key, klen, ep);
+    if (!p) p = line_find(db, db->lines, db->nbuckets, h, key, klen, ep);
+    return p;
+}
+
+/* キーの Entry を指している参照（チェーンなら直前の next か先頭、ラインならスロット）。
+ * 書き換えれば置き換え・削除ができる。無ければ NULL。読み手は ep の Entry を使う */
+static kvm_ref_t *kvm_find(KVM *db, uint64_t h, const char *key, uint32_t klen, Entry **ep) {
+    if (KVM_ISLINE(db)) return kvm_line_slot(db, h, key, klen, ep);
+    kvm_ref_t *link = kvm_slot(db, h);
+    for (kvm_ref_t r; (r = __atomic_load_n(link, __ATOMIC_ACQUIRE)); ) {
+        Entry *e = ENTRY(db, r);
+        if (e->klen == klen && memcmp(e->data, key, klen) == 0) {
+            if (ep) *ep = e;
+            return link;
+        }
+        link = &e->next;
+    }
+    return NULL;
+}
+
+/* ========== 順序付き索引（kvm_setorder） ========== */
+/* ハッシュ索引とは別に、同じ Entry をキー順に並べた B+tree をヒープに持つ。
+ * ノードには参照と一緒にキー先頭 8 バイト（ビッグエンディアン）を並べておき、
+ * 比較の多くは Entry を読まずに済ませる。ファイルには書かず、kvm_open・
+ * コンパクション・kvm_bulk_load の後に生きているキーを並べて一度に組み直す。
+ * 削除で空いたノードは詰めない（次に組み直すまでそのまま） */
+#define ORD_FAN 32
+#define ORD_FILL (ORD_FAN - ORD_FAN / 8)  /* 組み直す時に 1 ノードへ詰める数 */
+
+typedef struct ORDNODE ORDNODE;
+struct ORDNODE {
+    int n;                  /* 葉ならキー数、内部ノードなら区切りの数（子は n + 1 個） */
+    int leaf;
+    uint64_t pfx[ORD_FAN];
+    kvm_ref_t ref[ORD_FAN]; /* 葉は Entry、内部ノードは child[i + 1] の最小キーの Entry */
+    ORDNODE *next;          /* 葉の右隣 */
+    ORDNODE *child[ORD_FAN + 1];  /* 内部ノードだけ */
+};
+
+struct KVMORD {
+    ORDNODE *root;          /* 空なら NULL */
+    ORDNODE *first;         /* 一番左の葉 */
+    size_t nodes;
+};
+
+/* 組み直し用に集めるキー */
+typedef struct {
+    uint64_t pfx;
+    kvm_ref_t ref;
+} ORDKEY;
+
+static inline uint64_t ord_pfx(const void *key, uint32_t klen) {
+    const uint8_t *k = key;
+    uint64_t p = 0;
+    for (uint32_t i = 0; i < 8; i++) p = p << 8 | (i < klen ? k[i] : 0);
+    return p;
+}
+
+/* key と ref の Entry のキーの大小（memcmp 順、同じ前置ならば短い方が小さい） */
+static inline int ord_cmp(KVM *db, uint64_t p, const char *key, uint32_t klen, uint64_t sp, kvm_ref_t sref) {
+    if (p != sp) return p < sp ? -1 : 1;
+    const Entry *e = ENTRY(db, sref);
+    uint32_t m = klen < e->klen ? klen : e->klen, skip = m < 8 ? m : 8;
+    int c = memcmp(key + skip, e->data + skip, m - skip);
+    if (c) return c;
+    return klen < e->klen ? -1 : klen > e->klen;
+}
+
+/* x の中で key 以上になる最初の位置（upper なら key より大きい最初の位置） */
+static int ord_search(KVM *db, const ORDNODE *x, uint64_t p, const char *key, uint32_t klen, int upper) {
+    int lo = 0, hi = x->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = ord_cmp(db, p, key, klen, x->pfx[mid], x->ref[mid]);
+        if (c > 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static ORDNODE *ord_node(KVMORD *o, int leaf) {
+    ORDNODE *x = malloc(sizeof(ORDNODE));
+    if (!x) return NULL;
+    x->n = 0;
+    x->leaf = leaf;
+    x->next = NULL;
+    o->nodes++;
+    return x;
+}
+
+static void ord_free(ORDNODE *x) {
+    if (!x) return;
+    if (!x->leaf)
+        for (int i = 0; i <= x->n; i++) ord_free(x->child[i]);
+    free(x);
+}
+
+static void ord_clear(KVMORD *o) {
+    ord_free(o->root);
+    o->root = o->first = NULL;
+    o->nodes = 0;
+}
+
+/* x 以下に入れる。x が分割されたら右半分を *split に、その最小キーを *sp / *sr に返す */
+static int ord_ins(KVM *db, ORDNODE *x, uint64_t p, const char *key, uint32_t klen, kvm_ref_t ref,
+                   ORDNODE **split, uint64_t *sp, kvm_ref_t *sr) {
+    KVMORD *o = db->ord;
+    *split = NULL;
+    if (x->leaf) {
+        int i = ord_search(db, x, p, key, klen, 0);
+        if (i < x->n && ord_cmp(db, p, key, klen, x->pfx[i], x->ref[i]) == 0) {
+            x->ref[i] = ref;  /* 置き換えで Entry が動いた、または消した後に入れ直した */
+            return 0;
+        }
+        ORDNODE *t = x;
+        if (x->n == ORD_FAN) {
+            ORDNODE *r = ord_node(o, 1);
+            if (!r) return -1;
+            int h = ORD_FAN / 2;
+            r->n = ORD_FAN - h;
+            memcpy(r->pfx, x->pfx + h, r->n * sizeof(uint64_t));
+            memcpy(r->ref, x->ref + h, r->n * sizeof(kvm_ref_t));
+            x->n = h;
+            r->next = x->next;
+            x->next = r;
+            if (i > h) { t = r; i -= h; }
+            *split = r;
+        }
+        memmove(t->pfx + i + 1, t->pfx + i, (t->n - i) * sizeof(uint64_t));
+        memmove(t->ref + i + 1, t->ref + i, (t->n - i) * sizeof(kvm_ref_t));
+        t->pfx[i] = p;
+        t->ref[i] = ref;
+        t->n++;
+        if (*split) { *sp = (*split)->pfx[0]; *sr = (*split)->ref[0]; }
+        return 0;
+    }
+    int i = ord_search(db, x, p, key, klen, 1);
+    ORDNODE *cs;
+    uint64_t cp;
+    kvm_ref_t cr;
+    if (ord_ins(db, x->child[i], p, key, klen, ref, &cs, &cp, &cr) != 0) return -1;
+    if (!cs) return 0;
+    ORDNODE *t = x;
+    if (x->n == ORD_FAN) {
+        /* 真ん中の区切りを親に上げ、右半分を新しいノードに移す */
+        ORDNODE *r = ord_node(o, 0);
+        if (!r) return -1;
+        int mid = ORD_FAN / 2;
+        r->n = ORD_FAN - mid - 1;
+        memcpy(r->pfx, x->pfx + mid + 1, r->n * sizeof(uint64_t));
+        memcpy(r->ref, x->ref + mid + 1, r->n * sizeof(kvm_ref_t));
+        memcpy(r->child, x->child + mid + 1, (r->n + 1) * sizeof(ORDNODE*));
+        *sp = x->pfx[mid];
+        *sr = x->ref[mid];
+        x->n = mid;
+        if (i > mid) { t = r; i -= mid + 1; }
+        *split = r;
+    }
+    memmove(t->pfx + i + 1, t->pfx + i, (t->n - i) * sizeof(uint64_t));
+    memmove(t->ref + i + 1, t->ref + i, (t->n - i) * sizeof(kvm_ref_t));
+    memmove(t->child + i + 2, t->child + i + 1, (t->n - i) * sizeof(ORDNODE*));
+    t->pfx[i] = cp;
+    t->ref[i] = cr;
+    t->child[i + 1] = cs;
+    t->n++;
+    return 0;
+}
+
+/* ref の Entry のキーを入れる（同じキーがあれば参照を差し替える） */
+static int ord_insert(KVM *db, kvm_ref_t ref) {
+    KVMORD *o = db->ord;
+    const Entry *e = ENTRY(db, ref);
+    uint64_t p = ord_pfx(e->data, e->klen), sp;
+    kvm_ref_t sr;
+    ORDNODE *split;
+    if (!o->root) {
+        if (!(o->root = o->first = ord_node(o, 1))) return -1;
+    }
+    if (ord_ins(db, o->root, p, e->data, e->klen, ref, &split, &sp, &sr) != 0) return -1;
+    if (split) {
+        ORDNODE *r = ord_node(o, 0);
+        if (!r) return -1;
+        r->n = 1;
+        r->pfx[0] = sp;
+        r->ref[0] = sr;
+        r->child[0] = o->root;
+        r->child[1] = split;
+        o->root = r;
+    }
+    return 0;
+}
+
+/* key 以上の最初の位置。無ければ NULL */
+static ORDNODE *ord_seek(KVM *db, const char *key, uint32_t klen, int *ip) {
+    ORDNODE *x = db->ord->root;
+    if (!x) return NULL;
+    uint64_t p = ord_pfx(key, klen);
+    while (!x->leaf) x = x->child[ord_search(db, x, p, key, klen, 1)];
+    int i = ord_search(db, x, p, key, klen, 0);
+    while (x && i >= x->n) { x = x->next; i = 0; }
+    *ip = i;
+    return x;
+}
+
+static void ord_remove(KVM *db, const char *key, uint32_t klen) {
+    int i;
+    ORDNODE *x = ord_seek(db, key, klen, &i);
+    if (!x || ord_cmp(db, ord_pfx(key, klen), key, klen, x->pfx[i], x->ref[i]) != 0) return;
+    x->n--;
+    memmove(x->pfx + i, x->pfx + i + 1, (x->n - i) * sizeof(uint64_t));
+    memmove(x->ref + i, x->ref + i + 1, (x->n - i) * sizeof(kvm_ref_t));
+}
+
+/* キー順に並んだ n 件から葉を ORD_FILL 件ずつ作り、上の段を順に積む。
+ * ノードは先に全部確保する（途中で足りなくなっても木が半端にならない） */
+static int ord_build(KVM *db, const ORDKEY *keys, size_t n) {
+    KVMORD *o = db->ord;
+    ord_clear(o);
+    if (!n) return 0;
+    size_t nleaf = (n + ORD_FILL - 1) / ORD_FILL, total = 0;
+    for (size_t c = nleaf; ; c = (c + ORD_FILL) / (ORD_FILL + 1)) {
+        total += c;
+        if (c == 1) break;
+    }
+    ORDNODE **all = malloc(total * sizeof(ORDNODE*));
+    ORDKEY *low = malloc(nleaf * sizeof(ORDKEY));  /* 各ノードの最小キー */
+    size_t got = 0;
+    if (all && low)
+        for (; got < total; got++)
+            if (!(all[got] = ord_node(o, got < nleaf))) break;
+    if (got < total) {
+        for (size_t i = 0; i < got; i++) free(all[i]);
+        o->nodes = 0;
+        free(all);
+        free(low);
+        return -1;
+    }
+    for (size_t j = 0; j < nleaf; j++) {
+        ORDNODE *x = all[j];
+        size_t b = j * ORD_FILL;
+        x->n = n - b < ORD_FILL ? (int)(n - b) : ORD_FILL;
+        for (int i = 0; i < x->n; i++) { x->pfx[i] = keys[b + i].pfx; x->ref[i] = keys[b + i].ref; }
+        x->next = j + 1 < nleaf ? all[j + 1] : NULL;
+        low[j] = keys[b];
+    }
+    /* all[lv, lv + cnt) が今の段。その上の段をすぐ後ろに作る */
+    size_t lv = 0, cnt = nleaf;
+    while (cnt > 1) {
+        size_t up = (cnt + ORD_FILL) / (ORD_FILL + 1);
+        for (size_t j = 0; j < up; j++) {
+            ORDNODE *x = all[lv + cnt + j];
+            size_t b = j * (ORD_FILL + 1), m = cnt - b < ORD_FILL + 1 ? cnt - b : ORD_FILL + 1;
+            x->child[0] = all[lv + b];
+            for (size_t i = 1; i < m; i++) {
+                x->pfx[i - 1] = low[b + i].pfx;
+                x->ref[i - 1] = low[b + i].ref;
+                x->child[i] = all[lv + b + i];
+            }
+            x->n = (int)m - 1;
+            low[j] = low[b];
+        }
+        lv += cnt;
+        cnt = up;
+    }
+    o->first = all[0];
+    o->root = all[lv];
+    free(all);
+    free(low);
+    return 0;
+}
+
+static int ord_key_cmp(const void *a, const void *b, void *arg) {
+    const ORDKEY *x = a, *y = b;
+    const Entry *e = ENTRY((KVM*)arg, x->ref);
+    return ord_cmp(arg, x->pfx, e->data, e->klen, y->pfx, y->ref);
+}
+
+static void ord_collect1(KVM *db, kvm_ref_t ref, ORDKEY *keys, size_t *n) {
+    const Entry *e = ENTRY(db, ref);
+    keys[*n].pfx = ord_pfx(e->data, e->klen);
+    keys[(*n)++].ref = ref;
+}
+
+/* ハッシュ索引（移行中なら旧表も）から生きているキーを集めて組み直す */
+static int kvm_ord_rebuild(KVM *db) {
+    ORDKEY *keys = malloc((db->count + 1) * sizeof(ORDKEY));
+    if (!keys) return -1;
+    size_t n = 0;
+    for (int old = 0; old < 2; old++) {
+        size_t nb = old ? db->old_nbuckets : db->nbuckets;
+        if (KVM_ISLINE(db)) {
+            Line *t = old ? db->old_lines : db->lines;
+            for (size_t b = 0; t && b < nb; b++)
+                for (int s = 0; s < LINE_SLOTS; s++)
+                    if (t[b].tag[s] >= 2 && n < db->count) ord_collect1(db, t[b].off[s], keys, &n);
+        } else {
+            kvm_ref_t *t = old ? db->old_buckets : db->buckets;
+            for (size_t b = 0; t && b < nb; b++)
+                for (kvm_ref_t off = t[b]; off && n < db->count; off = ENTRY(db, off)->next)
+                    ord_collect1(db, off, keys, &n);
+        }
+    }
+    qsort_r(keys, n, sizeof(ORDKEY), ord_key_cmp, db);
+    int ret = ord_build(db, keys, n);
+    free(keys);
+    return ret;
+}
+
+KVM *kvm_new(void) {
+    KVM *db = calloc(1, sizeof(KVM));
+    db->fd = -1;
+    db->vfd = -1;
+    kvm_tune(db, 0, 0);
+    db->cache_bytes = TIER_CACHE;
+    db->stats = kvm_stats_new();
+    db->node = -1;
+    return db;
+}
+
+/* kvm_open 前に呼ぶ。bnum は想定レコード数の目安（0以下なら既定値）、opts は KVMT*。
+ * KVM_INDEX を決めたビルドでは KVMTLINE はビルドの形に揃える */
+int kvm_tune(KVM *db, int64_t bnum, int opts) {
+    if (db->mem) return -1;
+#if KVM_INDEX == 1
+    opts &= ~KVMTLINE;
+#elif KVM_INDEX == 2
+    opts |= KVMTLINE;
+#endif
+    db->opts = opts;
+    if (bnum <= 0) bnum = BUCKET_COUNT;
+    if (opts & KVMTLINE) bnum /= LINE_SLOTS;
+    db->nbuckets = 1;
+    while ((int64_t)db->nbuckets < bnum) db->nbuckets <<= 1;
+    return 0;
+}
+
+/* kvm_open 前に呼ぶ。expected は想定キー数、fpr は目標の偽陽性率 */
+int kvm_setbloom(KVM *db, int64_t expected, double fpr) {
+    if (db->mem) return -1;
+    db->bloom_expected = expected;
+    db->bloom_fpr = fpr;
+    return 0;
+}
+
+/* kvm_open 前に呼ぶ（tchdbsetmutex 相当）。以後は複数スレッドから kvm_get 系・kvm_mget と
+ * kvm_put 系・kvm_delete 系を同時に呼んでよい。読み手は書き手を待たず、書き手が待つのは
+ * 索引表の拡張・移行とコンパクションの入れ替えの間だけ。
+ * kvm_open / kvm_close / kvm_tune 類は他の操作と並べて呼ばないこと */
+int kvm_setmutex(KVM *db) {
+    if (db->mem || db->sync) return -1;
+    void *p;
+    if (posix_memalign(&p, 64, sizeof(KVMSYNC)) != 0) return -1;
+    KVMSYNC *sy = p;
+    memset(sy, 0, sizeof(KVMSYNC));
+    pthread_mutex_init(&sy->wmtx, NULL);
+    db->sync = sy;
+    return 0;
+}
+
+/* kvm_open 前に呼ぶ。キー順の索引も持ち、kvm_scan / kvm_prefix が使えるようになる
+ * （tcbdb のカーソル相当）。put / delete のたびに木も直すので、そのぶん書きは遅くなる */
+int kvm_setorder(KVM *db) {
+    if (db->mem || db->ord) return -1;
+    db->ord = calloc(1, sizeof(KVMORD));
+    return db->ord ? 0 : -1;
+}
+
+/* kvm_open 前に呼ぶ。KVMTTIER の値を持つ読みキャッシュの上限（バイト） */
+int kvm_setcache(KVM *db, size_t bytes) {
+    if (db->mem) return -1;
+    db->cache_bytes = bytes;
+    return 0;
+}
+
+/* kvm_open 前に呼ぶ。KVMTCACHE の領域の大きさ（バイト、呼ばなければ POOL_SIZE）。
+ * ヘッダと索引表と辞書もこの中に置く。開き直す時はファイルの大きさがそのまま上限 */
+int kvm_setlimit(KVM *db, size_t bytes) {
+    if (db->mem || bytes > POOL_MAX) return -1;
+    db->limit = (bytes + HDR_SIZE - 1) & ~(size_t)(HDR_SIZE - 1);
+    return 0;
+}
+
+/* 書いた所の終わり（KVMTCACHE で先頭に戻っていれば古い側の終わり） */
+static inline size_t kvm_data_end(KVM *db) {
+    return db->ring_wend > db->write_pos ? db->ring_wend : db->write_pos;
+}
+
+static void *kvm_table_ptr(KVM *db, uint64_t off) {
+    return off ? db->mem + off : NULL;
+}
+
+static uint64_t kvm_table_off(KVM *db, const void *p) {
+    return p ? (uint64_t)((const uint8_t*)p - db->mem) : 0;
+}
+
+static void kvm_write_header(KVM *db, uint32_t flags) {
+    KVMHDR *hdr = (KVMHDR*)db->mem;
+    memcpy(hdr->magic, KVM_MAGIC, sizeof(hdr->magic));
+    hdr->version = KVM_VERSION;
+    hdr->flags = flags;
+    hdr->opts = db->opts;
+    hdr->ref_bits = sizeof(kvm_ref_t) * 8;
+    hdr->mem_size = db->mem_size;
+    hdr->write_pos = db->write_pos;
+    hdr->count = db->count;
+    hdr->data_off = db->data_off;
+    hdr->bloom_blocks = db->bloom_blocks;
+    hdr->nbuckets = db->nbuckets;
+    hdr->table_off = kvm_table_off(db, KVM_ISLINE(db) ? (void*)db->lines : (void*)db->buckets);
+    hdr->old_nbuckets = db->old_nbuckets;
+    hdr->old_table_off = kvm_table_off(db, KVM_ISLINE(db) ? (void*)db->old_lines : (void*)db->old_buckets);
+    hdr->rehash_pos = db->rehash_pos;
+    hdr->live_bytes = db->live_bytes;
+    hdr->dead_bytes = db->dead_bytes;
+    hdr->dict_off = kvm_table_off(db, db->dict);
+    hdr->dict_len = db->dict_len;
+    hdr->vlog_pos = db->vlog_pos;
+    hdr->vlog_seq = db->vlog_seq;
+    hdr->ring_off = db->ring_off;
+    hdr->ring_head = db->ring_head;
+    hdr->ring_wend = db->ring_wend;
+}
+
+/* 読めなければ -1。書き手が閉じずに終わったファイル（KVM_FOPEN が残っている）なら 1 */
+static int kvm_read_header(KVM *db) {
+    const KVMHDR *hdr = (const KVMHDR*)db->mem;
+    if (memcmp(hdr->magic, KVM_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version < 2 ||
+        hdr->version > KVM_VERSION) return -1;
+    if (hdr->ref_bits != sizeof(kvm_ref_t) * 8) return -1;
+    if (hdr->mem_size != db->mem_size || hdr->write_pos > hdr->mem_size ||
+        hdr->data_off > hdr->write_pos) return -1;
+    db->opts = hdr->opts;
+    db->write_pos = hdr->write_pos;
+    db->count = hdr->count;
+    db->data_off = hdr->data_off;
+    db->bloom_blocks = hdr->bloom_blocks;
+    db->nbuckets = hdr->nbuckets;
+    db->old_nbuckets = hdr->old_nbuckets;
+    db->rehash_pos = hdr->rehash_pos;
+    db->live_bytes = hdr->live_bytes;
+    db->dead_bytes = hdr->dead_bytes;
+    db->dict = kvm_table_ptr(db, hdr->dict_off);  /* version 2 のヘッダではここはゼロ */
+    db->dict_len = hdr->dict_len;
+    db->vlog_pos = hdr->vlog_pos;
+    db->vlog_seq = hdr->vlog_seq;
+    db->ring_off = hdr->ring_off;
+    db->ring_head = hdr->ring_head;
+    db->ring_wend = hdr->ring_wend;
+    if (KVM_ISLINE(db)) {
+        db->lines = kvm_table_ptr(db, hdr->table_off);
+        db->old_lines = kvm_table_ptr(db, hdr->old_table_off);
+    } else {
+        db->buckets = kvm_table_ptr(db, hdr->table_off);
+        db->old_buckets = kvm_table_ptr(db, hdr->old_table_off);
+    }
+    return (hdr->flags & KVM_FOPEN) ? 1 : 0;
+}
+
+/* 新しい DB の領域割り当て。mem はゼロで埋まっている前提。
+ * KVMTCACHE は Bloom を持たず、索引表の後ろを輪にする（索引表は伸ばさない） */
+#define RING_MIN ((size_t)1 << 20)    /* KVMTCACHE の輪の最小の大きさ */
+
+static int kvm_format(KVM *db) {
+    if ((db->opts & KVMTCACHE) || !KVM_BLOOM) db->bloom_blocks = 0;
+    else bloom_size(db);
+    db->data_off = BLOOM_OFF + db->bloom_blocks * 64;
+    db->write_pos = db->data_off;
+    db->count = 0;
+    db->live_bytes = db->dead_bytes = 0;
+    db->old_nbuckets = 0;
+    db->rehash_pos = 0;
+    db->dict = NULL;
+    db->dict_len = 0;
+    db->vlog_pos = 0;
+    if (KVM_ISLINE(db)) db->lines = kvm_alloc_table(db, db->nbuckets);
+    else db->buckets = kvm_alloc_table(db, db->nbuckets);
+    db->ring_off = db->ring_head = db->write_pos;
+    db->ring_wend = 0;
+    db->tombs = 0;
+    if ((db->opts & KVMTCACHE) && db->write_pos + RING_MIN > db->mem_size) return -1;
+    return db->lines || db->buckets ? 0 : -1;
+}
+
+/* ---------- 閉じられずに終わったファイルの作り直し ---------- */
+/* 書き手は開いている間ヘッダに KVM_FOPEN を立て、ファイルに flock を掛ける。ロックは
+ * プロセスが終われば外れるので、ロックが取れたのに KVM_FOPEN が残っていれば書き手が
+ * 閉じずに落ちている。ヘッダの数字と索引表・Bloom はその後も書き換わっているので
+ * 信じず、データ領域の Entry を前から辿って作り直す。Entry は書き終えてから索引に
+ * 差し込み、置き換えと削除では古い方に EF_STALE / EF_DEAD を立てるので、どちらも
+ * 立っていない最後の Entry がそのキーの今の値になる。辿るのは size が合わない所
+ * （まだ書いていないゼロの所）まで。プロセスだけが落ちたなら書いた分はページ
+ * キャッシュに残っているので全部戻り、OS ごと落ちた時に必ず戻るのは最後の kvm_sync
+ * までの分。KVMTCACHE は輪を回って古い Entry が残るので中身を捨てて空から始める */
+
+/* pos に書き終えた Entry があるか */
+static int kvm_recover_entry(KVM *db, size_t pos) {
+    if (pos + sizeof(Entry) > db->mem_size) return 0;
+    const Entry *e = (const Entry*)(db->mem + pos);
+    if (e->size < sizeof(Entry) || (e->size & 7) || e->size > db->mem_size - pos) return 0;
+    if (e->flags & EF_BLOB) return 1;
+    size_t tb = (e->flags & EF_TTL) ? sizeof(uint32_t) : 0;
+    return (size_t)e->klen + entry_vbytes(e->flags, e->vlen) + tb <= e->size - sizeof(Entry);
+}
+
+static int kvm_recover(KVM *db, const char *path) {
+    if (db->opts & KVMTCACHE) {
+        memset(db->mem + BLOOM_OFF, 0, db->mem_size - BLOOM_OFF);
+        db->lines = NULL;
+        db->buckets = NULL;
+        return kvm_format(db);
+    }
+    /* KVMTTIER の値は値ファイルに実際にある所までしか戻せない */
+    uint64_t vsize = 0;
+    if (db->opts & KVMTTIER) {
+        char *vp = kvm_vlog_path(path, db->vlog_seq);
+        struct stat st;
+        if (vp && stat(vp, &st) == 0) vsize = st.st_size;
+        free(vp);
+    }
+    const Entry *de = db->dict ? (const Entry*)(db->dict - offsetof(Entry, data)) : NULL;
+    int dict_ok = 0;
+    size_t pos = db->data_off, n = 0;
+    while (kvm_recover_entry(db, pos)) {
+        const Entry *e = (const Entry*)(db->mem + pos);
+        if (e == de) dict_ok = (e->flags & EF_BLOB) && e->vlen == db->dict_len + 4 + LZ_TAB_BYTES;
+        if (!(e->flags & (EF_BLOB | EF_DEAD | EF_STALE))) n++;
+        pos += e->size;
+    }
+    if (pos < db->write_pos) return -1;     /* 最後に同期した所より手前で切れている */
+    if (!dict_ok) {
+        db->dict = NULL;
+        db->dict_len = 0;
+        de = NULL;
+    }
+    size_t end = pos;
+    db->write_pos = end;
+    db->count = 0;
+    db->live_bytes = de ? de->size : 0;
+    db->dead_bytes = end - db->data_off - db->live_bytes;
+    db->old_nbuckets = 0;
+    db->rehash_pos = 0;
+    db->old_lines = NULL;
+    db->old_buckets = NULL;
+    db->tombs = 0;
+    size_t want = KVM_ISLINE(db) ? n / LINE_LOAD + 1 : n / LOAD_FACTOR + 1, nb = db->nbuckets;
+    while (nb < want) nb <<= 1;
+    void *t = kvm_alloc_table(db, nb);
+    if (!t) return -1;
+    memset(t, 0, table_bytes(db, nb));
+    db->nbuckets = nb;
+    db->lines = KVM_ISLINE(db) ? t : NULL;
+    db->buckets = KVM_ISLINE(db) ? NULL : t;
+    memset(db->bloom, 0, db->bloom_blocks * 64);
+    uint64_t vend = db->vlog_pos < vsize ? db->vlog_pos : vsize;
+    for (pos = db->data_off; pos < end; pos += ((Entry*)(db->mem + pos))->size) {
+        Entry *e = (Entry*)(db->mem + pos);
+        if (e->flags & (EF_BLOB | EF_DEAD | EF_STALE)) continue;
+        if (e->flags & EF_COLD) {
+            uint64_t off;
+            memcpy(&off, e->data + e->klen, sizeof(off));
+            if (off + e->vlen > vsize) {
+                e->flags |= EF_DEAD;
+                continue;
+            }
+            if (off + e->vlen > vend) vend = off + e->vlen;
+        }
+        uint64_t h = kvm_hash(e->data, e->klen);
+        kvm_ref_t ref = REF(pos), *link = kvm_find(db, h, e->data, e->klen, NULL);
+        if (link) {
+            /* 差し替えの途中で落ちると古い方に EF_STALE が立っていない */
+            Entry *old = ENTRY(db, *link);
+            old->flags |= EF_STALE;
+            db->live_bytes -= old->size;
+            db->dead_bytes += old->size;
+            e->next = old->next;
+            *link = ref;
+        } else if (KVM_ISLINE(db)) {
+            e->next = 0;
+            line_insert(db->lines, db->nbuckets, h, ref);
+            db->count++;
+        } else {
+            kvm_ref_t *slot = kvm_slot(db, h);
+            e->next = *slot;
+            *slot = ref;
+            db->count++;
+        }
+        bloom_add(db, h);
+        db->live_bytes += e->size;
+        db->dead_bytes -= e->size;
+    }
+    db->vlog_pos = vend;
+    return 0;
+}
+
+/* ---------- ノードへの配置と写し ---------- */
+/* 呼んだスレッドのメモリの取り方（set_mempolicy）。old が NULL でなければ前のを返す */
+typedef struct {
+    int mode;
+    unsigned long mask;
+} KVMPOL;
+
+static void kvm_policy_set(int node, KVMPOL *old) {
+#ifdef KVM_NUMA
+    if (old && syscall(__NR_get_mempolicy, &old->mode, &old->mask, KVM_NODES + 1, NULL, 0) != 0) {
+        old->mode = MPOL_DEFAULT;
+        old->mask = 0;
+    }
+    unsigned long mask = 1ul << node;
+    syscall(__NR_set_mempolicy, MPOL_PREFERRED, &mask, KVM_NODES + 1);
+#else
+    (void)node; (void)old;
+#endif
+}
+
+static void kvm_policy_restore(const KVMPOL *old) {
+#ifdef KVM_NUMA
+    syscall(__NR_set_mempolicy, old->mode, old->mode == MPOL_DEFAULT ? NULL : &old->mask, KVM_NODES + 1);
+#else
+    (void)old;
+#endif
+}
+
+/* [addr, addr + len) を node から取る。MPOL_PREFERRED なので埋まれば他のノードから取る */
+static void kvm_mbind(void *addr, size_t len, int node) {
+#ifdef KVM_NUMA
+    unsigned long mask = 1ul << node;
+    syscall(__NR_mbind, addr, len, MPOL_PREFERRED, &mask, KVM_NODES + 1, 0);
+#else
+    (void)addr; (void)len; (void)node;
+#endif
+}
+
+/* /sys/devices/system/node/possible（"0"、"0-1"、"0,2-3" など）の最後の番号 + 1 */
+int kvm_numa_nodes(void) {
+    int n = 1;
+#ifdef KVM_NUMA
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    if (f) {
+        int c, v = -1;
+        while ((c = fgetc(f)) != EOF) {
+            if (c >= '0' && c <= '9') v = (v < 0 ? 0 : v * 10) + (c - '0');
+            else if (v >= 0) { n = v + 1; v = -1; }
+        }
+        if (v >= 0) n = v + 1;
+        fclose(f);
+    }
+#endif
+    return n < KVM_NODES ? n : KVM_NODES;
+}
+
+/* cpu の載っているノード（/sys/devices/system/cpu/cpuN/nodeM）。分からなければ 0 */
+static int kvm_cpu_node(int cpu) {
+    int node = 0;
+#ifdef KVM_NUMA
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    for (struct dirent *de; (de = readdir(d)); ) {
+        int v;
+        if (sscanf(de->d_name, "node%d", &v) == 1) {
+            node = v;
+            break;
+        }
+    }
+    closedir(d);
+#else
+    (void)cpu;
+#endif
+    return node < KVM_NODES ? node : 0;
+}
+
+/* kvm_open 前に呼ぶ。領域（Bloom・索引表・データ）をノード node のメモリに置き、
+ * kvm_open の中で触るページも node から取る。ファイルのページキャッシュには mbind が
+ * 効かないので、開いた後に書くスレッドも同じノードで動かすこと（kvms_setnuma の持ち主は
+ * そうしてある）。-1 で決めないに戻す。NUMA の無いビルドでは -1 */
+int kvm_setnode(KVM *db, int node) {
+#ifdef KVM_NUMA
+    if (db->mem || node < -1 || node >= KVM_NODES) return -1;
+    db->node = node;
+    return 0;
+#else
+    (void)db; (void)node;
+    return -1;
+#endif
+}
+
+/* kvm_open 前に呼ぶ。ノードごとに Bloom と索引表の写しを持ち、kvm_replicate で写してから
+ * 次に書き手が入るまで、読み手は自分のノードの写しを引く。kvm_setmutex も済ませる。
+ * KVMTCACHE とは組めない（追い出した Entry を写しが指したままになる）。
+ * NUMA の無いビルドでは -1 */
+int kvm_setreplica(KVM *db) {
+#ifdef KVM_NUMA
+    if (db->mem || db->rep) return -1;
+    if (!db->sync && kvm_setmutex(db) != 0) return -1;
+    void *p;
+    if (posix_memalign(&p, 64, sizeof(KVMREP)) != 0) return -1;
+    KVMREP *r = memset(p, 0, sizeof(KVMREP));
+    atomic_init(&r->wseq, 1);
+    r->nnodes = kvm_numa_nodes();
+    db->rep = r;
+    return 0;
+#else
+    (void)db;
+    return -1;
+#endif
+}
+
+/* 今の Bloom と索引表を全ノードの写しに写す（写しは各ノードに mbind した mmap）。
+ * 写す間は読み手を待たせる。拡張の移行中なら先に済ませる。写しが全部新しければ
+ * 何もしないので、定期的に呼んでもよい */
+int kvm_replicate(KVM *db) {
+    KVMREP *r = db->rep;
+    if (!r) return -1;
+    kvm_wlock(db);
+    if (!db->mem || (kvm_rehashing(db) && !(db->omode & KVMOWRITER))) {
+        kvm_wunlock(db);
+        return -1;
+    }
+    if (kvm_rehashing(db)) {
+        kvm_dirty(db);
+        while (kvm_rehashing(db)) kvm_rehash_step(db);
+    }
+    unsigned long seq = atomic_load(&r->wseq);
+    int stale = 0;
+    for (int n = 0; n < r->nnodes; n++) stale |= atomic_load(&r->node[n].seq) != seq;
+    if (!stale) {
+        kvm_wunlock(db);
+        return 0;
+    }
+    size_t bb = db->bloom_blocks * BLOOM_K * sizeof(uint64_t), tb = table_bytes(db, db->nbuckets);
+    int ret = 0;
+    kvm_excl(db);
+    for (int n = 0; n < r->nnodes; n++) {
+        KVMREPN *p = &r->node[n];
+        atomic_store(&p->seq, 0);
+        if (p->size < bb + tb) {
+            if (p->buf) munmap(p->buf, p->size);
+            p->size = bb + tb;
+            p->buf = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p->buf == MAP_FAILED) {
+                p->buf = NULL;
+                p->size = 0;
+                ret = -1;
+                continue;
+            }
+            kvm_mbind(p->buf, p->size, n);
+        }
+        memcpy(p->buf, db->bloom, bb);
+        memcpy(p->buf + bb, KVM_ISLINE(db) ? (void*)db->lines : (void*)db->buckets, tb);
+        p->bloom = (uint64_t*)p->buf;
+        p->table = p->buf + bb;
+        p->nbuckets = db->nbuckets;
+        atomic_store_explicit(&p->seq, seq, memory_order_release);
+    }
+    kvm_unexcl(db);
+    kvm_wunlock(db);
+    return ret;
+}
+
+static void kvm_rep_free(KVMREP *r) {
+    if (!r) return;
+    for (int n = 0; n < r->nnodes; n++)
+        if (r->node[n].buf) munmap(r->node[n].buf, r->node[n].size);
+    free(r);
+}
+
+/* 書き手は排他、読み手は共有の flock を掛ける（取れなければ -1）。TRUNC はロックを
+ * 取ってから切り詰めるので、他の書き手が開いているファイルは壊さない */
+static int kvm_open_file(KVM *db, const char *path, int omode) {
+    int writer = (omode & KVMOWRITER) != 0;
+    int flags = writer ? O_RDWR : O_RDONLY;
+    if (writer && (omode & KVMOCREAT)) flags |= O_CREAT;
+    db->fd = open(path, flags, 0644);
+    if (db->fd < 0) return -1;
+    if (flock(db->fd, (writer ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0) return -1;
+    if (writer && (omode & KVMOTRUNC) && ftruncate(db->fd, 0) != 0) return -1;
+    struct stat st;
+    if (fstat(db->fd, &st) != 0) return -1;
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        size_t size = (db->opts & KVMTCACHE) ? db->limit : POOL_SIZE;
+        if (!(omode & KVMOWRITER) || ftruncate(db->fd, size) != 0) return -1;
+        db->mem_size = size;
+    } else {
+        db->mem_size = st.st_size;
+    }
+    if (db->mem_size > POOL_MAX) return -1;
+    /* ファイル末尾より先もまとめて予約しておき、伸ばす時は ftruncate だけで済ませる */
+    int prot = (omode & KVMOWRITER) ? PROT_READ | PROT_WRITE : PROT_READ;
+    db->map_size = POOL_MAX;
+    db->mem = mmap(NULL, db->map_size, prot, MAP_SHARED, db->fd, 0);
+    if (db->mem == MAP_FAILED) { db->mem = NULL; return -1; }
+    if (db->node >= 0) kvm_mbind(db->mem, db->map_size, db->node);
+    db->bloom = (uint64_t*)(db->mem + BLOOM_OFF);
+    int hr = fresh ? kvm_format(db) : kvm_read_header(db);
+    if (hr < 0) return -1;
+    if (hr > 0) {
+        /* 読み手は書き換えをファイルに残さない写しの上で作り直す */
+        if (!writer) {
+            munmap(db->mem, db->map_size);
+            db->mem = mmap(NULL, db->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE,
+                           db->fd, 0);
+            if (db->mem == MAP_FAILED) { db->mem = NULL; return -1; }
+            db->bloom = (uint64_t*)(db->mem + BLOOM_OFF);
+            if (kvm_read_header(db) < 0) return -1;
+        }
+        if (kvm_recover(db, path) != 0) return -1;
+    }
+    if (writer) kvm_write_header(db, KVM_FOPEN);
+    return 0;
+}
+
+static int kvm_sweep_start(KVM *db);
+
+/* KVMTCACHE は値ファイルを持てず、順序付き索引とも組めない（木の区切りが追い出した
+ * Entry を指したままになる） */
+static int kvm_modes_ok(KVM *db) {
+    if (KVM_INDEX != 0 && KVM_ISLINE(db) != ((db->opts & KVMTLINE) != 0)) return 0;
+    return !(db->opts & KVMTCACHE) || (!(db->opts & KVMTTIER) && !db->ord && !db->rep);
+}
+
+static int kvm_open_raw(KVM *db, const char *path, int omode) {
+    if (db->mem || !kvm_modes_ok(db)) return -1;
+    db->fd = -1;
+    if (!db->limit) db->limit = POOL_SIZE;
+    if (path) {
+        db->omode = omode;
+        if (kvm_open_file(db, path, omode) == 0) {
+            db->path = strdup(path);
+            if (!kvm_modes_ok(db) || ((db->opts & KVMTTIER) && kvm_tier_open(db) != 0)) {
+                kvm_close(db);
+                return -1;
+            }
+            if ((db->ord && kvm_ord_rebuild(db) != 0) || kvm_sweep_start(db) != 0) {
+                kvm_close(db);
+                return -1;
+            }
+            return 0;
+        }
+        if (db->mem) munmap(db->mem, db->map_size);
+        if (db->fd >= 0) close(db->fd);
+        db->mem = NULL;
+        db->fd = -1;
+        return -1;
+    }
+    if (db->opts & KVMTTIER) return -1;  /* 値ファイルを置く場所が無い */
+    db->omode = KVMOWRITER;
+    /* 物理ページは触った所だけ割り当てられる。ランダム読みの TLB ミスを減らすため
+     * 透過的ヒュージページも頼んでおく */
+    db->map_size = POOL_MAX;
+    db->mem_size = (db->opts & KVMTCACHE) ? db->limit : POOL_MAX;
+    db->mem = mmap(NULL, db->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (db->mem == MAP_FAILED) { db->mem = NULL; return -1; }
+#ifdef MADV_HUGEPAGE
+    madvise(db->mem, db->map_size, MADV_HUGEPAGE);
+#endif
+    if (db->node >= 0) kvm_mbind(db->mem, db->map_size, db->node);
+    db->bloom = (uint64_t*)(db->mem + BLOOM_OFF);
+    if (kvm_format(db) != 0) {
+        munmap(db->mem, db->map_size);
+        db->mem = NULL;
+        return -1;
+    }
+    if (kvm_sweep_start(db) != 0) {
+        kvm_close(db);
+        return -1;
+    }
+    return 0;
+}
+
+/* path が NULL ならメモリ上だけの DB。omode は KVMO*（path 指定時のみ意味を持つ）。
+ * kvm_setnode していれば、開く間に触るページ（新しい DB の Bloom と索引表、読み直す
+ * ヘッダ）もそのノードから取る */
+int kvm_open(KVM *db, const char *path, int omode) {
+    if (db->node < 0) return kvm_open_raw(db, path, omode);
+    KVMPOL old;
+    kvm_policy_set(db->node, &old);
+    int ret = kvm_open_raw(db, path, omode);
+    kvm_policy_restore(&old);
+    return ret;
+}
+
+/* ヘッダを書いてファイルへ同期する（tchdbsync 相当）。この後に落ちても、次の kvm_open が
+ * データ領域を辿り直して少なくともここまでを戻す */
+int kvm_sync(KVM *db) {
+    if (!db->mem || db->fd < 0 || !(db->omode & KVMOWRITER)) return -1;
+    kvm_wlock(db);
+    /* 値ファイルを先に落とす（ヘッダの vlog_pos までは必ず読めるように） */
+    int ret = db->vfd >= 0 ? fdatasync(db->vfd) : 0;
+    kvm_write_header(db, KVM_FOPEN);
+    if (msync(db->mem, kvm_data_end(db), MS_SYNC) != 0) ret = -1;
+    kvm_wunlock(db);
+    return ret;
+}
+
+/* ========== スナップショットの版の保持（kvm_snapshot） ========== */
+/* スナップショットは作った時の write_pos（pos）と通し番号（epoch）だけを持つ。
+ * Entry は追記するだけなので、pos より前にある Entry がその時点までに書かれたもの。
+ * ただし置き換えや削除は索引から外すだけで痕跡を残さないので、生きている
+ * スナップショットから見えている Entry を外す時は、外す前に rec に記録しておく
+ * （外した時の epoch を death に持つ）。スナップショット sn から見えるのは
+ * pos < sn->pos かつ death >= sn->epoch の記録か、pos < sn->pos の今の Entry。
+ * 見えている Entry はその場で上書きせず、スナップショットがある間は
+ * コンパクションも kvm_bulk_load の作り直しもしない */
+#define SNAP_REC_MIN 1024       /* rec の初期バケット数（2の冪） */
+
+typedef struct SNAPREC SNAPREC;
+struct SNAPREC {
+    SNAPREC *next;
+    uint64_t h;             /* キーのハッシュ */
+    kvm_ref_t ref;
+    uint64_t death;         /* 外した時の KVMSNAPS.epoch */
+};
+
+struct KVMSNAP {
+    KVM *db;
+    size_t pos;             /* 作った時の write_pos */
+    uint64_t epoch;
+    uint64_t gen;           /* 作った時の KVM.gen（閉じたら読めない） */
+    uint32_t now;           /* 作った時刻（期限切れはこれで見る） */
+    KVMSNAP *prev, *next;
+};
+
+/* live と hi と epoch は書き手の mutex の下で触る。rec は読み手も辿るので mtx で守る */
+struct KVMSNAPS {
+    pthread_mutex_t mtx;
+    KVMSNAP *live;          /* 生きているスナップショット（新しい順） */
+    size_t hi;              /* その pos の最大。これより前の Entry は上書きできない */
+    uint64_t epoch;         /* これまでに作ったスナップショットの数 */
+    SNAPREC **rec;
+    size_t nrec, mask;
+};
+
+static inline int kvm_snap_live(KVM *db) {
+    return db->snaps && db->snaps->live;
+}
+
+/* ref の Entry を生きているスナップショットが見ているか */
+static inline int kvm_snap_pinned(KVM *db, kvm_ref_t ref) {
+    return kvm_snap_live(db) && REF_POS(ref) < db->snaps->hi;
+}
+
+static void snap_rec_clear(KVMSNAPS *s) {
+    for (size_t i = 0; s->rec && i <= s->mask; i++) {
+        for (SNAPREC *r = s->rec[i], *n; r; r = n) { n = r->next; free(r); }
+    }
+    free(s->rec);
+    s->rec = NULL;
+    s->nrec = s->mask = 0;
+}
+
+/* rec を倍に広げる。広げられなければそのまま（チェーンが伸びるだけ） */
+static void snap_rec_grow(KVMSNAPS *s) {
+    size_t n = s->rec ? (s->mask + 1) * 2 : SNAP_REC_MIN;
+    SNAPREC **t = calloc(n, sizeof(SNAPREC*));
+    if (!t) return;
+    for (size_t i = 0; s->rec && i <= s->mask; i++) {
+        for (SNAPREC *r = s->rec[i], *nx; r; r = nx) {
+            nx = r->next;
+            r->next = t[r->h & (n - 1)];
+            t[r->h & (n - 1)] = r;
+        }
+    }
+    free(s->rec);
+    s->rec = t;
+    s->mask = n - 1;
+}
+
+/* 索引から外す（置き換える・消す）前に呼ぶ。ref の Entry がスナップショットから
+ * 見えていれば rec に残す。残せなければ -1（呼び出し側は何も変えずに失敗させる） */
+static int kvm_snap_keep(KVM *db, uint64_t h, kvm_ref_t ref) {
+    if (!kvm_snap_pinned(db, ref)) return 0;
+    KVMSNAPS *s = db->snaps;
+    SNAPREC *r = malloc(sizeof(SNAPREC));
+    if (!r) return -1;
+    r->h = h;
+    r->ref = ref;
+    r->death = s->epoch;
+    pthread_mutex_lock(&s->mtx);
+    if (!s->rec || s->nrec > s->mask) snap_rec_grow(s);
+    if (!s->rec) { pthread_mutex_unlock(&s->mtx); free(r); return -1; }
+    r->next = s->rec[h & s->mask];
+    s->rec[h & s->mask] = r;
+    s->nrec++;
+    pthread_mutex_unlock(&s->mtx);
+    return 0;
+}
+
+/* 閉じる時は記録を捨て、残っているスナップショットを切り離す（以後は読めない） */
+static void kvm_snaps_reset(KVM *db) {
+    KVMSNAPS *s = db->snaps;
+    if (!s) return;
+    for (KVMSNAP *sn = s->live; sn; sn = sn->next) sn->db = NULL;
+    s->live = NULL;
+    s->hi = 0;
+    pthread_mutex_lock(&s->mtx);
+    snap_rec_clear(s);
+    pthread_mutex_unlock(&s->mtx);
+}
+
+/* ========== 追い出し（KVMTCACHE） ========== */
+/* 領域を上限で止めて輪として使い回す。末尾まで書いたら ring_off に戻り、一番古い
+ * ring_head から EVICT_CHUNK ずつ追い出して書く場所を空ける（ログ順の FIFO）。
+ * 前回から読まれた Entry（EF_REF）は追い出さずに書く側へ写し直して一度だけ残す（CLOCK）。
+ * 写し直しは空ける量の半分まで。追い出しと先頭に戻る時は読み手を締め出し、gen を増やす */
+#define EVICT_CHUNK ((size_t)256 << 10)
+
+/* 領域を古い順に辿る時の始まりと次の Entry（KVMTCACHE は ring_wend から ring_off に飛ぶ） */
+static inline size_t kvm_walk_start(KVM *db) {
+    return (db->opts & KVMTCACHE) ? db->ring_head : db->data_off;
+}
+
+static inline size_t kvm_walk_next(KVM *db, size_t pos) {
+    pos += ((const Entry*)(db->mem + pos))->size;
+    return pos == db->ring_wend ? db->ring_off : pos;
+}
+
+/* link が指す Entry を索引から外して EF_DEAD を立てる（削除・期限切れ・追い出しで共通）。
+ * 空きのあるラインからは探索が先へ進まないので、そこは削除済みでなく空きに戻す */
+static int kvm_unlink(KVM *db, uint64_t h, kvm_ref_t *link) {
+    if (kvm_snap_keep(db, h, *link) != 0) return -1;
+    kvm_dirty(db);
+    Entry *e = ENTRY(db, *link);
+    __atomic_fetch_or(&e->flags, EF_DEAD, __ATOMIC_RELEASE);
+    if (KVM_ISLINE(db)) {
+        Line *l = (Line*)((uintptr_t)link & ~(uintptr_t)63);
+        int empty = line_has_empty(l);
+        __atomic_store_n(&l->tag[link - l->off], empty ? 0 : 1, __ATOMIC_RELEASE);
+        if (!empty) db->tombs++;
+    } else {
+        __atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+    }
+    db->live_bytes -= e->size;
+    db->dead_bytes += e->size;
+    db->count--;
+    if (db->ord) ord_remove(db, e->data, e->klen);
+    return 0;
+}
+
+/* 伸ばさないライン表は削除済みのスロットで埋まっていくので、生きているキーだけで入れ直す */
+static void kvm_line_rebuild(KVM *db) {
+    kvm_ref_t *refs = malloc((db->count + 1) * sizeof(kvm_ref_t));
+    if (!refs) return;
+    size_t n = 0;
+    for (size_t b = 0; b < db->nbuckets; b++)
+        for (int s = 0; s < LINE_SLOTS; s++)
+            if (db->lines[b].tag[s] >= 2 && n < db->count) refs[n++] = db->lines[b].off[s];
+    kvm_excl(db);
+    memset(db->lines, 0, db->nbuckets * sizeof(Line));
+    for (size_t i = 0; i < n; i++) {
+        const Entry *e = ENTRY(db, refs[i]);
+        line_insert(db->lines, db->nbuckets, kvm_hash(e->data, e->klen), refs[i]);
+    }
+    db->tombs = 0;
+    kvm_unexcl(db);
+    free(refs);
+}
+
+/* ring_head から want バイト以上（EVICT_CHUNK 以上）を空ける。何も無ければ -1 */
+static int kvm_evict(KVM *db, size_t want) {
+    size_t lim = db->ring_wend ? db->ring_wend : db->write_pos, pos = db->ring_head;
+    if (pos >= lim) return -1;
+    size_t chunk = want > EVICT_CHUNK ? want : EVICT_CHUNK, stop = pos + chunk, keep = chunk / 2;
+    uint32_t now = kvm_clock();
+    kvm_excl(db);
+    while (pos < lim && pos < stop) {
+        Entry *e = (Entry*)(db->mem + pos);
+        size_t size = e->size;
+        uint32_t f = e->flags;
+        int moved = 0;
+        if (!(f & (EF_BLOB | EF_DEAD | EF_STALE))) {
+            uint64_t h = kvm_hash(e->data, e->klen);
+            kvm_ref_t *link = kvm_find(db, h, e->data, e->klen, NULL);
+            if (link && *link == REF(pos)) {
+                if ((f & EF_REF) && size <= keep && !entry_expired(e, f, now) &&
+                    (db->ring_wend || db->write_pos + size <= db->mem_size)) {
+                    /* 戻って書いている時は書く側が常にこの Entry より手前にあるので、
+                     * 前から順に写せばまだ見ていない Entry は潰さない */
+                    Entry *c = (Entry*)(db->mem + db->write_pos);
+                    memmove(c, e, size);
+                    c->flags = f & ~(uint32_t)EF_REF;
+                    *link = REF(db->write_pos);
+                    db->write_pos += size;
+                    keep -= size;
+                    moved = 1;
+                } else {
+                    kvm_unlink(db, h, link);
+                }
+            }
+        }
+        if (!moved) db->dead_bytes -= size;
+        pos += size;
+    }
+    db->ring_head = pos;
+    if (db->ring_wend && pos == db->ring_wend) {
+        db->ring_head = db->ring_off;
+        db->ring_wend = 0;
+    } else if (!db->ring_wend && pos == db->write_pos) {
+        db->ring_head = db->write_pos = db->ring_off;
+    }
+    db->gen++;
+    kvm_unexcl(db);
+    return 0;
+}
+
+/* write_pos から n バイト書けるようにする。書き終えても ring_head に届かないこと
+ * （同じ位置まで書くと空と見分けられない）。輪の 1/4 を超える Entry は置けない。
+ * KVMTLINE は索引表が伸びないので件数が負荷率に達しても追い出す */
+static int kvm_ring_room(KVM *db, size_t n) {
+    if (n > (db->mem_size - db->ring_off) / 4) return -1;
+    while (KVM_ISLINE(db) && db->count >= db->nbuckets * LINE_LOAD)
+        if (kvm_evict(db, 0) != 0) return -1;
+    if (KVM_ISLINE(db) && db->tombs > db->nbuckets * LINE_SLOTS / 4) kvm_line_rebuild(db);
+    for (;;) {
+        if (!db->ring_wend) {
+            if (db->write_pos + n <= db->mem_size) return 0;
+            kvm_excl(db);
+            if (db->ring_head == db->write_pos) db->ring_head = db->ring_off;
+            else db->ring_wend = db->write_pos;
+            db->write_pos = db->ring_off;
+            db->gen++;
+            kvm_unexcl(db);
+            continue;
+        }
+        if (db->write_pos + n < db->ring_head) return 0;
+        if (kvm_evict(db, n) != 0) return -1;
+    }
+}
+
+/* ========== コンパクション ========== */
+static double kvm_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* 生きている Entry を dst の末尾に詰めて写す（値を縮めた分のパディングも詰まる）。
+ * 値ファイルにある値は dst の値ファイルへ詰めて写す（消した値・古い値の分が空く） */
+static Entry *kvm_copy_entry(KVM *db, KVM *dst, const Entry *src, uint64_t h) {
+    uint32_t vb = entry_vbytes(src->flags, src->vlen), ttl = src->flags & EF_TTL;
+    size_t size = entry_size(src->klen, vb + (ttl ? sizeof(uint32_t) : 0));
+    if (kvm_ensure(dst, size) != 0) return NULL;
+    Entry *e = (Entry*)(dst->mem + dst->write_pos);
+    memcpy(e, src, sizeof(Entry) + src->klen + vb);
+    e->size = size; e->flags = src->flags & (EF_LZ | EF_DICT | EF_COLD | EF_TTL); e->next = 0;
+    if (ttl) {
+        uint32_t t = entry_expire(src);
+        memcpy((uint8_t*)e + size - sizeof(t), &t, sizeof(t));
+    }
+    if (src->flags & EF_COLD) {
+        uint64_t off;
+        memcpy(&off, src->data + src->klen, sizeof(off));
+        char *buf = malloc(src->vlen ? src->vlen : 1);
+        int err = !buf || kvm_vread(db->vfd, buf, src->vlen, off) != 0 ||
+                  kvm_vlog_append(dst, buf, src->vlen, &off) != 0;
+        free(buf);
+        if (err) return NULL;
+        memcpy(e->data + e->klen, &off, sizeof(off));
+    }
+    dst->write_pos += size;
+    dst->live_bytes += size;
+    dst->count++;
+    bloom_add(dst, h);
+    return e;
+}
+
+/* kvm_setorder した DB はキー順に写して、その並びのまま dst の木を組む。
+ * 範囲走査が領域を前から順に読むだけになる（チェーンは連続しなくなる） */
+static int kvm_compact_ordered(KVM *db, KVM *dst) {
+    ORDKEY *keys = malloc((db->count + 1) * sizeof(ORDKEY));
+    if (!keys) return 1;
+    size_t n = 0;
+    uint32_t now = kvm_clock();
+    for (ORDNODE *x = db->ord->first; x; x = x->next)
+        for (int i = 0; i < x->n; i++) {
+            Entry *e = ENTRY(db, x->ref[i]);
+            if (entry_expired(e, e->flags, now)) continue;
+            uint64_t h = kvm_hash(e->data, e->klen);
+            Entry *c = kvm_copy_entry(db, dst, e, h);
+            if (!c || n >= db->count) { free(keys); return 1; }
+            kvm_ref_t ref = REF((uint8_t*)c - dst->mem);
+            if (KVM_ISLINE(dst)) {
+                line_insert(dst->lines, dst->nbuckets, h, ref);
+            } else {
+                c->next = dst->buckets[h & (dst->nbuckets - 1)];
+                dst->buckets[h & (dst->nbuckets - 1)] = ref;
+            }
+            keys[n].pfx = x->pfx[i];
+            keys[n++].ref = ref;
+        }
+    int err = ord_build(dst, keys, n) != 0;
+    free(keys);
+    return err;
+}
+
+/* 索引をバケット（ライン）順に辿って生きている Entry だけを写す（期限切れも捨てる）。
+ * チェーンは同じ順に並べ直すので、1本のチェーンが連続した領域になる */
+static void *kvm_compact_main(void *arg) {
+    KVM *db = arg, *dst = db->compact_dst;
+    double t0 = kvm_now();
+    uint32_t now = kvm_clock();
+    int err = 0;
+    if (db->ord) {
+        err = kvm_compact_ordered(db, dst);
+        goto done;
+    }
+    for (size_t b = 0; b < db->nbuckets && !err; b++) {
+        if (KVM_ISLINE(db)) {
+            Line *l = &db->lines[b];
+            for (int s = 0; s < LINE_SLOTS; s++) {
+                if (l->tag[s] < 2) continue;
+                Entry *e = ENTRY(db, l->off[s]);
+                if (entry_expired(e, e->flags, now)) continue;
+                uint64_t h = kvm_hash(e->data, e->klen);
+                Entry *c = kvm_copy_entry(db, dst, e, h);
+                if (!c) { err = 1; break; }
+                line_insert(dst->lines, dst->nbuckets, h, REF((uint8_t*)c - dst->mem));
+            }
+        } else {
+            kvm_ref_t *tail = &dst->buckets[b];
+            for (kvm_ref_t off = db->buckets[b]; off; off = ENTRY(db, off)->next) {
+                Entry *e = ENTRY(db, off);
+                if (entry_expired(e, e->flags, now)) continue;
+                Entry *c = kvm_copy_entry(db, dst, e, kvm_hash(e->data, e->klen));
+                if (!c) { err = 1; break; }
+                *tail = REF((uint8_t*)c - dst->mem);
+                tail = &c->next;
+            }
+        }
+    }
+done:
+    if (!err && dst->fd >= 0 && kvm_sync(dst) != 0) err = 1;
+    db->compact_err = err;
+    db->compact_sec = kvm_now() - t0;
+    atomic_store(&db->compact_state, 2);
+    return NULL;
+}
+
+/* 書き出し先を捨てる。ファイルは消し、持ち物の解放は kvm_del に任せる */
+static void kvm_compact_discard(KVM *dst) {
+    if (dst->ord) ord_clear(dst->ord);
+    if (dst->vfd >= 0) {
+        char *vp = kvm_vlog_path(dst->path, dst->vlog_seq);
+        if (vp) unlink(vp);
+        free(vp);
+    }
+    kvm_tier_close(dst);
+    munmap(dst->mem, dst->map_size);
+    if (dst->fd >= 0) { close(dst->fd); unlink(dst->path); }
+    free(dst->path);
+    dst->path = NULL;
+    dst->mem = NULL;
+    dst->fd = -1;
+    kvm_del(dst);
+}
+
+static int kvm_compact_begin(KVM *db) {
+    if (!db->mem || !(db->omode & KVMOWRITER) || atomic_load(&db->compact_state)) return -1;
+    /* スナップショットが残した版を動かすと位置で見分けられなくなる。
+     * KVMTCACHE は追い出しで空くので詰め直さない */
+    if (kvm_snap_live(db) || (db->opts & KVMTCACHE)) return -1;
+    while (kvm_rehashing(db)) kvm_rehash_step(db);
+    KVM *dst = kvm_new();
+    kvm_setstats(dst, 0);   /* 数えは入れ替えの時に元の DB のものを引き継ぐ */
+    dst->node = db->node;
+    dst->opts = db->opts;
+    dst->nbuckets = db->nbuckets;
+    dst->bloom_expected = db->bloom_expected;
+    dst->bloom_fpr = db->bloom_fpr;
+    dst->cache_bytes = db->cache_bytes;
+    dst->vlog_seq = db->vlog_seq + 1;
+    if (db->ord) kvm_setorder(dst);
+    char *tmp = NULL;
+    if (db->path) {
+        tmp = malloc(strlen(db->path) + 16);
+        sprintf(tmp, "%s.compact", db->path);
+    }
+    if (kvm_open(dst, tmp, KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) {
+        if (tmp) unlink(tmp);
+        free(tmp);
+        kvm_del(dst);
+        return -1;
+    }
+    free(tmp);
+    if (db->dict_len && kvm_store_dict(dst, db->dict, db->dict_len) != 0) {
+        kvm_compact_discard(dst);
+        return -1;
+    }
+    db->compact_dst = dst;
+    atomic_store(&db->compact_state, 1);
+    if (pthread_create(&db->compact_thread, NULL, kvm_compact_main, db) != 0) {
+        kvm_compact_discard(dst);
+        db->compact_dst = NULL;
+        atomic_store(&db->compact_state, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* 別スレッドでコンパクションを始める。終わるまで kvm_get は旧領域を読み、
+ * kvm_put / kvm_delete は kvm_compact_wait してから書く */
+int kvm_compact_start(KVM *db) {
+    kvm_wlock(db);
+    int ret = kvm_compact_begin(db);
+    kvm_wunlock(db);
+    return ret;
+}
+
+/* コピーが終わっていれば 1（待たずに確認できる） */
+int kvm_compact_done(KVM *db) {
+    return atomic_load(&db->compact_state) == 2;
+}
+
+static int kvm_compact_finish(KVM *db, KVMCOMPACT *st) {
+    if (!atomic_load(&db->compact_state)) return -1;
+    pthread_join(db->compact_thread, NULL);
+    KVM *dst = db->compact_dst;
+    db->compact_dst = NULL;
+    atomic_store(&db->compact_state, 0);
+    /* 値ファイルは新しい世代の名前にしてから領域のファイルを差し替える。どこで落ちても
+     * 残ったヘッダが指す世代の値ファイルがそのまま残っている */
+    char *vsrc = NULL, *vdst = NULL, *vold = NULL;
+    if (dst->vfd >= 0) {
+        vsrc = kvm_vlog_path(dst->path, dst->vlog_seq);
+        vdst = kvm_vlog_path(db->path, dst->vlog_seq);
+        vold = kvm_vlog_path(db->path, db->vlog_seq);
+    }
+    /* 差し替える前に新しい領域を落としておく（どちらのファイルが残っても開ける） */
+    if (!db->compact_err && dst->fd >= 0) {
+        if (dst->vfd >= 0 && fdatasync(dst->vfd) != 0) db->compact_err = 1;
+        kvm_write_header(dst, KVM_FOPEN);
+        if (msync(dst->mem, kvm_data_end(dst), MS_SYNC) != 0) db->compact_err = 1;
+    }
+    if (db->compact_err || (dst->vfd >= 0 && (!vsrc || !vdst || !vold || rename(vsrc, vdst) != 0)) ||
+        (db->path && rename(dst->path, db->path) != 0)) {
+        kvm_compact_discard(dst);
+        free(vsrc); free(vdst); free(vold);
+        return -1;
+    }
+    if (vold) unlink(vold);
+    free(vsrc); free(vdst); free(vold);
+    if (st) {
+        st->before = db->write_pos;
+        st->after = dst->write_pos;
+        /* 書き出し先の表や辞書の置き方で増えることもあるので 0 で止める */
+        st->reclaimed = db->write_pos > dst->write_pos ? db->write_pos - dst->write_pos : 0;
+        st->seconds = db->compact_sec;
+    }
+    kvm_excl(db);
+    kvm_tier_close(db);
+    munmap(db->mem, db->map_size);
+    if (db->fd >= 0) close(db->fd);
+    free(dst->path);
+    dst->path = db->path;
+    dst->omode = db->omode;
+    dst->sync = db->sync;
+    dst->snaps = db->snaps;
+    dst->sweep = db->sweep;
+    dst->stats = db->stats;
+    dst->node = db->node;
+    dst->rep = db->rep;
+    kvm_dirty(db);
+    if (db->ord) { ord_clear(db->ord); free(db->ord); }
+    dst->gen = db->gen + 1;
+    *db = *dst;
+    free(dst);
+    kvm_unexcl(db);
+    return 0;
+}
+
+/* コピーの終了を待って新しい領域に入れ替える。ファイルは rename で差し替えるので
+ * 途中で落ちても元のファイルが残る。st が NULL でなければ結果を書く */
+int kvm_compact_wait(KVM *db, KVMCOMPACT *st) {
+    kvm_wlock(db);
+    int ret = kvm_compact_finish(db, st);
+    kvm_wunlock(db);
+    return ret;
+}
+
+/* 同期版（tchdboptimize 相当） */
+int kvm_optimize(KVM *db, KVMCOMPACT *st) {
+    kvm_wlock(db);
+    int ret = kvm_compact_begin(db);
+    if (ret == 0) ret = kvm_compact_finish(db, st);
+    kvm_wunlock(db);
+    return ret;
+}
+
+static void kvm_sweep_stop(KVM *db);
+
+void kvm_close(KVM *db) {
+    if (db) kvm_sweep_stop(db);
+    if (db && atomic_load(&db->compact_state)) kvm_compact_finish(db, NULL);
+    if (db && db->mem) {
+        kvm_excl(db);
+        if (db->fd >= 0 && (db->omode & KVMOWRITER)) {
+            if (db->vfd >= 0) fdatasync(db->vfd);
+            kvm_write_header(db, 0);
+            msync(db->mem, kvm_data_end(db), MS_SYNC);
+        }
+        kvm_tier_close(db);
+        munmap(db->mem, db->map_size);
+        if (db->fd >= 0) close(db->fd);
+        db->mem = NULL;
+        db->fd = -1;
+        db->buckets = db->old_buckets = NULL;
+        db->lines = db->old_lines = NULL;
+        db->old_nbuckets = 0;
+        db->count = 0;
+        db->dict = NULL;
+        db->dict_len = 0;
+        if (db->ord) ord_clear(db->ord);
+        kvm_snaps_reset(db);
+        kvm_dirty(db);
+        db->gen++;
+        free(db->path);
+        db->path = NULL;
+        kvm_unexcl(db);
+    }
+}
+
+void kvm_del(KVM *db) {
+    if (!db) return;
+    kvm_close(db);
+    if (db->sync) {
+        pthread_mutex_destroy(&db->sync->wmtx);
+        free(db->sync);
+    }
+    free(db->ord);
+    if (db->snaps) {
+        pthread_mutex_destroy(&db->snaps->mtx);
+        free(db->snaps);
+    }
+    if (db->sweep) {
+        pthread_mutex_destroy(&db->sweep->mtx);
+        pthread_cond_destroy(&db->sweep->cond);
+        free(db->sweep);
+    }
+    kvm_stats_free(db->stats);
+    kvm_rep_free(db->rep);
+    free(db);
+}
+
+/* 既存のキーは値が元の Entry に収まればその場で上書きし、収まらなければ
+ * 新しい Entry を書いて索引の参照をすげ替える（古い方は EF_STALE）。
+ * cflags に EF_COLD があれば value は値ファイルの位置、vlen はそこに置いた長さ。
+ * expire が 0 でなければ期限として Entry の末尾に置く */
+static int kvm_put_raw(KVM *db, const char *key, uint32_t klen, const char *value, uint32_t vlen,
+                       uint32_t cflags, uint32_t expire) {
+    if (kvm_rehashing(db)) kvm_rehash_step(db);
+    uint64_t h = kvm_hash(key, klen);
+    kvm_ref_t *link = kvm_find(db, h, key, klen, NULL);
+    uint32_t vb = entry_vbytes(cflags, vlen), tb = expire ? sizeof(expire) : 0;
+    if (expire) cflags |= EF_TTL;
+    if (link && !kvm_snap_pinned(db, *link)) {
+        Entry *old = ENTRY(db, *link);
+        if (old->size - sizeof(Entry) - klen >= vb + tb) {
+            if (db->sync) atomic_fetch_add(&db->sync->seq, 1);
+            memcpy(old->data + klen, value, vb);
+            if (expire) memcpy((uint8_t*)old + old->size - tb, &expire, tb);
+            old->vlen = vlen;
+            __atomic_store_n(&old->flags,
+                             (old->flags & ~(uint32_t)(EF_LZ | EF_DICT | EF_COLD | EF_TTL)) | cflags,
+                             __ATOMIC_RELAXED);
+            if (db->sync) atomic_fetch_add(&db->sync->seq, 1);
+            return 0;
+        }
+    }
+    size_t size = entry_size(klen, vb + tb);
+    if (db->opts & KVMTCACHE) {
+        if (kvm_ring_room(db, size) != 0) return -1;
+        /* 追い出しで元の Entry が動いたか消えたかもしれない */
+        if (link) link = kvm_find(db, h, key, klen, NULL);
+    } else if (kvm_ensure(db, size) != 0) {
+        return -1;
+    }
+    kvm_ref_t ref = REF(db->write_pos);
+    Entry *e = (Entry*)(db->mem + db->write_pos);
+    e->klen = klen; e->vlen = vlen; e->size = size; e->flags = cflags;
+    memcpy(e->data, key, klen);
+    memcpy(e->data + klen, value, vb);
+    if (expire) memcpy((uint8_t*)e + size - tb, &expire, tb);
+    if (link && kvm_snap_keep(db, h, *link) != 0) return -1;
+    /* Entry と Bloom を書き終えてから参照を差し込む（読み手はロックを取らない） */
+    bloom_add(db, h);
+    if (link) {
+        Entry *old = ENTRY(db, *link);
+        __atomic_fetch_or(&old->flags, EF_STALE, __ATOMIC_RELEASE);
+        db->live_bytes -= old->size;
+        db->dead_bytes += old->size;
+        e->next = old->next;
+        __atomic_store_n(link, ref, __ATOMIC_RELEASE);
+    } else if (KVM_ISLINE(db)) {
+        e->next = 0;
+        line_insert(db->lines, db->nbuckets, h, ref);
+        db->count++;
+    } else {
+        kvm_ref_t *slot = kvm_slot(db, h);
+        e->next = *slot;
+        __atomic_store_n(slot, ref, __ATOMIC_RELEASE);
+        db->count++;
+    }
+    db->write_pos += size;
+    db->live_bytes += size;
+    int ret = db->ord ? ord_insert(db, ref) : 0;
+    kvm_maybe_grow(db);
+    return ret;
+}
+
+/* KVMTLZ なら先に圧縮し、KVMTTIER なら値ファイルに足してから置く */
+static int kvm_put_locked(KVM *db, const char *key, uint32_t klen, const char *value, uint32_t vlen,
+                          uint32_t expire) {
+    /* 値ファイルも入れ替わるので、足す前に済ませておく */
+    if (atomic_load(&db->compact_state)) kvm_compact_finish(db, NULL);
+    kvm_count(kvm_ctr(db), KVMCPUT);
+    kvm_dirty(db);
+    uint32_t cflags;
+    char *tmp;
+    uint64_t off;
+    value = kvm_encode(db, value, &vlen, &cflags, &tmp);
+    int ret = 0;
+    if ((db->opts & KVMTTIER) && vlen > sizeof(uint64_t)) {
+        ret = kvm_vlog_append(db, value, vlen, &off);
+        value = (const char*)&off;
+        cflags |= EF_COLD;
+    }
+    if (ret == 0) ret = kvm_put_raw(db, key, klen, value, vlen, cflags, expire);
+    free(tmp);
+    return ret;
+}
+
+int kvm_put2(KVM *db, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen) {
+    if (!(db->omode & KVMOWRITER)) return -1;
+    kvm_wlock(db);
+    int ret = kvm_put_locked(db, kbuf, klen, vbuf, vlen, 0);
+    kvm_wunlock(db);
+    return ret;
+}
+
+int kvm_put(KVM *db, const char *key, const char *value) {
+    return kvm_put2(db, key, strlen(key), value, strlen(value));
+}
+
+/* ttl 秒後に期限が切れる put（0 以下なら期限なし）。切れたキーは get / 走査から
+ * 無いものとして扱い、領域は kvm_sweep・上書き・追い出し・コンパクションで空く */
+int kvm_put_ttl2(KVM *db, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen, int ttl) {
+    if (!(db->omode & KVMOWRITER)) return -1;
+    uint32_t expire = ttl > 0 ? kvm_clock() + (uint32_t)ttl : 0;
+    kvm_wlock(db);
+    int ret = kvm_put_locked(db, kbuf, klen, vbuf, vlen, expire);
+    kvm_wunlock(db);
+    return ret;
+}
+
+int kvm_put_ttl(KVM *db, const char *key, const char *value, int ttl) {
+    return kvm_put_ttl2(db, key, strlen(key), value, strlen(value), ttl);
+}
+
+/* 空の DB に n 件をまとめて入れる。索引表と Bloom filter を n 件分で作り直し、
+ * レコードを索引の上位ビットで 2^BULK_PART_BITS 個に振り分けてから区画順に詰めて書く。
+ * 1区画が触る索引とチェーンは狭い範囲に収まるのでキャッシュから外れにくい。
+ * 同じキーが複数あれば後のものが残る。空でないかスナップショットがあるか KVMTCACHE なら
+ * kvm_put2 を繰り返すだけ */
+static int kvm_bulk_locked(KVM *db, const KVMREC *recs, int64_t n) {
+    if (atomic_load(&db->compact_state)) kvm_compact_finish(db, NULL);
+    if (db->count || db->dead_bytes || kvm_rehashing(db) || kvm_snap_live(db) || (db->opts & KVMTCACHE)) {
+        for (int64_t i = 0; i < n; i++)
+            if (kvm_put_locked(db, recs[i].kbuf, recs[i].klen, recs[i].vbuf, recs[i].vlen, 0) != 0) return -1;
+        return 0;
+    }
+    /* 空の表と Bloom を捨てて n 件分で作り直す（この先はまだゼロのまま）。辞書は置き直す */
+    uint8_t *dict = db->dict_len ? malloc(db->dict_len) : NULL;
+    uint32_t dict_len = dict ? db->dict_len : 0;
+    if (dict) memcpy(dict, db->dict, dict_len);
+    size_t want = KVM_ISLINE(db) ? n / LINE_LOAD + 1 : n / LOAD_FACTOR + 1, nb = db->nbuckets;
+    while (nb < want) nb <<= 1;
+    memset(db->mem + BLOOM_OFF, 0, db->write_pos - BLOOM_OFF);
+    db->buckets = NULL;
+    db->lines = NULL;
+    db->nbuckets = nb;
+    if (db->bloom_expected < n) db->bloom_expected = n;
+    db->gen++;
+    int fret = kvm_format(db);
+    if (fret == 0 && dict) fret = kvm_store_dict(db, dict, dict_len);
+    free(dict);
+    if (fret != 0) return -1;
+    if (db->fd >= 0) kvm_write_header(db, KVM_FOPEN);
+    if (db->vfd >= 0) {
+        /* 値ファイルも空から書き直す（位置が使い回されるのでキャッシュも捨てる） */
+        kvm_cache_clear(db->cache);
+        if (ftruncate(db->vfd, 0) != 0) return -1;
+    }
+    
+    size_t total = 0;
+    uint64_t *h = malloc(n * sizeof(uint64_t));
+    int64_t *order = malloc(n * sizeof(int64_t));
+    int shift = 0, bits = 0;
+    while (((size_t)1 << bits) < nb) bits++;
+    if (bits > BULK_PART_BITS) shift = bits - BULK_PART_BITS;
+    size_t nparts = nb >> shift;
+    int64_t *start = calloc(nparts + 1, sizeof(int64_t));
+    if (!h || !order || !start) { free(h); free(order); free(start); return -1; }
+    for (int64_t i = 0; i < n; i++) {
+        h[i] = kvm_hash(recs[i].kbuf, recs[i].klen);
+        start[((h[i] & (nb - 1)) >> shift) + 1]++;
+        total += entry_size(recs[i].klen, recs[i].vlen);
+    }
+    for (size_t p = 0; p < nparts; p++) start[p + 1] += start[p];
+    for (int64_t i = 0; i < n; i++) order[start[(h[i] & (nb - 1)) >> shift]++] = i;
+    free(start);
+    
+    /* 区画順に並べ替えると入力側が飛び飛びになるので、レコードとキー・値を先読みしておく */
+    int ret = kvm_ensure(db, total);
+    /* KVMTTIER の値は BULK_VBUF ずつまとめて値ファイルに書く */
+    size_t vcap = (db->opts & KVMTTIER) ? BULK_VBUF : 0, vfill = 0;
+    char *vbuf = vcap ? malloc(vcap) : NULL;
+    uint64_t voff;
+    if (!vbuf) vcap = 0;
+    for (int64_t j = 0; j < n && ret == 0; j++) {
+        if (j + 2 * BULK_PREFETCH < n) {
+            __builtin_prefetch(&recs[order[j + 2 * BULK_PREFETCH]]);
+            __builtin_prefetch(&h[order[j + 2 * BULK_PREFETCH]]);
+        }
+        if (j + BULK_PREFETCH < n) {
+            const KVMREC *q = &recs[order[j + BULK_PREFETCH]];
+            __builtin_prefetch(q->kbuf);
+            __builtin_prefetch(q->vbuf);
+        }
+        const KVMREC *r = &recs[order[j]];
+        uint64_t hj = h[order[j]];
+        if (kvm_find(db, hj, r->kbuf, r->klen, NULL)) {
+            if (vfill && kvm_vlog_append(db, vbuf, vfill, &voff) != 0) { ret = -1; break; }
+            vfill = 0;
+            ret = kvm_put_locked(db, r->kbuf, r->klen, r->vbuf, r->vlen, 0);
+            continue;
+        }
+        uint32_t vlen = r->vlen, cflags;
+        char *tmp;
+        const char *val = kvm_encode(db, r->vbuf, &vlen, &cflags, &tmp);
+        if ((db->opts & KVMTTIER) && vlen > sizeof(uint64_t)) {
+            if (vfill + vlen > vcap && vfill) {
+                if (kvm_vlog_append(db, vbuf, vfill, &voff) != 0) { free(tmp); ret = -1; break; }
+                vfill = 0;
+            }
+            if (vlen > vcap) {
+                if (kvm_vlog_append(db, val, vlen, &voff) != 0) { free(tmp); ret = -1; break; }
+            } else {
+                voff = db->vlog_pos + vfill;
+                memcpy(vbuf + vfill, val, vlen);
+                vfill += vlen;
+            }
+            free(tmp);
+            tmp = NULL;
+            val = (const char*)&voff;
+            cflags |= EF_COLD;
+        }
+        uint32_t vb = entry_vbytes(cflags, vlen);
+        size_t size = entry_size(r->klen, vb);
+        kvm_ref_t ref = REF(db->write_pos);
+        Entry *e = (Entry*)(db->mem + db->write_pos);
+        e->klen = r->klen; e->vlen = vlen; e->size = size; e->flags = cflags;
+        memcpy(e->data, r->kbuf, r->klen);
+        memcpy(e->data + r->klen, val, vb);
+        free(tmp);
+        if (KVM_ISLINE(db)) {
+            e->next = 0;
+            line_insert(db->lines, db->nbuckets, hj, ref);
+        } else {
+            kvm_ref_t *slot = &db->buckets[hj & (nb - 1)];
+            e->next = *slot;
+            *slot = ref;
+        }
+        bloom_add(db, hj);
+        db->write_pos += size;
+        db->live_bytes += size;
+        db->count++;
+    }
+    if (ret == 0 && vfill && kvm_vlog_append(db, vbuf, vfill, &voff) != 0) ret = -1;
+    free(vbuf);
+    free(h);
+    free(order);
+    if (ret == 0 && db->ord) ret = kvm_ord_rebuild(db);
+    return ret;
+}
+
+/* kvm_setmutex 時は作り直しの間、読み手を締め出す */
+int kvm_bulk_load(KVM *db, const KVMREC *recs, int64_t n) {
+    if (!db->mem || !(db->omode & KVMOWRITER) || n < 0) return -1;
+    kvm_wlock(db);
+    kvm_excl(db);
+    kvm_dirty(db);
+    int ret = kvm_bulk_locked(db, recs, n);
+    kvm_unexcl(db);
+    kvm_wunlock(db);
+    return ret;
+}
+
+/* 辞書の学習（COVER を簡単にしたもの）。見本を DICT_SEG バイトの区間に区切り、
+ * 出現の多い 8 バイト列を多く含む区間を選んで並べる。見本全体を辞書の区間数の
+ * 時代（epoch）に分け、時代ごとに一番良い区間を取り、取った区間の 8 バイト列は
+ * 数えないことにして重複を避ける。よく効く区間ほど後ろ（入力に近い側）に置く */
+#define DICT_SEG 64
+#define DICT_GRAM 8
+#define DICT_HBITS 16
+
+typedef struct {
+    uint32_t off;
+    uint64_t score;
+} DICTSEG;
+
+static int dictseg_cmp(const void *a, const void *b) {
+    uint64_t x = ((const DICTSEG*)a)->score, y = ((const DICTSEG*)b)->score;
+    return x < y ? -1 : x > y;
+}
+
+static inline uint32_t dict_gram(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - DICT_HBITS));
+}
+
+static uint32_t dict_train(const uint8_t *buf, size_t total, const size_t *bounds, int n,
+                           uint8_t *dict) {
+    if (total <= DICT_MAX) {
+        memcpy(dict, buf, total);
+        return total;
+    }
+    uint32_t *freq = calloc(1u << DICT_HBITS, sizeof(uint32_t));
+    int nseg = DICT_MAX / DICT_SEG;
+    DICTSEG *seg = calloc(nseg, sizeof(DICTSEG));
+    if (!freq || !seg) { free(freq); free(seg); return 0; }
+    /* 見本をまたぐ 8 バイト列は数えない */
+    for (int i = 0; i < n; i++)
+        for (size_t p = i ? bounds[i - 1] : 0; p + DICT_GRAM <= bounds[i]; p++)
+            freq[dict_gram(buf + p)]++;
+    size_t epoch = total / nseg;
+    int got = 0;
+    for (int k = 0, smp = 0; k < nseg; k++) {
+        size_t lo = k * epoch, hi = lo + epoch;
+        DICTSEG best = {0, 0};
+        for (size_t p = lo; p < hi && p + DICT_SEG <= total; p += DICT_GRAM) {
+            while (bounds[smp] <= p) smp++;
+            if (p + DICT_SEG > bounds[smp]) continue;
+            uint64_t sc = 0;
+            for (size_t q = p; q + DICT_GRAM <= p + DICT_SEG; q++) sc += freq[dict_gram(buf + q)];
+            if (sc > best.score) { best.off = p; best.score = sc; }
+        }
+        if (!best.score) continue;
+        for (size_t q = best.off; q + DICT_GRAM <= best.off + DICT_SEG; q++) freq[dict_gram(buf + q)] = 0;
+        seg[got++] = best;
+    }
+    qsort(seg, got, sizeof(DICTSEG), dictseg_cmp);
+    for (int i = 0; i < got; i++) memcpy(dict + i * DICT_SEG, buf + seg[i].off, DICT_SEG);
+    free(freq);
+    free(seg);
+    return got * DICT_SEG;
+}
+
+/* KVMTLZ の辞書を見本 n 個から作って置く（zstd の学習済み辞書の代わり）。
+ * 以後に圧縮する値がこの辞書を使う（既に置いた値はそのまま読める）。
+ * 書き手で開いた後に一度だけ。辞書はファイルに残り、コンパクションでも引き継ぐ */
+int kvm_setdict(KVM *db, const void *const *samples, const uint32_t *sizes, int n) {
+    if (!db->mem || !(db->omode & KVMOWRITER) || !(db->opts & KVMTLZ) || n <= 0) return -1;
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += sizes[i];
+    if (total < DICT_SEG) return -1;
+    uint8_t *buf = malloc(total), *dict = malloc(DICT_MAX);
+    size_t *bounds = malloc(n * sizeof(size_t));
+    int ret = -1;
+    if (buf && dict && bounds) {
+        size_t p = 0;
+        for (int i = 0; i < n; i++) {
+            memcpy(buf + p, samples[i], sizes[i]);
+            p += sizes[i];
+            bounds[i] = p;
+        }
+        uint32_t len = dict_train(buf, total, bounds, n, dict);
+        kvm_wlock(db);
+        if (len && !db->dict_len && !atomic_load(&db->compact_state)) ret = kvm_store_dict(db, dict, len);
+        /* 作り直しは辞書の場所をヘッダから知る */
+        if (ret == 0 && db->fd >= 0) kvm_write_header(db, KVM_FOPEN);
+        kvm_wunlock(db);
+    }
+    free(buf);
+    free(dict);
+    free(bounds);
+    return ret;
+}
+
+/* vlen と flags は一度だけ読む（kvm_setmutex 時はその場上書きと競合しうる）。
+ * 展開に失敗したら NULL（呼び出し側は seq を見て読み直す） */
+static char *kvm_copy_value(KVM *db, Entry *e, uint32_t *sp) {
+    uint32_t vlen = __atomic_load_n(&e->vlen, __ATOMIC_RELAXED);
+    uint32_t flags = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+    char *tmp;
+    const char *sv = kvm_stored(db, e, flags, vlen, &tmp);
+    if (!sv) return NULL;
+    if (tmp && !(flags & EF_LZ)) {
+        /* 値ファイルから読んだものがそのまま値 */
+        tmp[vlen] = '\0';
+        if (sp) *sp = vlen;
+        return tmp;
+    }
+    uint32_t raw = kvm_raw_len(sv, flags, vlen);
+    char *v = malloc((size_t)raw + 1);
+    if (v && kvm_decode(db, sv, flags, vlen, v, raw) != 0) { free(v); v = NULL; }
+    free(tmp);
+    if (!v) return NULL;
+    v[raw] = '\0';
+    if (sp) *sp = raw;
+    return v;
+}
+
+/* KVMTCACHE で読まれた印を付ける（書けない時は付けない） */
+static inline void kvm_touch(KVM *db, Entry *e, uint32_t flags) {
+    if ((db->opts & KVMTCACHE) && !(flags & EF_REF) && (db->omode & KVMOWRITER))
+        __atomic_fetch_or(&e->flags, EF_REF, __ATOMIC_RELAXED);
+}
+
+/* 期限切れは無いものとして返す。書き手だけで使っていればその場で索引から外す
+ * （順序付き索引は kvm_scan の cb から引かれると葉が詰まるので外さない） */
+static Entry *kvm_lookup(KVM *db, const char *key, uint32_t klen) {
+    if (kvm_rehashing(db) && (db->omode & KVMOWRITER) && !db->sync) kvm_rehash_step(db);
+    uint64_t h = kvm_hash(key, klen);
+    KVMCTR *c = kvm_ctr(db);
+    KVMREPN *rp = kvm_rep(db);
+    if (!bloom_maybe_in(db, rp ? rp->bloom : db->bloom, h)) {
+        kvm_count(c, KVMCBLOOM);
+        return NULL;
+    }
+    Entry *e = NULL;
+    kvm_ref_t *link = NULL;
+    if (rp) kvm_find_rep(db, rp, h, key, klen, &e);
+    else link = kvm_find(db, h, key, klen, &e);
+    if (!e) {
+        kvm_count(c, KVMCMISS);
+        return NULL;
+    }
+    uint32_t f = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+    if (entry_expired(e, f, kvm_clock())) {
+        kvm_count(c, KVMCEXPIRED);
+        if (link && (db->omode & KVMOWRITER) && !db->sync && !db->ord && !atomic_load(&db->compact_state))
+            kvm_unlink(db, h, link);
+        return NULL;
+    }
+    kvm_touch(db, e, f);
+    kvm_count(c, KVMCHIT);
+    return e;
+}
+
+/* 戻り値は malloc した値（後ろに NUL を付けてある）。vlen が NULL でなければ長さを書く */
+void *kvm_get2(KVM *db, const void *kbuf, uint32_t klen, uint32_t *vlen) {
+    KVMSTRIPE *st = kvm_rlock(db);
+    char *v;
+    unsigned s;
+    do {
+        s = kvm_read_begin(db);
+        Entry *e = kvm_lookup(db, kbuf, klen);
+        v = e ? kvm_copy_value(db, e, vlen) : NULL;
+        if (e && kvm_read_retry(db, s)) { free(v); continue; }
+        break;
+    } while (1);
+    kvm_runlock(st);
+    return v;
+}
+
+char *kvm_get(KVM *db, const char *key) {
+    return kvm_get2(db, key, strlen(key), NULL);
+}
+
+/* 値をコピーせずに領域内を直接指して返す（NUL 終端はされない）。
+ * 指す先は同じキーへの次の kvm_put（その場上書き）かコンパクションの入れ替えまで有効。
+ * kvm_setmutex 時も引けるが、それらと並べて呼んだ時の中身は呼び出し側で守ること。
+ * 圧縮した値と値ファイルにある値は指せないので -1（kvm_get か kvm_get_into を使う） */
+int kvm_get_view(KVM *db, const char *key, uint32_t klen, const char **vp, uint32_t *sp) {
+    KVMSTRIPE *st = kvm_rlock(db);
+    Entry *e = kvm_lookup(db, key, klen);
+    if (e && (__atomic_load_n(&e->flags, __ATOMIC_RELAXED) & (EF_LZ | EF_COLD))) e = NULL;
+    if (e) {
+        *vp = e->data + e->klen;
+        *sp = __atomic_load_n(&e->vlen, __ATOMIC_RELAXED);
+    }
+    kvm_runlock(st);
+    return e ? 0 : -1;
+}
+
+/* 呼び出し側のバッファに cap バイトまでコピーする（tchdbget3 相当）。
+ * 収まれば NUL 終端する。戻り値は値の長さ（cap 以上なら切り詰めた）、無いか cap が負なら -1 */
+int kvm_get_into2(KVM *db, const void *kbuf, uint32_t klen, char *buf, int cap) {
+    if (cap < 0) return -1;
+    KVMSTRIPE *st = kvm_rlock(db);
+    int ret = -1;
+    unsigned s;
+    do {
+        s = kvm_read_begin(db);
+        Entry *e = kvm_lookup(db, kbuf, klen);
+        ret = -1;
+        if (!e) break;
+        uint32_t vl = __atomic_load_n(&e->vlen, __ATOMIC_RELAXED);
+        uint32_t flags = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+        char *cold;
+        const char *sv = kvm_stored(db, e, flags, vl, &cold);
+        if (!sv) continue;
+        uint32_t raw = kvm_raw_len(sv, flags, vl), n = raw < (uint32_t)cap ? raw : (uint32_t)cap;
+        int err = 0;
+        if (!(flags & EF_LZ)) {
+            memcpy(buf, sv, n);
+        } else if (raw <= (uint32_t)cap) {
+            err = kvm_decode(db, sv, flags, vl, buf, raw);
+        } else {
+            /* 切り詰める時は一旦全部展開する */
+            char *tmp = malloc(raw);
+            err = !tmp || kvm_decode(db, sv, flags, vl, tmp, raw) != 0;
+            if (!err) memcpy(buf, tmp, n);
+            free(tmp);
+        }
+        free(cold);
+        if (err) continue;
+        if (n < (uint32_t)cap) buf[n] = '\0';
+        ret = raw;
+    } while (kvm_read_retry(db, s));
+    kvm_runlock(st);
+    return ret;
+}
+
+int kvm_get_into(KVM *db, const char *key, char *buf, int cap) {
+    return kvm_get_into2(db, key, strlen(key), buf, cap);
+}
+
+/* 複数キーをまとめて引く。先に全部ハッシュして Bloom と索引をプリフェッチし、
+ * 次にチェーン先頭（ラインならタグの合った Entry）をプリフェッチしてから照合する。
+ * 独立した読みを重ねて DRAM の待ちを隠す。out[i] は kvm_get と同じく
+ * malloc した値か NULL。戻り値は見つかった件数 */
+int kvm_mget(KVM *db, const char **keys, int n, char **out) {
+    KVMSTRIPE *st = kvm_rlock(db);
+    KVMCTR *c = kvm_ctr(db);
+    int hits = 0;
+    uint32_t now = kvm_clock();
+    for (int base = 0; base < n; base += MGET_BATCH) {
+        int m = n - base < MGET_BATCH ? n - base : MGET_BATCH;
+        const char **k = keys + base;
+        uint64_t h[MGET_BATCH];
+        uint32_t klen[MGET_BATCH];
+        void *slot[MGET_BATCH];
+        uint8_t maybe[MGET_BATCH];
+        if (kvm_rehashing(db) && (db->omode & KVMOWRITER) && !db->sync) kvm_rehash_step(db);
+        KVMREPN *rp = kvm_rep(db);
+        uint64_t *bloom = rp ? rp->bloom : db->bloom;
+        for (int i = 0; i < m; i++) {
+            klen[i] = strlen(k[i]);
+            h[i] = kvm_hash(k[i], klen[i]);
+            __builtin_prefetch(bloom_block_in(db, bloom, h[i]));
+            if (rp && KVM_ISLINE(db)) slot[i] = (Line*)rp->table + (h[i] & (rp->nbuckets - 1));
+            else if (rp) slot[i] = (kvm_ref_t*)rp->table + (h[i] & (rp->nbuckets - 1));
+            else if (KVM_ISLINE(db)) slot[i] = &db->lines[h[i] & (db->nbuckets - 1)];
+            else slot[i] = kvm_slot(db, h[i]);
+            __builtin_prefetch(slot[i]);
+        }
+        for (int i = 0; i < m; i++) {
+            maybe[i] = bloom_maybe_in(db, bloom, h[i]);
+            if (!maybe[i]) continue;
+            kvm_ref_t ref = 0;
+            if (KVM_ISLINE(db)) {
+                Line *l = slot[i];
+                unsigned mm = line_match(l, line_tag(h[i]));
+                if (mm) ref = l->off[__builtin_ctz(mm)];
+            } else {
+                ref = *(kvm_ref_t*)slot[i];
+            }
+            if (ref) __builtin_prefetch(ENTRY(db, ref));
+        }
+        for (int i = 0; i < m; i++) {
+            char *v = NULL;
+            int r = KVMCBLOOM;
+            if (maybe[i]) {
+                unsigned s;
+                do {
+                    free(v);
+                    s = kvm_read_begin(db);
+                    Entry *e = NULL;
+                    if (rp) kvm_find_rep(db, rp, h[i], k[i], klen[i], &e);
+                    else kvm_find(db, h[i], k[i], klen[i], &e);
+                    uint32_t f = e ? __atomic_load_n(&e->flags, __ATOMIC_RELAXED) : 0;
+                    r = !e ? KVMCMISS : entry_expired(e, f, now) ? KVMCEXPIRED : KVMCHIT;
+                    if (r != KVMCHIT) e = NULL;
+                    if (e) kvm_touch(db, e, f);
+                    v = e ? kvm_copy_value(db, e, NULL) : NULL;
+                    if (!e) break;
+                } while (kvm_read_retry(db, s));
+            }
+            kvm_count(c, r);
+            out[base + i] = v;
+            if (v) hits++;
+        }
+    }
+    kvm_runlock(st);
+    return hits;
+}
+
+/* ========== 非同期の読み（kvm_get_async） ========== */
+/* KVMTTIER の値ファイルの読みを io_uring で重ね、1 スレッドで何百も読みを出したままにする。
+ * 索引は RAM にあるので引くのはその場で済み、待つのは値ファイルの読みだけ。
+ * KVMAIO はスレッドごとに作る（中ではロックを取らない）。無いキー・領域に置かれた値・
+ * キャッシュに当たった値は kvm_get_async の中で cb を呼ぶ。残りは AIO_BATCH 件たまるか
+ * kvm_aio_poll で io_uring にまとめて出し、終わったものの cb を kvm_aio_poll が呼ぶ。
+ * io_uring が無いか使えなければ（Linux 以外、無効にされたカーネル）その場で pread する。
+ * cb に渡す値は cb の中でだけ有効で、見つからなければ NULL。cb から kvm_get_async や
+ * put を呼んでもよい */
+#define AIO_BATCH 32            /* これだけたまったら kvm_aio_poll を待たずに出す */
+#define AIO_DEPTH_MAX 4096
+
+#ifdef KVM_URING
+/* 必要な分だけの io_uring（SQ / CQ のリングを mmap して直接触る） */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqe_sz;
+} URING;
+
+static void uring_fini(URING *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqe_sz);
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED) munmap(u->sq_ptr, u->sq_sz);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static int uring_init(URING *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) u->sq_sz = u->cq_sz = u->sq_sz > u->cq_sz ? u->sq_sz : u->cq_sz;
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) { uring_fini(u); return -1; }
+    u->cq_ptr = single ? u->sq_ptr
+              : mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED) { uring_fini(u); return -1; }
+    u->sqe_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqe_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { uring_fini(u); return -1; }
+    uint8_t *sq = u->sq_ptr, *cq = u->cq_ptr;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* 読みを 1 つ積む（カーネルに渡すのは uring_enter） */
+static void uring_prep_read(URING *u, int fd, void *buf, uint32_t len, uint64_t off, uint64_t data) {
+    unsigned tail = *u->sq_tail, i = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(URING *u, unsigned submit, unsigned wait) {
+    int r;
+    do {
+        r = (int)syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/* 終わったものを 1 つ取り出す。無ければ 0 */
+static int uring_reap(URING *u, uint64_t *data, int *res) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    const struct io_uring_cqe *c = &u->cqes[head & *u->cq_mask];
+    *data = c->user_data;
+    *res = c->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif
+
+typedef struct {
+    KVMGETCB cb;
+    void *op;
+    char *key;              /* 読み直す時のためのキーの写し */
+    uint32_t klen;
+    uint32_t vlen, flags;   /* 値ファイルに置いた長さと Entry.flags */
+    uint64_t off, gen;      /* gen は引いた時の KVM.gen（入れ替わったら off は使えない） */
+    char *buf;              /* vlen + 1 バイト */
+} AIOREQ;
+
+struct KVMAIO {
+    KVM *db;
+    int depth;
+    int npend;              /* 積んだがまだ出していない数 */
+    int inflight;           /* io_uring に出して終わっていない数 */
+    int uring;              /* io_uring が使えれば 1 */
+#ifdef KVM_URING
+    URING ring;
+#endif
+    AIOREQ *req;            /* depth 個 */
+    int *freeidx, nfree;
+    int *pend;
+};
+
+/* depth は 1 スレッドで出したままにできる読みの数 */
+KVMAIO *kvm_aio_new(KVM *db, int depth) {
+    if (depth < 1) depth = 1;
+    if (depth > AIO_DEPTH_MAX) depth = AIO_DEPTH_MAX;
+    KVMAIO *aio = calloc(1, sizeof(KVMAIO));
+    if (!aio) return NULL;
+    aio->db = db;
+    aio->depth = depth;
+    aio->req = calloc(depth, sizeof(AIOREQ));
+    aio->freeidx = malloc(depth * sizeof(int));
+    aio->pend = malloc(depth * sizeof(int));
+    if (!aio->req || !aio->freeidx || !aio->pend) {
+        free(aio->req); free(aio->freeidx); free(aio->pend); free(aio);
+        return NULL;
+    }
+    for (int i = 0; i < depth; i++) aio->freeidx[i] = depth - 1 - i;
+    aio->nfree = depth;
+#ifdef KVM_URING
+    aio->uring = uring_init(&aio->ring, depth) == 0;
+#endif
+    return aio;
+}
+
+/* 出したものが全部終わるのを待ってから閉じる */
+void kvm_aio_del(KVMAIO *aio) {
+    if (!aio) return;
+    while (aio->npend || aio->inflight) kvm_aio_poll(aio, 1);
+#ifdef KVM_URING
+    if (aio->uring) uring_fini(&aio->ring);
+#endif
+    free(aio->req);
+    free(aio->freeidx);
+    free(aio->pend);
+    free(aio);
+}
+
+/* 積んだまま・出したままの数 */
+int kvm_aio_pending(KVMAIO *aio) {
+    return aio->npend + aio->inflight;
+}
+
+/* 値ファイルから読んだ（圧縮してあれば展開前の）値を cb に渡す。展開は辞書を読むので
+ * 読み手の印を付けてする（cb は印を外してから呼ぶ） */
+static void aio_deliver(KVM *db, AIOREQ *r) {
+    if (!(r->flags & EF_LZ)) {
+        r->buf[r->vlen] = '\0';
+        r->cb(r->buf, r->vlen, r->op);
+        return;
+    }
+    uint32_t raw = kvm_raw_len(r->buf, r->flags, r->vlen);
+    char *v = malloc((size_t)raw + 1);
+    KVMSTRIPE *st = kvm_rlock(db);
+    if (v && kvm_decode(db, r->buf, r->flags, r->vlen, v, raw) != 0) { free(v); v = NULL; }
+    kvm_runlock(st);
+    if (v) v[raw] = '\0';
+    r->cb(v, v ? raw : 0, r->op);
+    free(v);
+}
+
+/* 読めなかった・領域が入れ替わったものは同期の kvm_get2 で引き直す */
+static void aio_redo(KVM *db, const void *kbuf, uint32_t klen, KVMGETCB cb, void *op) {
+    uint32_t vl = 0;
+    char *v = kvm_get2(db, kbuf, klen, &vl);
+    cb(v, vl, op);
+    free(v);
+}
+
+static void aio_release(KVMAIO *aio, int i) {
+    AIOREQ *r = &aio->req[i];
+    free(r->key);
+    free(r->buf);
+    r->key = r->buf = NULL;
+    aio->freeidx[aio->nfree++] = i;
+}
+
+/* 積んだ読みを io_uring に出す。出している間は読み手の印を付けておき、値ファイルの fd が
+ * コンパクションの入れ替えで閉じられないようにする（出した後はカーネルがファイルを握る） */
+static int aio_submit(KVMAIO *aio) {
+    if (!aio->npend) return 0;
+    KVM *db = aio->db;
+    int redo[AIO_DEPTH_MAX], nredo = 0, n = 0;
+#ifdef KVM_URING
+    KVMSTRIPE *st = kvm_rlock(db);
+    for (int j = 0; j < aio->npend; j++) {
+        int i = aio->pend[j];
+        AIOREQ *r = &aio->req[i];
+        if (r->gen != db->gen) redo[nredo++] = i;
+        else { uring_prep_read(&aio->ring, db->vfd, r->buf, r->vlen, r->off, i); n++; }
+    }
+    int done = 0;
+    while (done < n) {
+        int k = uring_enter(&aio->ring, n - done, 0);
+        if (k <= 0) break;
+        done += k;
+    }
+    if (done < n) {
+        /* 渡せなかった分は積んだのを取り消して同期で読む */
+        __atomic_store_n(aio->ring.sq_tail, *aio->ring.sq_tail - (n - done), __ATOMIC_RELEASE);
+        for (int j = aio->npend - 1, left = n - done; j >= 0 && left; j--) {
+            int i = aio->pend[j];
+            if (aio->req[i].gen != db->gen) continue;
+            redo[nredo++] = i;
+            left--;
+        }
+    }
+    aio->inflight += done;
+    kvm_runlock(st);
+#else
+    for (int j = 0; j < aio->npend; j++) redo[nredo++] = aio->pend[j];
+#endif
+    aio->npend = 0;
+    for (int j = 0; j < nredo; j++) {
+        AIOREQ *r = &aio->req[redo[j]];
+        aio_redo(db, r->key, r->klen, r->cb, r->op);
+        aio_release(aio, redo[j]);
+    }
+    return nredo;
+}
+
+/* 積んだものを出し、出したもののうち min 個（出したままの数が少なければその数）が
+ * 終わるまで待つ。min が 0 なら待たずに終わっているものだけ。戻り値は cb を呼んだ数 */
+int kvm_aio_poll(KVMAIO *aio, int min) {
+    int done = aio_submit(aio);
+#ifdef KVM_URING
+    KVM *db = aio->db;
+    if (min > aio->inflight) min = aio->inflight;
+    int got = 0;
+    for (;;) {
+        uint64_t data;
+        int res;
+        while (aio->inflight && uring_reap(&aio->ring, &data, &res)) {
+            int i = (int)data;
+            AIOREQ *r = &aio->req[i];
+            aio->inflight--;
+            got++;
+            if (res == (int)r->vlen) {
+                KVMSTRIPE *st = kvm_rlock(db);
+                if (db->gen == r->gen) kvm_cache_put(db->cache, r->off, r->buf, r->vlen);
+                kvm_runlock(st);
+                aio_deliver(db, r);
+            } else {
+                aio_redo(db, r->key, r->klen, r->cb, r->op);
+            }
+            aio_release(aio, i);
+        }
+        if (got >= min || !aio->inflight) break;
+        if (uring_enter(&aio->ring, 0, 1) < 0) break;
+    }
+    done += got;
+#else
+    (void)min;
+#endif
+    return done;
+}
+
+/* 戻り値は cb をもう呼んだなら 0、読みを積んだなら 1、値を読む場所が取れなければ -1
+ * （cb は NULL で呼んである） */
+int kvm_get_async2(KVMAIO *aio, const void *kbuf, uint32_t klen, KVMGETCB cb, void *op) {
+    KVM *db = aio->db;
+    KVMSTRIPE *st = kvm_rlock(db);
+    char *v = NULL;
+    uint32_t vl = 0, vlen = 0, flags = 0;
+    uint64_t off = 0;
+    int cold;
+    for (;;) {
+        unsigned s = kvm_read_begin(db);
+        Entry *e = kvm_lookup(db, kbuf, klen);
+        cold = 0;
+        if (e) {
+            vlen = __atomic_load_n(&e->vlen, __ATOMIC_RELAXED);
+            flags = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+            if (flags & EF_COLD) { cold = 1; memcpy(&off, e->data + e->klen, sizeof(off)); }
+            else v = kvm_copy_value(db, e, &vl);
+        }
+        if (e && kvm_read_retry(db, s)) { free(v); v = NULL; continue; }
+        break;
+    }
+    if (!cold) {
+        kvm_runlock(st);
+        cb(v, v ? vl : 0, op);
+        free(v);
+        return 0;
+    }
+    AIOREQ t = { cb, op, NULL, klen, vlen, flags, off, db->gen, malloc((size_t)vlen + 1) };
+    int have = t.buf && kvm_cache_get(db->cache, off, vlen, t.buf) == 0;
+    if (!have && t.buf && !aio->uring) {
+        have = off + vlen <= db->vlog_pos && kvm_vread(db->vfd, t.buf, vlen, off) == 0;
+        if (have) kvm_cache_put(db->cache, off, t.buf, vlen);
+    }
+    kvm_runlock(st);
+    if (!t.buf) { cb(NULL, 0, op); return -1; }
+    if (have || !aio->uring) {
+        if (have) aio_deliver(db, &t);
+        else aio_redo(db, kbuf, klen, cb, op);
+        free(t.buf);
+        return 0;
+    }
+    while (!aio->nfree) kvm_aio_poll(aio, 1);
+    t.key = malloc(klen ? klen : 1);
+    if (!t.key) { free(t.buf); cb(NULL, 0, op); return -1; }
+    memcpy(t.key, kbuf, klen);
+    int i = aio->freeidx[--aio->nfree];
+    aio->req[i] = t;
+    aio->pend[aio->npend++] = i;
+    if (aio->npend >= AIO_BATCH) aio_submit(aio);
+    return 1;
+}
+
+int kvm_get_async(KVMAIO *aio, const char *key, KVMGETCB cb, void *op) {
+    return kvm_get_async2(aio, key, strlen(key), cb, op);
+}
+
+static void aio_mget_cb(const char *v, uint32_t vl, void *op) {
+    char **out = op;
+    *out = NULL;
+    if (!v || !(*out = malloc((size_t)vl + 1))) return;
+    memcpy(*out, v, vl);
+    (*out)[vl] = '\0';
+}
+
+/* kvm_mget の非同期版。値ファイルの読みを全部まとめて出してから待つので、
+ * ディスクの待ちが 1 件ずつではなく重なる。out[i] は kvm_mget と同じく malloc した値か
+ * NULL。aio に先に積んであった読みもここで終わらせる。戻り値は見つかった件数 */
+int kvm_aio_mget(KVMAIO *aio, const char **keys, int n, char **out) {
+    for (int i = 0; i < n; i++) kvm_get_async(aio, keys[i], aio_mget_cb, &out[i]);
+    while (kvm_aio_pending(aio)) kvm_aio_poll(aio, 1);
+    int hits = 0;
+    for (int i = 0; i < n; i++) hits += out[i] != NULL;
+    return hits;
+}
+
+/* 走査用。領域にそのまま置かれていれば直接指し、圧縮されているか値ファイルにあれば
+ * *buf（足りなければ伸ばす）へ読み出して指す。読めなければ -1 */
+static int kvm_value_at(KVM *db, const Entry *e, char **buf, size_t *cap,
+                        const char **vp, uint32_t *sp) {
+    uint32_t vlen = __atomic_load_n(&e->vlen, __ATOMIC_RELAXED);
+    uint32_t flags = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+    if (!(flags & (EF_LZ | EF_COLD))) {
+        *vp = e->data + e->klen;
+        *sp = vlen;
+        return 0;
+    }
+    char *cold;
+    const char *sv = kvm_stored(db, e, flags, vlen, &cold);
+    if (!sv) return -1;
+    uint32_t raw = kvm_raw_len(sv, flags, vlen);
+    if (raw + (size_t)1 > *cap) {
+        size_t n = *cap ? *cap : 256;
+        while (n < raw + (size_t)1) n *= 2;
+        char *p = realloc(*buf, n);
+        if (!p) { free(cold); return -1; }
+        *buf = p;
+        *cap = n;
+    }
+    int err = 0;
+    if (flags & EF_LZ) err = kvm_decode(db, sv, flags, vlen, *buf, raw);
+    else memcpy(*buf, sv, raw);
+    free(cold);
+    if (err) return -1;
+    (*buf)[raw] = '\0';
+    *vp = *buf;
+    *sp = raw;
+    return 0;
+}
+
+/* [start, end) のキーを昇順に cb へ渡す。start / end が NULL ならその側は端まで。
+ * kvm_setorder していなければ -1、そうでなければ cb に渡した件数を返す。
+ * kvm_setmutex 時は書き手の mutex を持って辿るので、その間 put / delete は待たされ
+ * （get は止まらない）、cb から put / delete を呼んではいけない。
+ * 渡すキーと値は領域を直接指していて（圧縮した値は展開した一時バッファ）、
+ * cb から戻った後は保証されない */
+int64_t kvm_scan2(KVM *db, const void *sbuf, uint32_t slen, const void *ebuf, uint32_t elen,
+                  KVMSCANCB cb, void *op) {
+    if (!db->mem || !db->ord) return -1;
+    kvm_wlock(db);
+    int64_t cnt = 0;
+    int i = 0;
+    char *buf = NULL;
+    size_t cap = 0;
+    uint32_t now = kvm_clock();
+    ORDNODE *x = sbuf ? ord_seek(db, sbuf, slen, &i) : db->ord->first;
+    uint64_t ep = ebuf ? ord_pfx(ebuf, elen) : 0;
+    for (; x; x = x->next, i = 0) {
+        /* 葉の残りの Entry は互いに独立なので先に読み込みを投げておく */
+        for (int j = i; j < x->n; j++) __builtin_prefetch(ENTRY(db, x->ref[j]));
+        if (x->next) __builtin_prefetch(x->next);
+        for (; i < x->n; i++) {
+            if (ebuf && ord_cmp(db, ep, ebuf, elen, x->pfx[i], x->ref[i]) <= 0) goto out;
+            const Entry *e = ENTRY(db, x->ref[i]);
+            const char *v;
+            uint32_t vs;
+            if (entry_expired(e, __atomic_load_n(&e->flags, __ATOMIC_RELAXED), now)) continue;
+            if (kvm_value_at(db, e, &buf, &cap, &v, &vs) != 0) { cnt = -1; goto out; }
+            cnt++;
+            if (!cb(e->data, e->klen, v, vs, op)) goto out;
+        }
+    }
+out:
+    kvm_wunlock(db);
+    free(buf);
+    return cnt;
+}
+
+int64_t kvm_scan(KVM *db, const char *start, const char *end, KVMSCANCB cb, void *op) {
+    return kvm_scan2(db, start, start ? strlen(start) : 0, end, end ? strlen(end) : 0, cb, op);
+}
+
+/* pbuf で始まるキーを昇順に渡す。終わりは前置の末尾のバイトを 1 つ進めたキー */
+int64_t kvm_prefix2(KVM *db, const void *pbuf, uint32_t plen, KVMSCANCB cb, void *op) {
+    char *end = malloc(plen + 1);
+    if (!end) return -1;
+    memcpy(end, pbuf, plen);
+    uint32_t elen = plen;
+    while (elen > 0 && (uint8_t)end[elen - 1] == 0xff) elen--;
+    if (elen > 0) end[elen - 1]++;
+    int64_t ret = kvm_scan2(db, pbuf, plen, elen ? end : NULL, elen, cb, op);
+    free(end);
+    return ret;
+}
+
+int64_t kvm_prefix(KVM *db, const char *prefix, KVMSCANCB cb, void *op) {
+    return kvm_prefix2(db, prefix, strlen(prefix), cb, op);
+}
+
+/* 全件を領域の先頭から write_pos まで順に辿る（tchdbiternext 相当）。索引は使わず、
+ * 削除済み・置き換え済みの Entry と索引表を読み飛ばすだけなので、読みは前から順の
+ * 連続アクセスになる。作った時点の write_pos までを辿り、その後に書かれたものや
+ * 途中で置き換えられたものは出たり出なかったりする。コンパクションや kvm_bulk_load で
+ * 領域が入れ替わったら（KVMTCACHE では追い出しでも）以後は -1 を返す。期限切れは出さない */
+struct KVMITER {
+    KVM *db;
+    size_t pos, end;
+    uint64_t gen;
+    uint32_t now;               /* 作った時刻（これで期限切れを見る） */
+    char *buf;                  /* 圧縮した値の展開先 */
+    size_t cap;
+};
+
+#define ITER_PREFETCH 512       /* kvm_iter_next / kvm_foreach がこのバイト数先を先読みする */
+
+KVMITER *kvm_iter_new(KVM *db) {
+    if (!db->mem) return NULL;
+    KVMITER *it = malloc(sizeof(KVMITER));
+    if (!it) return NULL;
+    kvm_wlock(db);
+    it->db = db;
+    it->pos = kvm_walk_start(db);
+    it->end = db->write_pos;
+    it->gen = db->gen;
+    kvm_wunlock(db);
+    it->now = kvm_clock();
+    it->buf = NULL;
+    it->cap = 0;
+    return it;
+}
+
+void kvm_iter_del(KVMITER *it) {
+    if (!it) return;
+    free(it->buf);
+    free(it);
+}
+
+/* 次のレコード。キーと値は領域を直接指す（kvm_get_view と同じ扱い。圧縮した値は
+ * 次の kvm_iter_next まで有効な展開先を指す）。終わりなら -1 */
+int kvm_iter_next(KVMITER *it, const char **kp, uint32_t *ksp, const char **vp, uint32_t *vsp) {
+    KVM *db = it->db;
+    KVMSTRIPE *st = kvm_rlock(db);
+    int ret = -1;
+    if (db->gen == it->gen) {
+        while (it->pos != it->end) {
+            const Entry *e = (const Entry*)(db->mem + it->pos);
+            __builtin_prefetch(db->mem + it->pos + ITER_PREFETCH);
+            it->pos = kvm_walk_next(db, it->pos);
+            uint32_t f = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+            if ((f & (EF_BLOB | EF_DEAD | EF_STALE)) || entry_expired(e, f, it->now)) continue;
+            if (kvm_value_at(db, e, &it->buf, &it->cap, vp, vsp) != 0) continue;
+            *kp = e->data;
+            *ksp = e->klen;
+            ret = 0;
+            break;
+        }
+    }
+    kvm_runlock(st);
+    return ret;
+}
+
+/* 全件を cb に渡す（tchdbforeach 相当）。kvm_iter_next と同じ順だが、読み手の印を
+ * 一度だけ付けて回すのでさらに軽い。その間は索引の拡張とコンパクションの入れ替えが
+ * 待たされ、cb から put / delete を呼んではいけない。戻り値は渡した件数 */
+int64_t kvm_foreach(KVM *db, KVMSCANCB cb, void *op) {
+    if (!db->mem) return -1;
+    /* 終わりは書き手の mutex の下で読む。読み手の印を付ける前に入れ替わっていたらやり直す */
+    KVMSTRIPE *st;
+    size_t start, end;
+    for (;;) {
+        kvm_wlock(db);
+        start = kvm_walk_start(db);
+        end = db->write_pos;
+        uint64_t gen = db->gen;
+        kvm_wunlock(db);
+        st = kvm_rlock(db);
+        if (db->gen == gen) break;
+        kvm_runlock(st);
+    }
+    int64_t cnt = 0;
+    char *buf = NULL;
+    size_t cap = 0;
+    uint32_t now = kvm_clock();
+    for (size_t pos = start; pos != end; ) {
+        const Entry *e = (const Entry*)(db->mem + pos);
+        __builtin_prefetch(db->mem + pos + ITER_PREFETCH);
+        pos = kvm_walk_next(db, pos);
+        uint32_t f = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+        if ((f & (EF_BLOB | EF_DEAD | EF_STALE)) || entry_expired(e, f, now)) continue;
+        const char *v;
+        uint32_t vs;
+        /* その場上書きと競合して展開できなかったものは飛ばす（上書き後の値は出ない扱い） */
+        if (kvm_value_at(db, e, &buf, &cap, &v, &vs) != 0) continue;
+        cnt++;
+        if (!cb(e->data, e->klen, v, vs, op)) break;
+    }
+    kvm_runlock(st);
+    free(buf);
+    return cnt;
+}
+
+/* ========== スナップショット（kvm_snapshot） ========== */
+/* 今の内容をコピーせずに固定して読む（tchdbcopy の代わり）。作るのは write_pos を
+ * 覚えるだけで、その後の put / delete は止めずに続けられる。書き手は見えている版を
+ * 上書きせず残すので、その間は領域がスナップショットの無い時より伸びる。
+ * 使い終わったら kvm_snap_del する（コンパクションはそれまで -1 で断る）。
+ * kvm_close の後は読めず、kvm_del の前に全部 kvm_snap_del しておくこと。
+ * KVMTCACHE は古い版から上書きするので作れない（NULL） */
+KVMSNAP *kvm_snapshot(KVM *db) {
+    if (!db->mem || (db->opts & KVMTCACHE)) return NULL;
+    KVMSNAP *sn = calloc(1, sizeof(KVMSNAP));
+    if (!sn) return NULL;
+    kvm_wlock(db);
+    /* コピー中の領域はすぐ入れ替わるので、先に入れ替えておく */
+    if (atomic_load(&db->compact_state)) kvm_compact_finish(db, NULL);
+    KVMSNAPS *s = db->snaps;
+    if (!s && (s = calloc(1, sizeof(KVMSNAPS)))) {
+        pthread_mutex_init(&s->mtx, NULL);
+        db->snaps = s;
+    }
+    if (!s) {
+        kvm_wunlock(db);
+        free(sn);
+        return NULL;
+    }
+    sn->db = db;
+    sn->pos = db->write_pos;
+    sn->epoch = ++s->epoch;
+    sn->gen = db->gen;
+    sn->now = kvm_clock();
+    sn->next = s->live;
+    if (s->live) s->live->prev = sn;
+    s->live = sn;
+    s->hi = sn->pos;
+    kvm_wunlock(db);
+    return sn;
+}
+
+/* 記録した版のうち、まだどれかのスナップショットから見えているものだけを残す */
+static void snap_rec_prune(KVMSNAPS *s) {
+    for (size_t i = 0; s->rec && i <= s->mask; i++) {
+        for (SNAPREC **pp = &s->rec[i]; *pp; ) {
+            SNAPREC *r = *pp;
+            int seen = 0;
+            for (KVMSNAP *sn = s->live; sn && !seen; sn = sn->next)
+                seen = REF_POS(r->ref) < sn->pos && r->death >= sn->epoch;
+            if (seen) { pp = &r->next; continue; }
+            *pp = r->next;
+            free(r);
+            s->nrec--;
+        }
+    }
+}
+
+void kvm_snap_del(KVMSNAP *sn) {
+    if (!sn) return;
+    KVM *db = sn->db;
+    if (db) {
+        kvm_wlock(db);
+        KVMSNAPS *s = db->snaps;
+        if (sn->prev) sn->prev->next = sn->next;
+        else s->live = sn->next;
+        if (sn->next) sn->next->prev = sn->prev;
+        s->hi = s->live ? s->live->pos : 0;
+        pthread_mutex_lock(&s->mtx);
+        if (s->live) snap_rec_prune(s);
+        else snap_rec_clear(s);
+        pthread_mutex_unlock(&s->mtx);
+        kvm_wunlock(db);
+    }
+    free(sn);
+}
+
+/* sn から見える key の Entry。読み手の印を付けて呼ぶ。期限は sn を作った時刻で見る */
+static Entry *kvm_snap_find(KVMSNAP *sn, const char *key, uint32_t klen) {
+    KVM *db = sn->db;
+    uint64_t h = kvm_hash(key, klen);
+    Entry *e = NULL;
+    if (bloom_maybe(db, h)) kvm_find(db, h, key, klen, &e);
+    if (e && (size_t)((uint8_t*)e - db->mem) < sn->pos)
+        return entry_expired(e, __atomic_load_n(&e->flags, __ATOMIC_ACQUIRE), sn->now) ? NULL : e;
+    /* 後から書かれたか消されたなら、見えていた版は外す前に記録してある */
+    KVMSNAPS *s = db->snaps;
+    e = NULL;
+    pthread_mutex_lock(&s->mtx);
+    for (SNAPREC *r = s->rec ? s->rec[h & s->mask] : NULL; r; r = r->next) {
+        if (r->h != h || REF_POS(r->ref) >= sn->pos || r->death < sn->epoch) continue;
+        Entry *x = ENTRY(db, r->ref);
+        if (x->klen == klen && memcmp(x->data, key, klen) == 0) { e = x; break; }
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return e && !entry_expired(e, e->flags, sn->now) ? e : NULL;
+}
+
+/* kvm_get2 と同じだが sn を作った時点の値を返す */
+void *kvm_snap_get2(KVMSNAP *sn, const void *kbuf, uint32_t klen, uint32_t *vlen) {
+    KVM *db = sn->db;
+    if (!db) return NULL;
+    KVMSTRIPE *st = kvm_rlock(db);
+    char *v = NULL;
+    if (db->gen == sn->gen) {
+        /* 見える Entry は書き換えられないので seq を見るまでもない */
+        Entry *e = kvm_snap_find(sn, kbuf, klen);
+        if (e) v = kvm_copy_value(db, e, vlen);
+    }
+    kvm_runlock(st);
+    return v;
+}
+
+char *kvm_snap_get(KVMSNAP *sn, const char *key) {
+    return kvm_snap_get2(sn, key, strlen(key), NULL);
+}
+
+/* pos の Entry が sn から見えるか。今は外れていても記録にあれば見える */
+static int kvm_snap_sees(KVMSNAP *sn, const Entry *e, size_t pos) {
+    uint32_t f = __atomic_load_n(&e->flags, __ATOMIC_ACQUIRE);
+    if ((f & EF_BLOB) || entry_expired(e, f, sn->now)) return 0;
+    if (!(f & (EF_DEAD | EF_STALE))) return 1;
+    KVMSNAPS *s = sn->db->snaps;
+    uint64_t h = kvm_hash(e->data, e->klen);
+    int seen = 0;
+    pthread_mutex_lock(&s->mtx);
+    for (SNAPREC *r = s->rec ? s->rec[h & s->mask] : NULL; r && !seen; r = r->next)
+        seen = r->ref == REF(pos) && r->death >= sn->epoch;
+    pthread_mutex_unlock(&s->mtx);
+    return seen;
+}
+
+/* sn から見える全件を領域の順に cb へ渡す（書き出し向け）。kvm_foreach と違い
+ * 読み手の印は 1 件ずつ外すので、辿っている間も書き手は止まらず、cb から
+ * put / delete を呼んでもよい（出てくる内容は変わらない）。渡すキーと値は
+ * cb から戻った後は保証されない。戻り値は渡した件数、閉じられていたら -1 */
+int64_t kvm_snap_foreach(KVMSNAP *sn, KVMSCANCB cb, void *op) {
+    KVM *db = sn->db;
+    if (!db) return -1;
+    int64_t cnt = 0;
+    char *buf = NULL;
+    size_t cap = 0;
+    for (size_t pos = db->data_off; pos < sn->pos; ) {
+        KVMSTRIPE *st = kvm_rlock(db);
+        if (db->gen != sn->gen) { kvm_runlock(st); cnt = -1; break; }
+        const Entry *e = (const Entry*)(db->mem + pos);
+        __builtin_prefetch(db->mem + pos + ITER_PREFETCH);
+        const char *v;
+        uint32_t vs;
+        int ok = kvm_snap_sees(sn, e, pos) && kvm_value_at(db, e, &buf, &cap, &v, &vs) == 0;
+        pos += e->size;
+        kvm_runlock(st);
+        if (!ok) continue;
+        cnt++;
+        if (!cb(e->data, e->klen, v, vs, op)) break;
+    }
+    free(buf);
+    return cnt;
+}
+
+/* 索引から外して Entry に EF_DEAD を立てる。領域はコンパクションまで残る。
+ * Bloom filter のビットは消せないので立ったまま。期限切れのキーは外すが -1 を返す */
+static int kvm_delete_locked(KVM *db, const char *key, uint32_t klen) {
+    if (atomic_load(&db->compact_state)) kvm_compact_finish(db, NULL);
+    if (kvm_rehashing(db)) kvm_rehash_step(db);
+    kvm_dirty(db);
+    uint64_t h = kvm_hash(key, klen);
+    KVMCTR *c = kvm_ctr(db);
+    Entry *e = NULL;
+    kvm_ref_t *link = bloom_maybe(db, h) ? kvm_find(db, h, key, klen, &e) : NULL;
+    int ret = -1;
+    if (link) {
+        int expired = entry_expired(e, e->flags, kvm_clock());
+        ret = kvm_unlink(db, h, link) != 0 || expired ? -1 : 0;
+    }
+    kvm_count(c, ret == 0 ? KVMCOUT : KVMCOUTMISS);
+    return ret;
+}
+
+int kvm_delete2(KVM *db, const void *kbuf, uint32_t klen) {
+    if (!(db->omode & KVMOWRITER)) return -1;
+    kvm_wlock(db);
+    int ret = kvm_delete_locked(db, kbuf, klen);
+    kvm_wunlock(db);
+    return ret;
+}
+
+int kvm_delete(KVM *db, const char *key) {
+    return kvm_delete2(db, key, strlen(key));
+}
+
+/* ========== 期限切れの掃除（kvm_sweep） ========== */
+/* 読まれないまま期限が切れたキーは、領域を古い順に辿って索引から外す。
+ * 書き手の mutex は SWEEP_STEP 件ごとに手放すので、その間も put / delete は進む */
+#define SWEEP_STEP 4096
+
+/* 領域を一巡して期限切れを外す。戻り値は外した件数。コンパクション中は何もせず、
+ * 途中で領域が入れ替わったら（KVMTCACHE の追い出しも）そこで止める */
+int64_t kvm_sweep(KVM *db) {
+    kvm_wlock(db);
+    if (!db->mem || !(db->omode & KVMOWRITER)) {
+        kvm_wunlock(db);
+        return -1;
+    }
+    int64_t n = 0;
+    uint64_t gen = db->gen;
+    size_t pos = kvm_walk_start(db), end = db->write_pos;
+    uint32_t now = kvm_clock();
+    while (pos != end && db->gen == gen && !atomic_load(&db->compact_state)) {
+        for (int i = 0; i < SWEEP_STEP && pos != end; i++) {
+            Entry *e = (Entry*)(db->mem + pos);
+            size_t at = pos;
+            pos = kvm_walk_next(db, pos);
+            if ((e->flags & (EF_BLOB | EF_DEAD | EF_STALE)) || !entry_expired(e, e->flags, now)) continue;
+            uint64_t h = kvm_hash(e->data, e->klen);
+            kvm_ref_t *link = kvm_find(db, h, e->data, e->klen, NULL);
+            if (link && *link == REF(at) && kvm_unlink(db, h, link) == 0) n++;
+        }
+        kvm_wunlock(db);
+        kvm_wlock(db);
+    }
+    kvm_wunlock(db);
+    return n;
+}
+
+static void *kvm_sweep_main(void *arg) {
+    KVM *db = arg;
+    KVMSWEEP *sw = db->sweep;
+    pthread_mutex_lock(&sw->mtx);
+    while (!sw->quit) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += sw->ms / 1000;
+        ts.tv_nsec += (long)(sw->ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_cond_timedwait(&sw->cond, &sw->mtx, &ts);
+        if (sw->quit) break;
+        pthread_mutex_unlock(&sw->mtx);
+        kvm_sweep(db);
+        pthread_mutex_lock(&sw->mtx);
+    }
+    pthread_mutex_unlock(&sw->mtx);
+    return NULL;
+}
+
+/* kvm_open 前に呼ぶ。書き手で開いている間、ms ミリ秒ごとに kvm_sweep するスレッドを付ける。
+ * 他のスレッドと同じ DB を触るので kvm_setmutex が先に要る */
+int kvm_setsweep(KVM *db, int ms) {
+    if (db->mem || !db->sync || ms <= 0) return -1;
+    if (!db->sweep) {
+        KVMSWEEP *sw = calloc(1, sizeof(KVMSWEEP));
+        if (!sw) return -1;
+        pthread_mutex_init(&sw->mtx, NULL);
+        pthread_cond_init(&sw->cond, NULL);
+        db->sweep = sw;
+    }
+    db->sweep->ms = ms;
+    return 0;
+}
+
+static int kvm_sweep_start(KVM *db) {
+    KVMSWEEP *sw = db->sweep;
+    if (!sw || !(db->omode & KVMOWRITER)) return 0;
+    sw->quit = 0;
+    if (pthread_create(&sw->thread, NULL, kvm_sweep_main, db) != 0) return -1;
+    sw->running = 1;
+    return 0;
+}
+
+static void kvm_sweep_stop(KVM *db) {
+    KVMSWEEP *sw = db->sweep;
+    if (!sw || !sw->running) return;
+    pthread_mutex_lock(&sw->mtx);
+    sw->quit = 1;
+    pthread_cond_signal(&sw->cond);
+    pthread_mutex_unlock(&sw->mtx);
+    pthread_join(sw->thread, NULL);
+    sw->running = 0;
+}
+
+/* ========== シャード（KVMS） ========== */
+/* キーをハッシュの上位 16bit で nshards 個の独立した KVM に振り分ける。上位ビットは
+ * バケット番号（下位ビット）、ラインの tag（32〜39bit）、Bloom のブロック（下位 32bit）の
+ * どれとも重ならないので、シャードの中での散らばりは崩れない。
+ * シャードごとに専用のスレッドを CPU に固定して付け、kvms_putbatch はシャードごとに
+ * 分けた束をその持ち主に書かせる（シャード間で何も共有しない）。単発の kvms_put2 などは
+ * 呼び出したスレッドで直接書く。シャードは kvm_setmutex 済みなので持ち主と並んでも安全。
+ * kvms_setnuma すると各シャードの領域を持ち主の CPU のノードに置く */
+#define KVMS_MAX 256
+
+typedef struct {
+    KVM *db;
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    /* 束の受け渡しと完了通知の両方に使う */
+    const KVMREC **job;     /* 持ち主に渡した束（NULL なら空き） */
+    int64_t njob;
+    int ret;
+    int quit;
+    int cpu;
+    int rep_ms;             /* 写しを写し直す間隔（0 なら写さない） */
+} KVMSHARD;
+
+struct KVMS {
+    int nshards;
+    KVMSHARD *shard;
+    int running;            /* 持ち主のスレッドが動いているか */
+    int rep_ms;             /* kvms_setnuma の replica_ms */
+};
+
+/* シャード i の持ち主を固定する CPU は i % kvms_ncpu() */
+static int kvms_ncpu(void) {
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+}
+
+static inline int kvms_route(const KVMS *s, const void *kbuf, uint32_t klen) {
+    return (int)(((kvm_hash(kbuf, klen) >> 48) * (uint64_t)s->nshards) >> 16);
+}
+
+KVMS *kvms_new(int nshards) {
+    if (nshards < 1) nshards = 1;
+    if (nshards > KVMS_MAX) nshards = KVMS_MAX;
+    KVMS *s = calloc(1, sizeof(KVMS));
+    s->nshards = nshards;
+    s->shard = calloc(nshards, sizeof(KVMSHARD));
+    for (int i = 0; i < nshards; i++) {
+        s->shard[i].db = kvm_new();
+        kvm_setmutex(s->shard[i].db);
+    }
+    return s;
+}
+
+/* bnum と expected は全体での目安。シャード数で割って各 KVM に渡す */
+int kvms_tune(KVMS *s, int64_t bnum, int opts) {
+    for (int i = 0; i < s->nshards; i++)
+        if (kvm_tune(s->shard[i].db, bnum > 0 ? bnum / s->nshards + 1 : 0, opts) != 0) return -1;
+    return 0;
+}
+
+int kvms_setbloom(KVMS *s, int64_t expected, double fpr) {
+    for (int i = 0; i < s->nshards; i++)
+        if (kvm_setbloom(s->shard[i].db, expected > 0 ? expected / s->nshards + 1 : 0, fpr) != 0)
+            return -1;
+    return 0;
+}
+
+/* kvms_open 前に呼ぶ。各シャードの領域（データ・索引表・Bloom）を持ち主の CPU の
+ * ノードに置き、持ち主もそのノードからメモリを取る。replica_ms が正なら各シャードに
+ * kvm_setreplica し、持ち主が replica_ms ミリ秒ごとに古くなった写しを写し直す
+ * （読みの多いシャードを他のノードのスレッドからも引く時に）。NUMA の無いビルドでは -1 */
+int kvms_setnuma(KVMS *s, int replica_ms) {
+    if (s->running) return -1;
+    int ncpu = kvms_ncpu();
+    for (int i = 0; i < s->nshards; i++) {
+        KVM *db = s->shard[i].db;
+        if (kvm_setnode(db, kvm_cpu_node(i % ncpu)) != 0) return -1;
+        if (replica_ms > 0 && !db->rep && kvm_setreplica(db) != 0) return -1;
+    }
+    s->rep_ms = replica_ms > 0 ? replica_ms : 0;
+    return 0;
+}
+
+/* 全シャードの写しを今すぐ写し直す */
+int kvms_replicate(KVMS *s) {
+    int ret = 0;
+    for (int i = 0; i < s->nshards; i++)
+        if (kvm_replicate(s->shard[i].db) != 0) ret = -1;
+    return ret;
+}
+
+static void *kvms_worker(void *arg) {
+    KVMSHARD *sh = arg;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    if (sh->db->node >= 0) kvm_policy_set(sh->db->node, NULL);
+    pthread_mutex_lock(&sh->mtx);
+    for (;;) {
+        while (!sh->job && !sh->quit) {
+            if (!sh->rep_ms) {
+                pthread_cond_wait(&sh->cond, &sh->mtx);
+                continue;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += sh->rep_ms / 1000;
+            ts.tv_nsec += (long)(sh->rep_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+            if (pthread_cond_timedwait(&sh->cond, &sh->mtx, &ts) == ETIMEDOUT) {
+                pthread_mutex_unlock(&sh->mtx);
+                kvm_replicate(sh->db);
+                pthread_mutex_lock(&sh->mtx);
+            }
+        }
+        if (!sh->job) break;
+        const KVMREC **job = sh->job;
+        int64_t n = sh->njob;
+        pthread_mutex_unlock(&sh->mtx);
+        int ret = 0;
+        for (int64_t i = 0; i < n; i++)
+            if (kvm_put2(sh->db, job[i]->kbuf, job[i]->klen, job[i]->vbuf, job[i]->vlen) != 0) ret = -1;
+        pthread_mutex_lock(&sh->mtx);
+        sh->ret = ret;
+        sh->job = NULL;
+        pthread_cond_broadcast(&sh->cond);
+    }
+    pthread_mutex_unlock(&sh->mtx);
+    return NULL;
+}
+
+static void kvms_stop(KVMS *s) {
+    if (!s->running) return;
+    for (int i = 0; i < s->nshards; i++) {
+        KVMSHARD *sh = &s->shard[i];
+        pthread_mutex_lock(&sh->mtx);
+        sh->quit = 1;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->mtx);
+        pthread_join(sh->thread, NULL);
+        pthread_mutex_destroy(&sh->mtx);
+        pthread_cond_destroy(&sh->cond);
+    }
+    s->running = 0;
+}
+
+/* path が NULL なら全シャードをメモリ上に、そうでなければ "path.<番号>" に作る。
+ * 開き直す時は同じシャード数で開くこと */
+int kvms_open(KVMS *s, const char *path, int omode) {
+    if (s->running) return -1;
+    char *name = path ? malloc(strlen(path) + 16) : NULL;
+    int i, ncpu = kvms_ncpu();
+    for (i = 0; i < s->nshards; i++) {
+        if (name) sprintf(name, "%s.%d", path, i);
+        if (kvm_open(s->shard[i].db, name, omode) != 0) break;
+    }
+    free(name);
+    if (i < s->nshards) {
+        while (i-- > 0) kvm_close(s->shard[i].db);
+        return -1;
+    }
+    for (i = 0; i < s->nshards; i++) {
+        KVMSHARD *sh = &s->shard[i];
+        pthread_mutex_init(&sh->mtx, NULL);
+        pthread_cond_init(&sh->cond, NULL);
+        sh->job = NULL;
+        sh->quit = 0;
+        sh->cpu = i % ncpu;
+        sh->rep_ms = s->rep_ms;
+        pthread_create(&sh->thread, NULL, kvms_worker, sh);
+    }
+    s->running = 1;
+    return 0;
+}
+
+int kvms_sync(KVMS *s) {
+    int ret = 0;
+    for (int i = 0; i < s->nshards; i++)
+        if (kvm_sync(s->shard[i].db) != 0) ret = -1;
+    return ret;
+}
+
+void kvms_close(KVMS *s) {
+    kvms_stop(s);
+    for (int i = 0; i < s->nshards; i++) kvm_close(s->shard[i].db);
+}
+
+void kvms_del(KVMS *s) {
+    if (!s) return;
+    kvms_close(s);
+    for (int i = 0; i < s->nshards; i++) kvm_del(s->shard[i].db);
+    free(s->shard);
+    free(s);
+}
+
+int kvms_put2(KVMS *s, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen) {
+    return kvm_put2(s->shard[kvms_route(s, kbuf, klen)].db, kbuf, klen, vbuf, vlen);
+}
+
+void *kvms_get2(KVMS *s, const void *kbuf, uint32_t klen, uint32_t *vlen) {
+    return kvm_get2(s->shard[kvms_route(s, kbuf, klen)].db, kbuf, klen, vlen);
+}
+
+int kvms_delete2(KVMS *s, const void *kbuf, uint32_t klen) {
+    return kvm_delete2(s->shard[kvms_route(s, kbuf, klen)].db, kbuf, klen);
+}
+
+int kvms_put(KVMS *s, const char *key, const char *value) {
+    return kvms_put2(s, key, strlen(key), value, strlen(value));
+}
+
+char *kvms_get(KVMS *s, const char *key) {
+    return kvms_get2(s, key, strlen(key), NULL);
+}
+
+/* キーを持つシャード。kvm_get_view などシャードに無い口はこれに対して呼ぶ */
+KVM *kvms_shard(KVMS *s, const void *kbuf, uint32_t klen) {
+    return s->shard[kvms_route(s, kbuf, klen)].db;
+}
+
+size_t kvms_count(KVMS *s) {
+    size_t n = 0;
+    for (int i = 0; i < s->nshards; i++) n += s->shard[i].db->count;
+    return n;
+}
+
+/* n 件をシャードごとの束に分け（安定な計数ソート）、それぞれの持ち主に並行して書かせる。
+ * 全シャードが書き終わるまで戻らない。呼ぶのは一度に1スレッドから */
+int kvms_putbatch(KVMS *s, const KVMREC *recs, int64_t n) {
+    if (!s->running || n < 0) return -1;
+    const KVMREC **part = malloc((n + 1) * sizeof(KVMREC*));
+    uint8_t *sid = malloc(n + 1);
+    int64_t *start = calloc(s->nshards + 1, sizeof(int64_t));
+    if (!part || !sid || !start) { free(part); free(sid); free(start); return -1; }
+    for (int64_t i = 0; i < n; i++) {
+        sid[i] = kvms_route(s, recs[i].kbuf, recs[i].klen);
+        start[sid[i] + 1]++;
+    }
+    for (int i = 0; i < s->nshards; i++) start[i + 1] += start[i];
+    int64_t *fill = malloc(s->nshards * sizeof(int64_t));
+    memcpy(fill, start, s->nshards * sizeof(int64_t));
+    for (int64_t i = 0; i < n; i++) part[fill[sid[i]]++] = &recs[i];
+    free(fill);
+    free(sid);
+    for (int i = 0; i < s->nshards; i++) {
+        KVMSHARD *sh = &s->shard[i];
+        if (start[i + 1] == start[i]) continue;
+        pthread_mutex_lock(&sh->mtx);
+        while (sh->job) pthread_cond_wait(&sh->cond, &sh->mtx);
+        sh->job = part + start[i];
+        sh->njob = start[i + 1] - start[i];
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->mtx);
+    }
+    int ret = 0;
+    for (int i = 0; i < s->nshards; i++) {
+        KVMSHARD *sh = &s->shard[i];
+        if (start[i + 1] == start[i]) continue;
+        pthread_mutex_lock(&sh->mtx);
+        while (sh->job == part + start[i]) pthread_cond_wait(&sh->cond, &sh->mtx);
+        if (sh->ret) ret = -1;
+        pthread_mutex_unlock(&sh->mtx);
+    }
+    free(start);
+    free(part);
+    return ret;
+}
+
@@ -0,0 +1,376 @@
+/*
+ * 自作KVM（Tokyo Cabinet の tchdb に倣った API）
+ *
+ * 構造体は tchdb.h と同じく中身まで見せる（ベンチマークが件数や使用量を直接読む）。
+ * 触ってよいのは読むことだけで、書き換えは kvm_* を通す。
+ *
+ * ビルド時に決める物（CMakeLists.txt の変種はこれを -D で渡すだけ）:
+ *   KVM_OFF64    索引と Entry.next の参照を 64bit のバイト位置にする
+ *                （既定は 8 バイト単位の 32bit で最大 32GB）
+ *   KVM_BLOOM    0 なら新しい DB に Bloom を作らず、引く時も見ない
+ *   KVM_INDEX    0: 索引の形を kvm_tune の KVMTLINE で選ぶ、1: チェーンだけ、
+ *                2: KVMTLINE だけ（もう片方の分岐をコンパイルで落とす）
+ *   POOL_SIZE / BUCKET_COUNT / LOAD_FACTOR も -D で上書きできる（kvm.c）
+ * 参照の幅と索引の形はファイルのヘッダに残るので、合わない変種では開けない
+ */
+#ifndef KVM_H
+#define KVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__has_include) && __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define KVM_URING               /* kvm_get_async が io_uring を使う（liburing は要らない） */
+#endif
+#if defined(__has_include) && __has_include(<linux/mempolicy.h>) && defined(__NR_mbind) && \
+    defined(__NR_set_mempolicy) && defined(__NR_getcpu)
+#define KVM_NUMA                /* kvm_setnode / kvm_setreplica が mbind を使う（libnuma は要らない） */
+#endif
+#endif
+
+#ifndef KVM_BLOOM
+#define KVM_BLOOM 1
+#endif
+#ifndef KVM_INDEX
+#define KVM_INDEX 0
+#endif
+
+/* 索引と Entry.next に入れるエントリの参照。既定はエントリが 8 バイト境界に
+ * 揃っていることを使って「位置 / 8」を 32bit で持つ（最大 32GB）。
+ * -DKVM_OFF64 ならバイト位置をそのまま 64bit で持つ */
+#ifdef KVM_OFF64
+typedef uint64_t kvm_ref_t;
+#define REF_SHIFT 0
+#define REF_MAX ((size_t)1 << 40)
+#else
+typedef uint32_t kvm_ref_t;
+#define REF_SHIFT 3
+#define REF_MAX ((size_t)1 << 35)
+#endif
+
+#ifdef KVM_OFF64
+#define LINE_SLOTS 7                  /* KVMTLINE: 1ライン(64B)あたりのスロット数 */
+#define LINE_TAGS 8
+#define LINE_LOAD 5                   /* KVMTLINE: count > ライン数 * LINE_LOAD で倍に拡張 */
+#else
+#define LINE_SLOTS 12
+#define LINE_TAGS 16
+#define LINE_LOAD 9
+#endif
+
+/* kvm_tune の opts */
+enum {
+    KVMTLINE = 1 << 0,      /* キャッシュライン単位のオープンアドレス索引 */
+    KVMTLZ = 1 << 1,        /* COMP_MIN 以上の値を圧縮して置く（HDBTDEFLATE 相当） */
+    KVMTTIER = 1 << 2,      /* 値を別の値ファイルに置いて pread で読む（パス指定時のみ） */
+    KVMTCACHE = 1 << 3      /* 領域を kvm_setlimit の大きさで止め、古い順に追い出して使い回す */
+};
+
+/* kvm_open: パス指定時のオープンモード（NULL ならファイルを持たないメモリ上の DB） */
+enum { KVMOREADER = 1 << 0, KVMOWRITER = 1 << 1, KVMOCREAT = 1 << 2, KVMOTRUNC = 1 << 3 };
+
+#define HDR_SIZE 4096                 /* 先頭のヘッダ領域（ページ単位） */
+
+/* Entry.flags */
+enum {
+    EF_BLOB = 1 << 0,       /* 索引表を格納する領域（キーを持たない） */
+    EF_DEAD = 1 << 1,       /* kvm_delete された（トゥームストーン） */
+    EF_STALE = 1 << 2,      /* 入り切らない更新で新しい Entry に置き換えられた */
+    EF_LZ = 1 << 3,         /* 値を圧縮して置いている（KVMTLZ） */
+    EF_DICT = 1 << 4,       /* 圧縮に kvm_setdict の辞書を使った */
+    EF_COLD = 1 << 5,       /* 値は値ファイルにあり、ここには位置（8 バイト）だけを置く */
+    EF_TTL = 1 << 6,        /* Entry の末尾 4 バイトに期限（UNIX 時刻の秒）がある */
+    EF_REF = 1 << 7         /* KVMTCACHE: 前回の追い出しの後に読まれた（CLOCK の参照ビット） */
+};
+
+/* size はパディング込みの Entry 全体の大きさ。値を縮めてその場で上書きしても
+ * 変わらないので、データ領域を先頭から辿る時にも使える */
+typedef struct {
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t size;
+    uint32_t flags;
+    kvm_ref_t next;
+    char data[];
+} Entry;
+
+/* KVMTLINE の索引ライン。tag: 0=空, 1=削除済み, 2以上=ハッシュの 32〜39bit。
+ * このモードでは Entry.next は使わない */
+typedef struct {
+    uint8_t tag[LINE_TAGS]; /* 先頭 LINE_SLOTS 個を使用（SSE2 で 16 バイト一括比較） */
+    kvm_ref_t off[LINE_SLOTS];
+} __attribute__((aligned(64))) Line;
+
+_Static_assert(sizeof(Line) == 64, "Line は 1 キャッシュライン");
+
+/* kvm_compact_wait / kvm_optimize の結果（tchdboptimize の前後比較に相当） */
+typedef struct {
+    size_t before;          /* コンパクション前の使用量（write_pos） */
+    size_t after;
+    size_t reclaimed;       /* before - after（増えた時は 0） */
+    double seconds;         /* 別スレッドでのコピーにかかった時間 */
+} KVMCOMPACT;
+
+/* kvm_bulk_load に渡す1レコード */
+typedef struct {
+    const void *kbuf;
+    uint32_t klen;
+    const void *vbuf;
+    uint32_t vlen;
+} KVMREC;
+
+/* kvm_stats の操作の数え（KVMSTAT.op の添字）。kvm_get 系・kvm_mget・kvm_get_async で
+ * 引いた 1 キーは HIT / MISS / BLOOM / EXPIRED のどれか 1 つに数える（書き手と重なって
+ * 引き直した時はもう一度数える） */
+enum {
+    KVMCHIT,                /* 見つかった */
+    KVMCMISS,               /* Bloom は通ったが索引に無かった（Bloom があれば偽陽性） */
+    KVMCBLOOM,              /* Bloom で落とした（索引を見ていない） */
+    KVMCEXPIRED,            /* 見つかったが期限切れ */
+    KVMCPUT,                /* kvm_put 系・kvm_bulk_load の 1 件 */
+    KVMCOUT,                /* kvm_delete 系で消した */
+    KVMCOUTMISS,            /* kvm_delete 系で無かった */
+    KVMCNUM
+};
+
+#define KVM_NODES 64                  /* kvm_setnode / kvm_setreplica が扱う NUMA ノードの数の上限 */
+#define KVM_HIST 16                   /* KVMSTAT.hist の欄の数。最後の欄はそれ以上をまとめる */
+
+/* kvm_stats の結果 */
+typedef struct {
+    size_t count;
+    size_t mem_size;
+    size_t write_pos;
+    size_t live_bytes;
+    size_t dead_bytes;
+    size_t nbuckets;        /* 今の索引表のバケット数（KVMTLINE ならライン数） */
+    double load;            /* count / 枠の数（KVMTLINE はライン数 * LINE_SLOTS） */
+    /* チェーン: 長さ i のバケットの数。KVMTLINE: 家のラインから i 本先に置かれたキーの数。
+     * 拡張の移行中は旧表に残っている分も入れる */
+    uint64_t hist[KVM_HIST];
+    size_t hist_max;        /* 一番長いチェーン（KVMTLINE は一番遠いキー） */
+    double probe;           /* 見つかる get 1 回で照合する Entry（KVMTLINE は見るライン）の平均 */
+    size_t tombs;           /* KVMTLINE の削除済みスロット */
+    size_t bloom_bytes;     /* 0 なら Bloom 無し */
+    double bloom_fill;      /* 立っているビットの割合 */
+    double bloom_fpr;       /* 今のビットから見積もった偽陽性率（Bloom を引かなければ 1） */
+    uint64_t op[KVMCNUM];   /* スレッドごとの数えの合計 */
+    int threads;            /* 数えを持っているスレッドの数 */
+} KVMSTAT;
+
+typedef struct KVM KVM;
+typedef struct KVMSYNC KVMSYNC;
+typedef struct KVMORD KVMORD;
+typedef struct KVMCACHE KVMCACHE;
+typedef struct KVMSNAPS KVMSNAPS;
+typedef struct KVMSWEEP KVMSWEEP;
+typedef struct KVMSTATS KVMSTATS;
+typedef struct KVMREP KVMREP;
+
+struct KVM {
+    uint8_t *mem;
+    size_t mem_size;        /* 使える大きさ（ファイルならファイルサイズ） */
+    size_t map_size;        /* 予約した仮想アドレスの大きさ（POOL_MAX） */
+    int fd;                 /* ファイルを持たなければ -1 */
+    int omode;
+    char *path;
+    uint64_t *bloom;        /* 64 バイトのブロックを bloom_blocks 個 */
+    size_t bloom_blocks;
+    int64_t bloom_expected;
+    double bloom_fpr;
+    size_t data_off;        /* Bloom の後ろ、データ領域の開始位置 */
+    int opts;
+    kvm_ref_t *buckets;     /* 現在のバケット表 */
+    Line *lines;            /* KVMTLINE 時は buckets の代わりにこちらを使う */
+    size_t nbuckets;        /* KVMTLINE 時はライン数 */
+    kvm_ref_t *old_buckets; /* 拡張中の旧バケット表（拡張中でなければ NULL） */
+    Line *old_lines;
+    size_t old_nbuckets;
+    size_t rehash_pos;      /* 旧バケット表で移行済みのバケット数 */
+    size_t write_pos;
+    size_t count;           /* 生きているキーの数 */
+    size_t live_bytes;      /* 生きている Entry と使用中の索引表のバイト数 */
+    size_t dead_bytes;      /* 削除・置き換え済みの Entry と使い終わった索引表 */
+    /* コンパクション中は compact_dst に別スレッドで書き出す。
+     * その間 mem 側は誰も書き換えないので kvm_get はそのまま読める */
+    pthread_t compact_thread;
+    KVM *compact_dst;
+    atomic_int compact_state; /* 0: なし, 1: コピー中, 2: コピー済み（入れ替え待ち） */
+    int compact_err;
+    double compact_sec;
+    KVMSYNC *sync;          /* kvm_setmutex していなければ NULL */
+    KVMORD *ord;            /* kvm_setorder していなければ NULL */
+    uint64_t gen;           /* 領域を入れ替える・作り直すたびに増やす（KVMITER が気付くため） */
+    const uint8_t *dict;    /* 圧縮の辞書（領域内の EF_BLOB を指す）。無ければ NULL */
+    uint32_t dict_len;
+    /* KVMTTIER の値ファイルと読みキャッシュ */
+    int vfd;                /* 値ファイル（使わなければ -1） */
+    uint64_t vlog_pos;
+    uint64_t vlog_seq;
+    size_t cache_bytes;     /* kvm_setcache の上限 */
+    KVMCACHE *cache;
+    size_t pinned;          /* mlock できた領域の先頭からのバイト数 */
+    KVMSNAPS *snaps;        /* kvm_snapshot を一度も呼んでいなければ NULL */
+    /* KVMTCACHE の輪。Entry は [ring_head, ring_wend) と [ring_off, write_pos) の順に古い。
+     * 先頭に戻っていなければ [ring_head, write_pos) だけ */
+    size_t limit;           /* kvm_setlimit の上限 */
+    size_t ring_off;
+    size_t ring_head;
+    size_t ring_wend;
+    size_t tombs;           /* KVMTLINE で削除済み(1)にしたスロット数（組み直しの目安） */
+    KVMSWEEP *sweep;        /* kvm_setsweep していなければ NULL */
+    KVMSTATS *stats;        /* kvm_stats の数え（kvm_setstats(db, 0) なら NULL） */
+    int node;               /* kvm_setnode のノード（-1 なら決めない） */
+    KVMREP *rep;            /* kvm_setreplica していなければ NULL */
+};
+
+/* KVMTTIER の読みキャッシュ（中身は kvm.c の説明を参照） */
+typedef struct {
+    uint64_t off;           /* 値ファイル内の位置（これで引く） */
+    char *buf;              /* NULL なら空き */
+    uint32_t len;
+    uint8_t ref;
+    int32_t next;           /* 同じハッシュのチェーン（空きなら空きリスト） */
+} CSLOT;
+
+struct KVMCACHE {
+    pthread_mutex_t mtx;
+    size_t cap, used;
+    uint32_t mask, hand, nused;
+    int32_t free;
+    int32_t *head;          /* mask + 1 個 */
+    CSLOT *slot;            /* mask + 1 個。針はこの順に回る */
+    uint64_t hits, misses;
+};
+
+/* kvm_get_async のコールバック。見つからなければ vbuf は NULL */
+typedef void (*KVMGETCB)(const char *vbuf, uint32_t vlen, void *op);
+/* kvm_scan / kvm_prefix に渡すコールバック。0 を返すとそこで打ち切る（TCITER と同じ） */
+typedef int (*KVMSCANCB)(const char *kbuf, uint32_t klen, const char *vbuf, uint32_t vlen, void *op);
+
+typedef struct KVMAIO KVMAIO;
+typedef struct KVMITER KVMITER;
+typedef struct KVMSNAP KVMSNAP;
+typedef struct KVMS KVMS;
+
+/* 索引の形。KVM_INDEX を決めたビルドでは定数になる */
+#if KVM_INDEX == 0
+#define KVM_ISLINE(db) (((db)->opts & KVMTLINE) != 0)
+#else
+#define KVM_ISLINE(db) ((void)(db), KVM_INDEX == 2)
+#endif
+
+static inline size_t entry_size(uint32_t klen, uint32_t vlen) {
+    return (sizeof(Entry) + klen + vlen + 7) & ~(size_t)7;
+}
+
+static inline uint32_t kvm_clock(void) {
+    return (uint32_t)time(NULL);
+}
+
+static inline size_t table_bytes(KVM *db, size_t n) {
+    return n * (KVM_ISLINE(db) ? sizeof(Line) : sizeof(kvm_ref_t));
+}
+
+/* 作る・開く・閉じる */
+KVM *kvm_new(void);
+void kvm_del(KVM *db);
+int kvm_tune(KVM *db, int64_t bnum, int opts);
+int kvm_setbloom(KVM *db, int64_t expected, double fpr);
+int kvm_setmutex(KVM *db);
+int kvm_setorder(KVM *db);
+int kvm_setcache(KVM *db, size_t bytes);
+int kvm_setlimit(KVM *db, size_t bytes);
+int kvm_setsweep(KVM *db, int ms);
+int kvm_setstats(KVM *db, int on);
+int kvm_setnode(KVM *db, int node);
+int kvm_setreplica(KVM *db);
+int kvm_open(KVM *db, const char *path, int omode);
+int kvm_sync(KVM *db);
+void kvm_close(KVM *db);
+char *kvm_vlog_path(const char *path, uint64_t seq);
+
+/* 書く */
+int kvm_put2(KVM *db, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen);
+int kvm_put(KVM *db, const char *key, const char *value);
+int kvm_put_ttl2(KVM *db, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen, int ttl);
+int kvm_put_ttl(KVM *db, const char *key, const char *value, int ttl);
+int kvm_bulk_load(KVM *db, const KVMREC *recs, int64_t n);
+int kvm_setdict(KVM *db, const void *const *samples, const uint32_t *sizes, int n);
+int kvm_delete2(KVM *db, const void *kbuf, uint32_t klen);
+int kvm_delete(KVM *db, const char *key);
+int64_t kvm_sweep(KVM *db);
+
+/* 読む */
+void *kvm_get2(KVM *db, const void *kbuf, uint32_t klen, uint32_t *vlen);
+char *kvm_get(KVM *db, const char *key);
+int kvm_get_view(KVM *db, const char *key, uint32_t klen, const char **vp, uint32_t *sp);
+int kvm_get_into2(KVM *db, const void *kbuf, uint32_t klen, char *buf, int cap);
+int kvm_get_into(KVM *db, const char *key, char *buf, int cap);
+int kvm_mget(KVM *db, const char **keys, int n, char **out);
+
+/* 非同期の読み（KVMTTIER） */
+KVMAIO *kvm_aio_new(KVM *db, int depth);
+void kvm_aio_del(KVMAIO *aio);
+int kvm_aio_pending(KVMAIO *aio);
+int kvm_aio_poll(KVMAIO *aio, int min);
+int kvm_get_async2(KVMAIO *aio, const void *kbuf, uint32_t klen, KVMGETCB cb, void *op);
+int kvm_get_async(KVMAIO *aio, const char *key, KVMGETCB cb, void *op);
+int kvm_aio_mget(KVMAIO *aio, const char **keys, int n, char **out);
+
+/* 走査 */
+int64_t kvm_scan2(KVM *db, const void *sbuf, uint32_t slen, const void *ebuf, uint32_t elen,
+                  KVMSCANCB cb, void *op);
+int64_t kvm_scan(KVM *db, const char *start, const char *end, KVMSCANCB cb, void *op);
+int64_t kvm_prefix2(KVM *db, const void *pbuf, uint32_t plen, KVMSCANCB cb, void *op);
+int64_t kvm_prefix(KVM *db, const char *prefix, KVMSCANCB cb, void *op);
+KVMITER *kvm_iter_new(KVM *db);
+void kvm_iter_del(KVMITER *it);
+int kvm_iter_next(KVMITER *it, const char **kp, uint32_t *ksp, const char **vp, uint32_t *vsp);
+int64_t kvm_foreach(KVM *db, KVMSCANCB cb, void *op);
+
+/* スナップショット */
+KVMSNAP *kvm_snapshot(KVM *db);
+void kvm_snap_del(KVMSNAP *sn);
+void *kvm_snap_get2(KVMSNAP *sn, const void *kbuf, uint32_t klen, uint32_t *vlen);
+char *kvm_snap_get(KVMSNAP *sn, const char *key);
+int64_t kvm_snap_foreach(KVMSNAP *sn, KVMSCANCB cb, void *op);
+
+/* NUMA ノードごとの写し */
+int kvm_replicate(KVM *db);
+int kvm_numa_nodes(void);
+int kvm_thread_node(void);
+
+/* 統計 */
+int kvm_stats(KVM *db, KVMSTAT *st);
+
+/* コンパクション */
+int kvm_compact_start(KVM *db);
+int kvm_compact_done(KVM *db);
+int kvm_compact_wait(KVM *db, KVMCOMPACT *st);
+int kvm_optimize(KVM *db, KVMCOMPACT *st);
+
+/* シャード */
+KVMS *kvms_new(int nshards);
+void kvms_del(KVMS *s);
+int kvms_tune(KVMS *s, int64_t bnum, int opts);
+int kvms_setbloom(KVMS *s, int64_t expected, double fpr);
+int kvms_setnuma(KVMS *s, int replica_ms);
+int kvms_replicate(KVMS *s);
+int kvms_open(KVMS *s, const char *path, int omode);
+int kvms_sync(KVMS *s);
+void kvms_close(KVMS *s);
+int kvms_put2(KVMS *s, const void *kbuf, uint32_t klen, const void *vbuf, uint32_t vlen);
+void *kvms_get2(KVMS *s, const void *kbuf, uint32_t klen, uint32_t *vlen);
+int kvms_delete2(KVMS *s, const void *kbuf, uint32_t klen);
+int kvms_put(KVMS *s, const char *key, const char *value);
+char *kvms_get(KVMS *s, const char *key);
+size_t kvms_count(KVMS *s);
+KVM *kvms_shard(KVMS *s, const void *kbuf, uint32_t klen);
+int kvms_putbatch(KVMS *s, const KVMREC *recs, int64_t n);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * 書き手が閉じずに落ちたファイルを開き直せるかの確認。
+ *   子プロセスで書いて kvm_sync し、その後も書いてから _exit する（kvm_close しない）。
+ *   親は読み手と書き手で開き直し、sync の前後に書いた物・消した物・上書きした物が
+ *   そのとおりに見えるかを見る。書き手が開いている間の読み手は flock で断られる。
+ *   ./test_recover [作業ディレクトリ(デフォルト:.)]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "kvm.h"
+
+#define NKEYS 20000
+
+static int fails;
+
+#define CHECK(c, ...) do { if (!(c)) { printf("  NG: " __VA_ARGS__); printf("\n"); fails++; } } while (0)
+
+static void key_of(int i, char *k) { sprintf(k, "key%08d", i); }
+
+/* i 番目のキーの版 ver の値。LZ で縮むように長めに繰り返す */
+static void val_of(int i, int ver, char *v) {
+    int n = sprintf(v, "{\"id\":%d,\"ver\":%d,\"body\":\"", i, ver);
+    for (int j = 0; j < 6; j++) n += sprintf(v + n, "value-%d-%d-", i, ver);
+    sprintf(v + n, "\"}");
+}
+
+/* 期待する状態: 0..NKEYS-1 のうち 3 の倍数は消し、5 の倍数は上書き（ver 1）。
+ * sync の後に NKEYS..NKEYS*3/2 を足し、7 の倍数を上書き（ver 2）する */
+static int want_ver(int i, int after) {
+    if (i >= NKEYS) return after ? 0 : -1;
+    if (i % 3 == 0) return -1;
+    if (after && i % 7 == 0) return 2;
+    return i % 5 == 0 ? 1 : 0;
+}
+
+static void writer_crash(const char *path, int opts, int after) {
+    KVM *db = kvm_new();
+    kvm_tune(db, 1024, opts);   /* 小さく始めて索引表の拡張も途中で起こす */
+    if (kvm_open(db, path, KVMOWRITER | KVMOCREAT | KVMOTRUNC) != 0) _exit(2);
+    char k[32], v[256];
+    for (int i = 0; i < NKEYS; i++) {
+        key_of(i, k);
+        val_of(i, 0, v);
+        kvm_put(db, k, v);
+    }
+    for (int i = 0; i < NKEYS; i++) {
+        key_of(i, k);
+        if (i % 3 == 0) kvm_delete(db, k);
+        else if (i % 5 == 0) { val_of(i, 1, v); kvm_put(db, k, v); }
+    }
+    if (kvm_sync(db) != 0) _exit(3);
+    if (after) {
+        for (int i = NKEYS; i < NKEYS * 3 / 2; i++) {
+            key_of(i, k);
+            val_of(i, 0, v);
+            kvm_put(db, k, v);
+        }
+        for (int i = 0; i < NKEYS; i += 7) {
+            if (i % 3 == 0) continue;
+            key_of(i, k);
+            val_of(i, 2, v);
+            kvm_put(db, k, v);
+        }
+    }
+    _exit(0);
+}
+
+static void verify(KVM *db, const char *what, int after) {
+    char k[32], v[256];
+    int bad = 0;
+    size_t live = 0;
+    for (int i = 0; i < NKEYS * 3 / 2; i++) {
+        key_of(i, k);
+        char *got = kvm_get(db, k);
+        int w = want_ver(i, after);
+        if (w >= 0) {
+            live++;
+            val_of(i, w, v);
+        }
+        if (w < 0 ? got != NULL : (!got || strcmp(got, v) != 0)) bad++;
+        free(got);
+    }
+    CHECK(bad == 0, "%s: %d keys differ", what, bad);
+    CHECK(db->count == live, "%s: count %zu, want %zu", what, db->count, live);
+}
+
+static void run(const char *dir, const char *name, int opts, int after) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/test_recover.kvm", dir);
+    printf("%s%s\n", name, after ? " (sync の後も書いて落ちる)" : " (sync の直後に落ちる)");
+    pid_t pid = fork();
+    if (pid == 0) writer_crash(path, opts, after);
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "writer exited with %d", status);
+
+    KVM *db = kvm_new();
+    CHECK(kvm_open(db, path, KVMOREADER) == 0, "reader open");
+    if (db->mem) {
+        verify(db, "reader", after);
+        /* 読み手は書き換えをファイルに残さないので、閉じてもまだ作り直しが要る */
+        kvm_close(db);
+    }
+    CHECK(kvm_open(db, path, KVMOWRITER) == 0, "writer open");
+    if (db->mem) {
+        verify(db, "writer", after);
+        /* 作り直した後も普通に書ける */
+        char k[32], v[256];
+        key_of(1, k);
+        val_of(1, 9, v);
+        CHECK(kvm_put(db, k, v) == 0, "put after recovery");
+        KVM *rd = kvm_new();
+        CHECK(kvm_open(rd, path, KVMOREADER) != 0, "reader open while a writer holds the file");
+        kvm_del(rd);
+        kvm_put(db, k, "x");
+        val_of(1, 0, v);
+        kvm_put(db, k, v);
+        kvm_close(db);
+    }
+    CHECK(kvm_open(db, path, KVMOREADER) == 0, "clean reopen");
+    if (db->mem) verify(db, "clean reopen", after);
+    kvm_del(db);
+    remove(path);
+    char *vp = kvm_vlog_path(path, 0);
+    remove(vp);
+    free(vp);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : ".";
+    static const struct { const char *name; int opts; } modes[] = {
+        { "chain", 0 }, { "line", KVMTLINE }, { "lz", KVMTLZ }, { "tier", KVMTTIER },
+    };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        for (int after = 0; after < 2; after++) run(dir, modes[m].name, modes[m].opts, after);
+    printf(fails ? "FAILED (%d)\n" : "OK\n", fails);
+    return fails != 0;
+}